@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "batch.hpp"
+
+// Jobs waiting for one worker. The owner takes from the back; others steal
+// from the front, so owner and thief rarely contend for the same end.
+struct t_queue {
+    std::mutex lock;
+    std::deque<std::size_t> jobs;
+};
+
+static bool pop_back(t_queue& q, std::size_t& job) {
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.jobs.empty()) {
+        return false;
+    }
+    job = q.jobs.back();
+    q.jobs.pop_back();
+    return true;
+}
+
+static bool pop_front(t_queue& q, std::size_t& job) {
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.jobs.empty()) {
+        return false;
+    }
+    job = q.jobs.front();
+    q.jobs.pop_front();
+    return true;
+}
+
+static void run_job(t_machine& m, const t_job& job, t_job_result& res) {
+    m.init();
+    auto stops = job.stop_pc < 0x10000 || job.stop_on_trap;
+    m.set_core(stops ? core_threaded : job.core);
+    m.load_program(job.image, job.load_addr);
+    m.set_program_counter(job.entry);
+    if (job.stop_pc < 0x10000) {
+        m.set_breakpoint(job.stop_pc, true);
+    }
+    if (job.stop_on_trap) {
+        m.set_idle_mode(idle_trap);
+    }
+    auto r = m.run_for(job.cycles);
+    if (r.ret < 0) {
+        res.stop = {stop_illegal, (m.get_program_counter() - 1) & 0xffff};
+    } else if (r.ret > 0) {
+        res.stop = m.get_stop();
+    } else {
+        res.stop = {stop_count, m.get_program_counter()};
+    }
+    res.registers = m.get_registers();
+    res.cycles = r.cycles;
+    res.steps = r.steps;
+    res.memory.resize(job.dump_len);
+    for (t_addr i = 0; i < job.dump_len; i++) {
+        res.memory[i] = m.read_memory((job.dump_addr + i) & 0xffff);
+    }
+}
+
+std::vector<t_job_result> run_batch(const std::vector<t_job>& jobs,
+                                    unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max(1u, std::min<unsigned>(threads, jobs.size()));
+    std::vector<t_job_result> results(jobs.size());
+    std::vector<t_queue> queues(threads);
+    // each worker starts with a contiguous share and steals once it is done
+    for (std::size_t i = 0; i < jobs.size(); i++) {
+        queues[i * threads / jobs.size()].jobs.push_back(i);
+    }
+
+    auto worker = [&](unsigned self) {
+        // a machine is large; one per worker, reused for each job
+        std::unique_ptr<t_machine> m(new t_machine);
+        std::size_t job = 0;
+        while (true) {
+            if (!pop_back(queues[self], job)) {
+                unsigned i = 1;
+                for (; i < threads; i++) {
+                    if (pop_front(queues[(self + i) % threads], job)) {
+                        break;
+                    }
+                }
+                if (i == threads) {
+                    // jobs are never added, so every queue stays empty
+                    return;
+                }
+            }
+            run_job(*m, jobs[job], results[job]);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& t : pool) {
+        t.join();
+    }
+    return results;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include "machine.hpp"
+
+// A program to run on a machine of its own. A job with a stop, at stop_pc
+// or an idle loop, runs on the threaded core whatever core it names: only
+// its checked instance stops there.
+struct t_job {
+    std::vector<char> image;
+    t_addr load_addr;
+    t_addr entry;
+    t_addr stop_pc; // breakpoint ending the job, 0x10000 if none
+    bool stop_on_trap; // end the job at an idle loop
+    t_cycles cycles; // budget
+    t_core core; // for a job without a stop
+    t_addr dump_addr; // memory to keep in the result
+    t_addr dump_len;
+};
+
+struct t_job_result {
+    t_stop stop; // stop_count once the budget is spent
+    t_registers registers;
+    t_cycles cycles;
+    unsigned long steps;
+    std::vector<char> memory; // from dump_addr
+};
+
+// Runs the jobs on a work-stealing pool of threads, all hardware threads
+// if 0 are given. Results are in the order of the jobs.
+std::vector<t_job_result> run_batch(const std::vector<t_job>&, unsigned);
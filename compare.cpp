@@ -0,0 +1,306 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compare.hpp"
+
+// Lines of a file through a window mapped over it, moved along as the lines
+// run past its end. A line may not be longer than the window.
+class t_line_reader {
+    static const std::size_t window = std::size_t(1) << 24;
+
+    int fd;
+    off_t size;
+    off_t base; // file offset of map
+    std::size_t len;
+    char* map;
+    off_t pos; // of the next line
+
+    bool move(off_t);
+
+public:
+    t_line_reader(const std::string&);
+    ~t_line_reader();
+    bool good();
+    int next(const char*&, const char*&, off_t&);
+    std::string read(off_t, std::size_t);
+};
+
+t_line_reader::t_line_reader(const std::string& file)
+    : size(0), base(0), len(0), map(nullptr), pos(0) {
+    fd = open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        size = st.st_size;
+    }
+}
+
+t_line_reader::~t_line_reader() {
+    if (map) {
+        munmap(map, len);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool t_line_reader::good() {
+    return fd >= 0;
+}
+
+// maps the window starting at the page holding offset at, read in at once
+// rather than a fault per page
+bool t_line_reader::move(off_t at) {
+    if (map) {
+        munmap(map, len);
+        map = nullptr;
+    }
+    base = at & ~off_t(sysconf(_SC_PAGESIZE) - 1);
+    len = std::min<off_t>(window, size - base);
+    auto m = mmap(nullptr, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd,
+                  base);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    map = static_cast<char*>(m);
+    madvise(map, len, MADV_SEQUENTIAL);
+    return true;
+}
+
+// the next line without its end, and its offset; 0 at the end of the file,
+// -1 if it cannot be read
+int t_line_reader::next(const char*& begin, const char*& end, off_t& at) {
+    if (pos >= size) {
+        return 0;
+    }
+    if (!map || pos >= base + off_t(len)) {
+        if (!move(pos)) {
+            return -1;
+        }
+    }
+    begin = map + (pos - base);
+    end = static_cast<const char*>(
+        std::memchr(begin, '\n', map + len - begin));
+    if (!end && base + off_t(len) < size) {
+        if (!move(pos)) {
+            return -1;
+        }
+        begin = map + (pos - base);
+        end = static_cast<const char*>(
+            std::memchr(begin, '\n', map + len - begin));
+        if (!end && base + off_t(len) < size) {
+            return -1;
+        }
+    }
+    if (!end) {
+        end = map + len;
+    }
+    at = pos;
+    pos += end - begin + 1;
+    if (end > begin && end[-1] == '\r') {
+        end--;
+    }
+    return 1;
+}
+
+std::string t_line_reader::read(off_t at, std::size_t n) {
+    std::string s(n, 0);
+    auto got = pread(fd, &s[0], n, at);
+    s.resize(got < 0 ? 0 : got);
+    return s;
+}
+
+// a line of the reference; have flags the fields it gives
+struct t_ref {
+    enum { has_a = 1, has_x = 2, has_y = 4, has_p = 8, has_sp = 16,
+           has_cyc = 32 };
+    unsigned have;
+    unsigned pc;
+    unsigned a;
+    unsigned x;
+    unsigned y;
+    unsigned p;
+    unsigned sp;
+    unsigned long long cyc;
+};
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// false if the line does not start with a pc
+static bool parse_ref(const char* b, const char* e, t_ref& r) {
+    r.have = 0;
+    r.pc = 0;
+    int digits = 0;
+    for (; b != e && hex_digit(*b) >= 0; b++, digits++) {
+        r.pc = r.pc << 4 | hex_digit(*b);
+    }
+    if (digits == 0 || digits > 4) {
+        return false;
+    }
+    // the fields are found by their colons, the key being the letters
+    // before one back to a space
+    for (auto c = b; (c = static_cast<const char*>(
+                          std::memchr(c, ':', e - c))); ) {
+        unsigned key = 0;
+        auto k = c;
+        for (int n = 0; k > b && k[-1] != ' ' && n < 4; k--, n++) {
+        }
+        for (; k != c; k++) {
+            key = key << 8 | (*k | 0x20);
+        }
+        bool cyc = key == ('c' << 16 | 'y' << 8 | 'c');
+        unsigned long long v = 0;
+        auto value = ++c;
+        if (cyc) {
+            for (; c != e && *c >= '0' && *c <= '9'; c++) {
+                v = v * 10 + (*c - '0');
+            }
+        } else {
+            for (int d; c != e && (d = hex_digit(*c)) >= 0; c++) {
+                v = v << 4 | d;
+            }
+        }
+        if (c == value) {
+            continue;
+        }
+        switch (key) {
+        case 'a': r.a = v; r.have |= t_ref::has_a; break;
+        case 'x': r.x = v; r.have |= t_ref::has_x; break;
+        case 'y': r.y = v; r.have |= t_ref::has_y; break;
+        case 'p': r.p = v; r.have |= t_ref::has_p; break;
+        case 's' << 8 | 'p': r.sp = v; r.have |= t_ref::has_sp; break;
+        case 'c' << 16 | 'y' << 8 | 'c': r.cyc = v; r.have |= t_ref::has_cyc;
+            break;
+        }
+    }
+    return true;
+}
+
+// the first field of the machine that differs from the line, null if none
+static const char* compare_ref(const t_ref& r, const t_registers& m,
+                               unsigned long long cyc) {
+    if (r.pc != m.pc) {
+        return "pc";
+    }
+    if ((r.have & t_ref::has_a) && r.a != (unsigned char)(m.ra)) {
+        return "a";
+    }
+    if ((r.have & t_ref::has_x) && r.x != (unsigned char)(m.rx)) {
+        return "x";
+    }
+    if ((r.have & t_ref::has_y) && r.y != (unsigned char)(m.ry)) {
+        return "y";
+    }
+    if ((r.have & t_ref::has_p) && r.p != (unsigned char)(m.rp)) {
+        return "p";
+    }
+    if ((r.have & t_ref::has_sp) && r.sp != (unsigned char)(m.sp)) {
+        return "sp";
+    }
+    if ((r.have & t_ref::has_cyc) && r.cyc != cyc) {
+        return "cyc";
+    }
+    return nullptr;
+}
+
+static std::string machine_line(const t_registers& m,
+                                unsigned long long cyc) {
+    char line[64];
+    std::snprintf(line, sizeof(line),
+                  "%04lx  a:%02x x:%02x y:%02x p:%02x sp:%02x cyc:%llu",
+                  m.pc, (unsigned char)(m.ra), (unsigned char)(m.rx),
+                  (unsigned char)(m.ry), (unsigned char)(m.rp),
+                  (unsigned char)(m.sp), cyc);
+    return line;
+}
+
+// Runs at most max_steps steps, and stops at the first line that differs.
+// Only the offsets of the last few lines are kept, to read them back as
+// context.
+t_trace_diff compare_trace(t_machine& m, const std::string& file,
+                           unsigned long max_steps) {
+    const unsigned context_lines = 5;
+    t_trace_diff diff{compare_match, 0, 0, "", "", "", {}};
+    t_line_reader in(file);
+    if (!in.good()) {
+        diff.result = compare_bad_file;
+        return diff;
+    }
+    // the line read last and the context before it
+    const unsigned ring = context_lines + 1;
+    std::pair<off_t, std::size_t> recent[ring] = {};
+    const char* b;
+    const char* e;
+    off_t at;
+    t_ref r = {};
+    bool first = true;
+    unsigned long long cycle_base = 0;
+    int ret;
+    while ((ret = in.next(b, e, at)) > 0) {
+        diff.line++;
+        recent[diff.line % ring] = {at, std::size_t(e - b)};
+        if (b == e) {
+            continue;
+        }
+        if (!parse_ref(b, e, r)) {
+            diff.result = compare_bad_file;
+            break;
+        }
+        if (!first) {
+            if (diff.steps == max_steps) {
+                break;
+            }
+            diff.steps++;
+            if (m.step() < 0) {
+                diff.result = compare_illegal;
+                diff.expected.assign(b, e);
+                diff.actual = machine_line(m.get_registers(),
+                                           m.get_cycle_counter() + cycle_base);
+                break;
+            }
+        }
+        auto regs = m.get_registers();
+        if (first && (r.have & t_ref::has_cyc)) {
+            cycle_base = r.cyc - m.get_cycle_counter();
+        }
+        first = false;
+        auto cyc = m.get_cycle_counter() + cycle_base;
+        auto field = compare_ref(r, regs, cyc);
+        if (field) {
+            diff.result = compare_diverged;
+            diff.field = field;
+            diff.expected.assign(b, e);
+            diff.actual = machine_line(regs, cyc);
+            break;
+        }
+    }
+    if (ret < 0) {
+        diff.result = compare_bad_file;
+    }
+    if (diff.result == compare_match) {
+        return diff;
+    }
+    // the lines before this one, oldest first, leaving out blank ones
+    for (unsigned long l = diff.line > context_lines ?
+                           diff.line - context_lines : 1;
+         l < diff.line; l++) {
+        auto& c = recent[l % ring];
+        if (c.second) {
+            diff.context.push_back(in.read(c.first, c.second));
+        }
+    }
+    return diff;
+}
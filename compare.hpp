@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "machine.hpp"
+
+enum t_compare_result {
+    compare_match, // every line matched, or max_steps ran
+    compare_diverged, // the machine differs from a line
+    compare_illegal, // the machine hit an illegal opcode
+    compare_bad_file // the reference cannot be read or a line has no pc
+};
+
+struct t_trace_diff {
+    t_compare_result result;
+    unsigned long line; // of the reference, from 1; the last one compared
+    unsigned long steps; // steps run
+    std::string field; // the first one that differs: pc, a, x, y, p, sp, cyc
+    std::string expected; // the reference line
+    std::string actual; // the machine, in the format of decode_trace()
+    std::vector<std::string> context; // reference lines just before
+};
+
+// Steps the machine through a reference trace, one line per instruction as
+// in the format of nestest logs or decode_trace(): the pc first, then any
+// of A:, X:, Y:, P:, SP: in hex and CYC: in decimal, upper or lower case.
+// A line gives the state before its instruction, so the first is compared
+// before any step and each next one after a step(). Fields a line leaves
+// out are not compared; cycles count from the first line. The file is read
+// through a window mapped in turn over it, so it may be of any length.
+t_trace_diff compare_trace(t_machine&, const std::string&, unsigned long);
@@ -0,0 +1,920 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "jit.hpp"
+#include "opcodes.hpp"
+
+namespace {
+
+const std::size_t buf_size = 16u << 20;
+const std::size_t max_block_code = 16u << 10;
+// code rewritten this often is left to the interpreter
+const unsigned max_rewrites = 4;
+
+enum t_reg {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15
+};
+
+enum t_cond {
+    cc_o = 0x0, cc_c = 0x2, cc_nc = 0x3, cc_z = 0x4, cc_nz = 0x5, cc_l = 0xc
+};
+
+// host registers for the guest state
+const int r_ctx = rbx;
+const int r_mem = rbp;
+const int r_a = r12;
+const int r_x = r13;
+const int r_y = r14;
+const int r_p = r15;
+
+#define CTX(field) std::int32_t(offsetof(t_jit_ctx, field))
+
+// a minimal x86-64 encoder, just the forms the translator needs
+class t_emitter {
+public:
+    unsigned char* p;
+
+    void byte(int v) {
+        *p++ = v;
+    }
+
+    void dword(std::uint32_t v) {
+        std::memcpy(p, &v, 4);
+        p += 4;
+    }
+
+    void qword(std::uint64_t v) {
+        std::memcpy(p, &v, 8);
+        p += 8;
+    }
+
+    void opcode(int op) {
+        if (op > 0xff) {
+            byte(op >> 8);
+        }
+        byte(op & 0xff);
+    }
+
+    void rex(int w, int reg, int index, int base) {
+        int r = 0x40 | w << 3 | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+        if (r != 0x40) {
+            byte(r);
+        }
+    }
+
+    // op reg, rm with both operands in registers
+    void rr(int op, int reg, int rm, int w = 0) {
+        rex(w, reg, 0, rm);
+        opcode(op);
+        byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    // op reg, [base + index * (1 << scale) + disp]; index rsp means none
+    void rm(int op, int reg, int base, std::int32_t disp,
+            int index = rsp, int scale = 0, int w = 0) {
+        rex(w, reg, index, base);
+        opcode(op);
+        if (index == rsp && (base & 7) != rsp) {
+            byte(0x80 | (reg & 7) << 3 | (base & 7));
+        } else {
+            byte(0x84 | (reg & 7) << 3);
+            byte(scale << 6 | (index & 7) << 3 | (base & 7));
+        }
+        dword(disp);
+    }
+
+    void push(int reg) {
+        rex(0, 0, 0, reg);
+        byte(0x50 | (reg & 7));
+    }
+
+    void pop(int reg) {
+        rex(0, 0, 0, reg);
+        byte(0x58 | (reg & 7));
+    }
+
+    void mov_imm(int reg, std::uint32_t v) {
+        rex(0, 0, 0, reg);
+        byte(0xb8 | (reg & 7));
+        dword(v);
+    }
+
+    void mov_imm64(int reg, std::uint64_t v) {
+        rex(1, 0, 0, reg);
+        byte(0xb8 | (reg & 7));
+        qword(v);
+    }
+
+    // group 1 operation (add, or, adc, sbb, and, sub, xor, cmp) on a
+    // 32-bit register with an immediate
+    void alu_imm(int digit, int reg, std::int32_t v) {
+        if (v >= -0x80 && v < 0x80) {
+            rr(0x83, digit, reg);
+            byte(v);
+        } else {
+            rr(0x81, digit, reg);
+            dword(v);
+        }
+    }
+
+    void add_ctx(std::int32_t off, std::int32_t v) {
+        rm(0x81, 0, r_ctx, off, rsp, 0, 1);
+        dword(v);
+    }
+
+    unsigned char* jmp() {
+        byte(0xe9);
+        dword(0);
+        return p - 4;
+    }
+
+    unsigned char* jcc(int cc) {
+        byte(0x0f);
+        byte(0x80 | cc);
+        dword(0);
+        return p - 4;
+    }
+};
+
+void bind(unsigned char* site, const void* target) {
+    std::int32_t rel = static_cast<const unsigned char*>(target) - (site + 4);
+    std::memcpy(site, &rel, 4);
+}
+
+unsigned char* target_of(unsigned char* site) {
+    std::int32_t rel;
+    std::memcpy(&rel, site, 4);
+    return site + 4 + rel;
+}
+
+unsigned length(t_mode mode) {
+    switch (mode) {
+    case mode_imp:
+    case mode_acc:
+        return 1;
+    case mode_abs:
+    case mode_abx:
+    case mode_aby:
+    case mode_ind:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+// extra cycles of the addressing mode for reads and for writes, as in
+// the m_*() members (without the page crossing penalty)
+unsigned read_cycles(t_mode mode) {
+    switch (mode) {
+    case mode_zpg: return 1;
+    case mode_zpx: case mode_zpy: case mode_abs: case mode_abx: case mode_aby:
+        return 2;
+    case mode_inx: return 4;
+    case mode_iny: return 3;
+    default: return 0;
+    }
+}
+
+unsigned write_cycles(t_mode mode) {
+    switch (mode) {
+    case mode_zpg: return 1;
+    case mode_zpx: case mode_zpy: case mode_abs: return 2;
+    case mode_abx: case mode_aby: return 3;
+    case mode_inx: case mode_iny: return 4;
+    default: return 0;
+    }
+}
+
+struct t_insn {
+    std::uint32_t pc;
+    t_op op;
+    t_mode mode;
+    unsigned operand;
+};
+
+class t_translator {
+    t_emitter& e;
+    const char* mem;
+    const unsigned char* exit_code;
+    std::vector<t_insn> insns;
+    // jumps to the stub that hands instruction i to the interpreter
+    std::vector<std::pair<unsigned char*, unsigned>> bails;
+    // patchable jumps leaving the block for a guest address
+    std::vector<std::pair<unsigned char*, std::uint32_t>> exits;
+    std::vector<unsigned> cum;
+
+    void clear_flags(int mask) {
+        e.alu_imm(4, r_p, mask);
+    }
+
+    void or_nz(int src) {
+        e.rm(0x0a, r_p, r_ctx, CTX(nz), src);
+    }
+
+    void set_nz(int src) {
+        clear_flags(0x7d);
+        or_nz(src);
+    }
+
+    void address(const t_insn&, bool);
+    void load(const t_insn&);
+    void check_store(unsigned);
+    void check_push(unsigned);
+    void exit_to(std::uint32_t, unsigned);
+    void exit_dynamic(unsigned);
+    void exit_unlinked(unsigned);
+    void exit_irq(std::uint32_t, unsigned);
+    void shift(const t_insn&, int, bool, unsigned);
+    bool translate(unsigned);
+
+public:
+    t_translator(t_emitter& em, const char* m, const unsigned char* ex)
+        : e(em), mem(m), exit_code(ex) {
+    }
+
+    std::uint32_t scan(std::uint32_t);
+    void emit();
+};
+
+bool terminator(t_op op) {
+    switch (op) {
+    case op_jmp: case op_jsr: case op_rts: case op_brk: case op_rti:
+    case op_plp: case op_cli:
+    case op_bcc: case op_bcs: case op_bpl: case op_bmi:
+    case op_bne: case op_beq: case op_bvc: case op_bvs:
+        return true;
+    default:
+        return false;
+    }
+}
+
+unsigned cycles(const t_insn& in) {
+    switch (in.op) {
+    case op_lda: case op_ldx: case op_ldy: case op_stx: case op_sty:
+    case op_and: case op_eor: case op_ora: case op_bit:
+    case op_adc: case op_sbc: case op_cmp: case op_cpx: case op_cpy:
+        return 2 + read_cycles(in.mode);
+    case op_sta:
+        return 2 + write_cycles(in.mode);
+    case op_inc: case op_dec:
+        return 4 + write_cycles(in.mode);
+    case op_asl: case op_lsr: case op_rol: case op_ror:
+        return in.mode == mode_acc ? 2 : 4 + write_cycles(in.mode);
+    case op_pha: case op_php:
+        return 3;
+    case op_pla: case op_plp:
+        return 4;
+    case op_brk:
+        return 7;
+    case op_rti:
+        return 6;
+    case op_jmp:
+        return in.mode == mode_ind ? 5 : 3;
+    case op_jsr: case op_rts:
+        return 6;
+    default:
+        return 2;
+    }
+}
+
+std::uint32_t t_translator::scan(std::uint32_t pc) {
+    while (insns.size() < t_jit::max_block) {
+        auto info = decode(mem[pc]);
+        if (info.op == op_none) {
+            break;
+        }
+        auto len = length(info.mode);
+        if (pc + len > 0x10000) {
+            break;
+        }
+        unsigned operand = 0;
+        if (len > 1) {
+            operand = mem[pc + 1];
+        }
+        if (len > 2) {
+            operand |= unsigned(mem[pc + 2]) << 8;
+        }
+        insns.push_back({pc, info.op, info.mode, operand});
+        pc += len;
+        if (terminator(info.op)) {
+            break;
+        }
+    }
+    return pc;
+}
+
+// leaves the effective address of a memory operand in ecx; reads through
+// an indexed mode also pay the page crossing cycle
+void t_translator::address(const t_insn& in, bool read) {
+    int index = (in.mode == mode_abx) ? r_x : r_y;
+    switch (in.mode) {
+    case mode_zpg:
+    case mode_abs:
+        e.mov_imm(rcx, in.operand);
+        break;
+    case mode_zpx:
+    case mode_zpy:
+        e.rr(0x8b, rcx, in.mode == mode_zpx ? r_x : r_y);
+        e.rr(0x80, 0, rcx);
+        e.byte(in.operand);
+        break;
+    case mode_abx:
+    case mode_aby:
+        e.rr(0x8b, rcx, index);
+        if (read) {
+            e.rr(0x8b, rax, rcx);
+            e.rr(0x80, 0, rax);
+            e.byte(in.operand & 0xff);
+            e.rm(0x83, 2, r_ctx, CTX(cycles), rsp, 0, 1);
+            e.byte(0);
+        }
+        e.alu_imm(0, rcx, in.operand);
+        e.alu_imm(4, rcx, 0xffff);
+        break;
+    case mode_inx:
+        e.rr(0x8b, rax, r_x);
+        e.rr(0x80, 0, rax);
+        e.byte(in.operand);
+        e.rm(0x0fb6, rcx, r_mem, 0, rax);
+        e.rm(0x0fb6, rdx, r_mem, 1, rax);
+        e.rr(0xc1, 4, rdx);
+        e.byte(8);
+        e.rr(0x09, rdx, rcx);
+        break;
+    case mode_iny:
+        e.rm(0x0fb6, rcx, r_mem, in.operand);
+        e.rm(0x0fb6, rdx, r_mem, (in.operand + 1) & 0xff);
+        e.rr(0xc1, 4, rdx);
+        e.byte(8);
+        e.rr(0x09, rdx, rcx);
+        if (read) {
+            e.rr(0x8b, rax, rcx);
+            e.rr(0x00, r_y, rax);
+            e.rm(0x83, 2, r_ctx, CTX(cycles), rsp, 0, 1);
+            e.byte(0);
+        }
+        e.rr(0x01, r_y, rcx);
+        e.alu_imm(4, rcx, 0xffff);
+        break;
+    default:
+        break;
+    }
+}
+
+// leaves the operand of a read instruction in eax
+void t_translator::load(const t_insn& in) {
+    if (in.mode == mode_imm) {
+        e.mov_imm(rax, in.operand);
+        return;
+    }
+    address(in, true);
+    e.rm(0x0fb6, rax, r_mem, 0, rcx);
+}
+
+// a store into translated code is done by the interpreter, whose
+// write_mem() invalidates the blocks covering that byte; any other store
+// marks its page dirty
+void t_translator::check_store(unsigned i) {
+    e.rm(0x8b, rdx, r_ctx, CTX(code_map), rsp, 0, 1);
+    e.rm(0x80, 7, rdx, 0, rcx);
+    e.byte(0);
+    bails.push_back({e.jcc(cc_nz), i});
+    e.rr(0x8b, rax, rcx);
+    e.rr(0xc1, 5, rax);
+    e.byte(8);
+    e.rm(0x8b, rdx, r_ctx, CTX(page_dirty), rsp, 0, 1);
+    e.rm(0xc6, 0, rdx, 0, rax);
+    e.byte(1);
+}
+
+void t_translator::check_push(unsigned i) {
+    e.rm(0x8b, rdx, r_ctx, CTX(code_page), rsp, 0, 1);
+    e.rm(0x80, 7, rdx, 1);
+    e.byte(0);
+    bails.push_back({e.jcc(cc_nz), i});
+    e.rm(0x8b, rdx, r_ctx, CTX(page_dirty), rsp, 0, 1);
+    e.rm(0xc6, 0, rdx, 1);
+    e.byte(1);
+}
+
+void t_translator::exit_to(std::uint32_t target, unsigned cyc) {
+    e.add_ctx(CTX(cycles), cyc);
+    exits.push_back({e.jmp(), target});
+}
+
+// leaves for the guest address in ecx, going straight to its block when
+// there is one
+void t_translator::exit_dynamic(unsigned cyc) {
+    e.add_ctx(CTX(cycles), cyc);
+    e.rm(0x89, rcx, r_ctx, CTX(pc));
+    e.rm(0x8b, rdx, r_ctx, CTX(entry), rsp, 0, 1);
+    e.rm(0x8b, rdx, rdx, 0, rcx, 3, 1);
+    e.rr(0x85, rdx, rdx, 1);
+    bind(e.jcc(cc_z), exit_code);
+    e.rr(0xff, 4, rdx);
+}
+
+// leaves for the guest address in ecx through the dispatcher, which looks
+// at pending interrupts first
+void t_translator::exit_unlinked(unsigned cyc) {
+    e.add_ctx(CTX(cycles), cyc);
+    e.rm(0x89, rcx, r_ctx, CTX(pc));
+    bind(e.jmp(), exit_code);
+}
+
+// leaves after the interrupt disable flag may have been cleared; only goes
+// through the dispatcher if an interrupt is actually waiting
+void t_translator::exit_irq(std::uint32_t target, unsigned cyc) {
+    e.rm(0x80, 7, r_ctx, CTX(irq));
+    e.byte(0);
+    auto quiet = e.jcc(cc_z);
+    e.mov_imm(rcx, target);
+    exit_unlinked(cyc);
+    bind(quiet, e.p);
+    exit_to(target, cyc);
+}
+
+void t_translator::shift(const t_insn& in, int digit, bool rotate, unsigned i) {
+    if (in.mode == mode_acc) {
+        e.rr(0x31, rcx, rcx);
+        if (rotate) {
+            e.rr(0x0fba, 4, r_p);
+            e.byte(0);
+        }
+        e.rr(0xd0, digit, r_a);
+        e.rr(0x0f92, 0, rcx);
+        clear_flags(0x7c);
+        e.rr(0x09, rcx, r_p);
+        or_nz(r_a);
+        return;
+    }
+    address(in, false);
+    check_store(i);
+    e.rm(0x0fb6, rax, r_mem, 0, rcx);
+    e.rr(0x31, rdx, rdx);
+    if (rotate) {
+        e.rr(0x0fba, 4, r_p);
+        e.byte(0);
+    }
+    e.rr(0xd0, digit, rax);
+    e.rr(0x0f92, 0, rdx);
+    e.rm(0x88, rax, r_mem, 0, rcx);
+    clear_flags(0x7c);
+    e.rr(0x09, rdx, r_p);
+    or_nz(rax);
+}
+
+// emits instruction i; returns false if it ends the block
+bool t_translator::translate(unsigned i) {
+    const auto& in = insns[i];
+    std::uint32_t next = in.pc + length(in.mode);
+    int reg = r_a;
+    int mask = 0;
+    bool set = false;
+
+    switch (in.op) {
+    case op_lda:
+    case op_ldx:
+    case op_ldy:
+        reg = (in.op == op_lda) ? r_a : (in.op == op_ldx) ? r_x : r_y;
+        load(in);
+        e.rr(0x8b, reg, rax);
+        set_nz(reg);
+        return true;
+    case op_sta:
+    case op_stx:
+    case op_sty:
+        reg = (in.op == op_sta) ? r_a : (in.op == op_stx) ? r_x : r_y;
+        address(in, false);
+        check_store(i);
+        e.rm(0x88, reg, r_mem, 0, rcx);
+        return true;
+    case op_tax: e.rr(0x8b, r_x, r_a); set_nz(r_x); return true;
+    case op_tay: e.rr(0x8b, r_y, r_a); set_nz(r_y); return true;
+    case op_txa: e.rr(0x8b, r_a, r_x); set_nz(r_a); return true;
+    case op_tya: e.rr(0x8b, r_a, r_y); set_nz(r_a); return true;
+    case op_tsx:
+        e.rm(0x0fb6, r_x, r_ctx, CTX(sp));
+        set_nz(r_x);
+        return true;
+    case op_txs:
+        e.rm(0x88, r_x, r_ctx, CTX(sp));
+        return true;
+    case op_pha:
+    case op_php:
+        check_push(i);
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rr(0x8b, rcx, in.op == op_pha ? r_a : r_p);
+        if (in.op == op_php) {
+            e.alu_imm(1, rcx, 0x30);
+        }
+        e.rm(0x88, rcx, r_mem, 0x100, rax);
+        e.rm(0xfe, 1, r_ctx, CTX(sp));
+        return true;
+    case op_pla:
+        e.rm(0xfe, 0, r_ctx, CTX(sp));
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rm(0x0fb6, r_a, r_mem, 0x100, rax);
+        set_nz(r_a);
+        return true;
+    case op_and:
+    case op_eor:
+    case op_ora:
+        load(in);
+        e.rr((in.op == op_and) ? 0x21 : (in.op == op_eor) ? 0x31 : 0x09, rax, r_a);
+        set_nz(r_a);
+        return true;
+    case op_bit:
+        load(in);
+        clear_flags(0x3d);
+        e.rr(0x8b, rcx, rax);
+        e.alu_imm(4, rcx, 0xc0);
+        e.rr(0x09, rcx, r_p);
+        e.rr(0x31, rdx, rdx);
+        e.rr(0x84, rax, r_a);
+        e.rr(0x0f94, 0, rdx);
+        e.rr(0x01, rdx, rdx);
+        e.rr(0x09, rdx, r_p);
+        return true;
+    case op_inc:
+    case op_dec:
+        address(in, false);
+        check_store(i);
+        e.rm(0x0fb6, rax, r_mem, 0, rcx);
+        e.rr(0xfe, in.op == op_inc ? 0 : 1, rax);
+        e.rm(0x88, rax, r_mem, 0, rcx);
+        set_nz(rax);
+        return true;
+    case op_inx: e.rr(0xfe, 0, r_x); set_nz(r_x); return true;
+    case op_dex: e.rr(0xfe, 1, r_x); set_nz(r_x); return true;
+    case op_iny: e.rr(0xfe, 0, r_y); set_nz(r_y); return true;
+    case op_dey: e.rr(0xfe, 1, r_y); set_nz(r_y); return true;
+    case op_asl: shift(in, 4, false, i); return true;
+    case op_lsr: shift(in, 5, false, i); return true;
+    case op_rol: shift(in, 2, true, i); return true;
+    case op_ror: shift(in, 3, true, i); return true;
+    case op_adc:
+    case op_sbc:
+        load(in);
+        e.rr(0x31, rcx, rcx);
+        e.rr(0x31, rdx, rdx);
+        e.rr(0x0fba, 4, r_p);
+        e.byte(0);
+        if (in.op == op_sbc) {
+            e.byte(0xf5);
+        }
+        e.rr((in.op == op_adc) ? 0x10 : 0x18, rax, r_a);
+        e.rr((in.op == op_adc) ? 0x0f92 : 0x0f93, 0, rcx);
+        e.rr(0x0f90, 0, rdx);
+        clear_flags(0x3c);
+        e.rr(0xc1, 4, rdx);
+        e.byte(6);
+        e.rr(0x09, rcx, r_p);
+        e.rr(0x09, rdx, r_p);
+        or_nz(r_a);
+        return true;
+    case op_cmp:
+    case op_cpx:
+    case op_cpy:
+        reg = (in.op == op_cmp) ? r_a : (in.op == op_cpx) ? r_x : r_y;
+        load(in);
+        e.rr(0x31, rdx, rdx);
+        e.rr(0x8b, rcx, reg);
+        e.rr(0x28, rax, rcx);
+        e.rr(0x0f93, 0, rdx);
+        clear_flags(0x7c);
+        e.rr(0x09, rdx, r_p);
+        or_nz(rcx);
+        return true;
+    case op_plp:
+        e.rm(0xfe, 0, r_ctx, CTX(sp));
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rm(0x0fb6, r_p, r_mem, 0x100, rax);
+        exit_irq(next, cum[i] + 4);
+        return false;
+    case op_cli:
+        clear_flags(0xfb);
+        exit_irq(next, cum[i] + 2);
+        return false;
+    case op_rti:
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rr(0xfe, 0, rax);
+        e.rm(0x0fb6, r_p, r_mem, 0x100, rax);
+        e.rr(0xfe, 0, rax);
+        e.rm(0x0fb6, rcx, r_mem, 0x100, rax);
+        e.rr(0xfe, 0, rax);
+        e.rm(0x0fb6, rdx, r_mem, 0x100, rax);
+        e.rm(0x88, rax, r_ctx, CTX(sp));
+        e.rr(0xc1, 4, rdx);
+        e.byte(8);
+        e.rr(0x09, rdx, rcx);
+        exit_unlinked(cum[i] + 6);
+        return false;
+    case op_brk:
+        check_push(i);
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rm(0xc6, 0, r_mem, 0x100, rax);
+        e.byte((next + 1) >> 8);
+        e.rr(0xfe, 1, rax);
+        e.rm(0xc6, 0, r_mem, 0x100, rax);
+        e.byte(next + 1);
+        e.rr(0xfe, 1, rax);
+        e.rr(0x8b, rcx, r_p);
+        e.alu_imm(1, rcx, 0x30);
+        e.rm(0x88, rcx, r_mem, 0x100, rax);
+        e.rr(0xfe, 1, rax);
+        e.rm(0x88, rax, r_ctx, CTX(sp));
+        e.alu_imm(1, r_p, 0x14);
+        e.rm(0x0fb6, rcx, r_mem, 0xfffe);
+        e.rm(0x0fb6, rdx, r_mem, 0xffff);
+        e.rr(0xc1, 4, rdx);
+        e.byte(8);
+        e.rr(0x09, rdx, rcx);
+        exit_dynamic(cum[i] + 7);
+        return false;
+    case op_clc: clear_flags(0xfe); return true;
+    case op_clv: clear_flags(0xbf); return true;
+    case op_cld: clear_flags(0xf7); return true;
+    case op_sec: e.alu_imm(1, r_p, 0x01); return true;
+    case op_sed: e.alu_imm(1, r_p, 0x08); return true;
+    case op_sei: e.alu_imm(1, r_p, 0x04); return true;
+    case op_nop: return true;
+    case op_jmp:
+        if (in.mode == mode_abs) {
+            exit_to(in.operand, cum[i] + 3);
+            return false;
+        }
+        e.rm(0x0fb6, rcx, r_mem, in.operand);
+        e.rm(0x0fb6, rdx, r_mem, (in.operand + 1) & 0xffff);
+        e.rr(0xc1, 4, rdx);
+        e.byte(8);
+        e.rr(0x09, rdx, rcx);
+        exit_dynamic(cum[i] + 5);
+        return false;
+    case op_jsr:
+        check_push(i);
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rm(0xc6, 0, r_mem, 0x100, rax);
+        e.byte((next - 1) >> 8);
+        e.rr(0xfe, 1, rax);
+        e.rm(0xc6, 0, r_mem, 0x100, rax);
+        e.byte(next - 1);
+        e.rr(0xfe, 1, rax);
+        e.rm(0x88, rax, r_ctx, CTX(sp));
+        exit_to(in.operand, cum[i] + 6);
+        return false;
+    case op_rts:
+        e.rm(0x0fb6, rax, r_ctx, CTX(sp));
+        e.rr(0xfe, 0, rax);
+        e.rm(0x0fb6, rcx, r_mem, 0x100, rax);
+        e.rr(0xfe, 0, rax);
+        e.rm(0x0fb6, rdx, r_mem, 0x100, rax);
+        e.rm(0x88, rax, r_ctx, CTX(sp));
+        e.rr(0xc1, 4, rdx);
+        e.byte(8);
+        e.rr(0x09, rdx, rcx);
+        e.rr(0xff, 0, rcx);
+        e.alu_imm(4, rcx, 0xffff);
+        exit_dynamic(cum[i] + 6);
+        return false;
+    case op_bcc: mask = 0x01; break;
+    case op_bcs: mask = 0x01; set = true; break;
+    case op_bne: mask = 0x02; break;
+    case op_beq: mask = 0x02; set = true; break;
+    case op_bvc: mask = 0x40; break;
+    case op_bvs: mask = 0x40; set = true; break;
+    case op_bpl: mask = 0x80; break;
+    case op_bmi: mask = 0x80; set = true; break;
+    default:
+        return true;
+    }
+
+    // conditional branch
+    std::uint32_t target = (next + static_cast<signed char>(in.operand)) & 0xffff;
+    unsigned cross = (target >> 8) != (next >> 8);
+    e.rr(0xf7, 0, r_p);
+    e.dword(mask);
+    auto taken = e.jcc(set ? cc_nz : cc_z);
+    exit_to(next, cum[i] + 2);
+    bind(taken, e.p);
+    exit_to(target, cum[i] + 3 + cross);
+    return false;
+}
+
+void t_translator::emit() {
+    unsigned n = insns.size();
+    e.rm(0x81, 5, r_ctx, CTX(budget), rsp, 0, 1);
+    e.dword(n);
+    bails.push_back({e.jcc(cc_l), 0});
+
+    cum.push_back(0);
+    bool open = true;
+    for (unsigned i = 0; i < n && open; i++) {
+        open = translate(i);
+        cum.push_back(cum[i] + cycles(insns[i]));
+    }
+    if (open) {
+        const auto& last = insns.back();
+        exit_to(last.pc + length(last.mode), cum[n]);
+    }
+
+    for (auto& b : bails) {
+        bind(b.first, e.p);
+        e.add_ctx(CTX(budget), n - b.second);
+        e.add_ctx(CTX(cycles), cum[b.second]);
+        e.rm(0xc7, 0, r_ctx, CTX(pc));
+        e.dword(insns[b.second].pc);
+        e.rm(0xc6, 0, r_ctx, CTX(bail));
+        e.byte(1);
+        bind(e.jmp(), exit_code);
+    }
+    for (auto& x : exits) {
+        bind(x.first, e.p);
+        e.rm(0xc7, 0, r_ctx, CTX(pc));
+        e.dword(x.second);
+        e.mov_imm64(rax, reinterpret_cast<std::uintptr_t>(x.first));
+        e.rm(0x89, rax, r_ctx, CTX(link), rsp, 0, 1);
+        bind(e.jmp(), exit_code);
+    }
+}
+
+} // namespace
+
+t_jit::t_jit(char* mem, char* code_page, char* page_dirty)
+    : entry(0x10000), code_map(0x10000), rewrites(0x10000),
+      page_blocks(0x100), flushes(0), ctx() {
+    ctx.mem = mem;
+    ctx.code_page = code_page;
+    ctx.page_dirty = page_dirty;
+    ctx.code_map = code_map.data();
+    ctx.entry = entry.data();
+    for (unsigned v = 0; v < 0x100; v++) {
+        ctx.nz[v] = (v & 0x80) | (v ? 0 : 0x02);
+    }
+
+    auto m = mmap(nullptr, buf_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        buf = nullptr;
+        return;
+    }
+    buf = static_cast<unsigned char*>(m);
+
+    // enter(ctx, code): load the guest registers and jump into a block
+    t_emitter e{buf};
+    enter_fn = reinterpret_cast<void (*)(t_jit_ctx*, void*)>(buf);
+    e.push(rbx);
+    e.push(rbp);
+    e.push(r12);
+    e.push(r13);
+    e.push(r14);
+    e.push(r15);
+    e.rr(0x83, 5, rsp, 1);
+    e.byte(8);
+    e.rr(0x8b, r_ctx, rdi, 1);
+    e.rm(0x8b, r_mem, r_ctx, CTX(mem), rsp, 0, 1);
+    e.rm(0x0fb6, r_a, r_ctx, CTX(ra));
+    e.rm(0x0fb6, r_x, r_ctx, CTX(rx));
+    e.rm(0x0fb6, r_y, r_ctx, CTX(ry));
+    e.rm(0x0fb6, r_p, r_ctx, CTX(rp));
+    e.rr(0xff, 4, rsi);
+
+    // every block leaves through here
+    exit_code = e.p;
+    e.rm(0x88, r_a, r_ctx, CTX(ra));
+    e.rm(0x88, r_x, r_ctx, CTX(rx));
+    e.rm(0x88, r_y, r_ctx, CTX(ry));
+    e.rm(0x88, r_p, r_ctx, CTX(rp));
+    e.rr(0x83, 0, rsp, 1);
+    e.byte(8);
+    e.pop(r15);
+    e.pop(r14);
+    e.pop(r13);
+    e.pop(r12);
+    e.pop(rbp);
+    e.pop(rbx);
+    e.byte(0xc3);
+
+    code_start = e.p;
+    top = e.p;
+}
+
+t_jit::~t_jit() {
+    if (buf) {
+        munmap(buf, buf_size);
+    }
+}
+
+bool t_jit::good() {
+    return buf != nullptr;
+}
+
+void* t_jit::compile(std::uint32_t pc) {
+    if (!buf || rewrites[pc] >= max_rewrites) {
+        return nullptr;
+    }
+    if (std::size_t(buf + buf_size - top) < max_block_code) {
+        flush();
+    }
+    t_emitter e{top};
+    t_translator tr(e, ctx.mem, exit_code);
+    auto end = tr.scan(pc);
+    if (end == pc) {
+        return nullptr;
+    }
+    auto code = e.p;
+    tr.emit();
+    top = e.p;
+
+    entry[pc] = code;
+    blocks[pc] = {pc, end - 1, {}};
+    std::fill(code_map.begin() + pc, code_map.begin() + end, 1);
+    for (auto page = pc >> 8; page <= (end - 1) >> 8; page++) {
+        page_blocks[page].push_back(pc);
+        ctx.code_page[page] = 1;
+    }
+    return code;
+}
+
+void* t_jit::lookup(std::uint32_t pc) {
+    if (entry[pc]) {
+        return entry[pc];
+    }
+    return compile(pc);
+}
+
+// points the exit jump at site straight at the block for pc
+void t_jit::link(void* site, std::uint32_t pc) {
+    auto f = flushes;
+    auto code = lookup(pc);
+    if (!code || f != flushes) {
+        return;
+    }
+    auto s = static_cast<unsigned char*>(site);
+    blocks[pc].incoming.push_back({s, target_of(s)});
+    bind(s, code);
+}
+
+void t_jit::enter(void* code) {
+    enter_fn(&ctx, code);
+}
+
+void t_jit::kill_block(std::uint32_t start) {
+    auto it = blocks.find(start);
+    if (it == blocks.end()) {
+        return;
+    }
+    auto& b = it->second;
+    for (auto& in : b.incoming) {
+        bind(in.first, in.second);
+    }
+    entry[start] = nullptr;
+    if (rewrites[start] < max_rewrites) {
+        rewrites[start]++;
+    }
+    std::fill(code_map.begin() + b.start, code_map.begin() + b.end + 1, 0);
+    auto first = b.start >> 8;
+    auto last = b.end >> 8;
+    blocks.erase(it);
+
+    // blocks may overlap, so mark what the survivors on these pages cover
+    for (auto page = first; page <= last; page++) {
+        auto& v = page_blocks[page];
+        v.erase(std::find(v.begin(), v.end(), start));
+        for (auto s : v) {
+            auto& o = blocks[s];
+            std::fill(code_map.begin() + o.start, code_map.begin() + o.end + 1, 1);
+        }
+        ctx.code_page[page] = !v.empty();
+    }
+}
+
+void t_jit::invalidate(std::uint32_t addr) {
+    if (!code_map[addr]) {
+        return;
+    }
+    auto starts = page_blocks[addr >> 8];
+    for (auto start : starts) {
+        auto it = blocks.find(start);
+        if (it != blocks.end() && it->second.start <= addr &&
+            addr <= it->second.end) {
+            kill_block(start);
+        }
+    }
+}
+
+void t_jit::flush() {
+    top = code_start;
+    blocks.clear();
+    std::fill(entry.begin(), entry.end(), nullptr);
+    std::fill(code_map.begin(), code_map.end(), 0);
+    std::fill(rewrites.begin(), rewrites.end(), 0);
+    for (auto& v : page_blocks) {
+        v.clear();
+    }
+    std::fill(ctx.code_page, ctx.code_page + 0x100, 0);
+    flushes++;
+}
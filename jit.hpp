@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// State shared with the generated code. While a block runs, a, x, y and p
+// live in host registers; they are only loaded from and stored back to this
+// structure on entry and exit.
+struct t_jit_ctx {
+    char* mem;
+    char* code_page;
+    char* page_dirty; // set for each page stored to
+    char* code_map; // guest bytes covered by a block
+    void** entry; // native entry point per guest address, null if none
+    void* link; // exit jump to patch once its target is translated
+    long budget; // instructions the blocks may still execute
+    std::uint64_t cycles;
+    std::uint32_t pc;
+    char ra;
+    char rx;
+    char ry;
+    char rp;
+    char sp;
+    char bail; // the instruction at pc has to go through the interpreter
+    char irq; // an irq or reset is waiting for the interrupt disable flag
+    char nz[0x100]; // n and z bits of the status register for each result
+};
+
+// Translates basic blocks of 6502 code to x86-64 and chains them together.
+// A page of guest memory holding translated code is flagged in code_page;
+// the owner must call invalidate() when such a page is written.
+class t_jit {
+    struct t_block {
+        std::uint32_t start;
+        std::uint32_t end;
+        std::vector<std::pair<unsigned char*, unsigned char*>> incoming;
+    };
+
+    unsigned char* buf;
+    unsigned char* top;
+    unsigned char* code_start;
+    void (*enter_fn)(t_jit_ctx*, void*);
+    unsigned char* exit_code;
+    std::vector<void*> entry;
+    std::vector<char> code_map;
+    std::vector<unsigned char> rewrites; // invalidations per block start
+    std::unordered_map<std::uint32_t, t_block> blocks;
+    std::vector<std::vector<std::uint32_t>> page_blocks;
+    unsigned long flushes;
+
+    void* compile(std::uint32_t);
+    void kill_block(std::uint32_t);
+
+public:
+    static const unsigned max_block = 64; // instructions
+    t_jit_ctx ctx;
+
+    t_jit(char*, char*, char*);
+    ~t_jit();
+    bool good();
+    void* lookup(std::uint32_t);
+    void link(void*, std::uint32_t);
+    void enter(void*);
+    void invalidate(std::uint32_t);
+    void flush();
+};
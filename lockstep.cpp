@@ -0,0 +1,814 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+
+#include <emmintrin.h>
+
+#include "lockstep.hpp"
+#include "opcodes.hpp"
+
+// GCC vector extensions: a byte or a 32-bit counter for each lane. Each
+// operation on them compiles to two AVX2 instructions, or four SSE2 ones
+// in the default clone of run_lanes().
+typedef unsigned char t_lanes __attribute__((vector_size(32)));
+typedef std::uint32_t t_counts __attribute__((vector_size(128)));
+
+// only run_lanes() passes vectors to these helpers, and it inlines them
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+static_assert(t_machine_vector::lanes == 32, "one lane per byte of t_lanes");
+
+static const std::uint32_t all_lanes = 0xffffffff;
+
+static const t_counts lane_index = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+};
+
+static std::array<std::uint64_t, 0x100> make_expand() {
+    std::array<std::uint64_t, 0x100> t;
+    for (unsigned i = 0; i < 0x100; i++) {
+        t[i] = 0;
+        for (unsigned b = 0; b < 8; b++) {
+            if (i & (1 << b)) {
+                t[i] |= std::uint64_t(0xff) << (8 * b);
+            }
+        }
+    }
+    return t;
+}
+
+// eight lane bytes, 0xff where a bit of the index is set
+static const std::array<std::uint64_t, 0x100> expand = make_expand();
+
+static std::array<t_opinfo, 0x100> make_opinfo() {
+    std::array<t_opinfo, 0x100> t;
+    for (unsigned i = 0; i < 0x100; i++) {
+        t[i] = decode(i);
+    }
+    return t;
+}
+
+static const std::array<t_opinfo, 0x100> opinfo = make_opinfo();
+
+static inline t_lanes splat(unsigned char v) {
+    return t_lanes{} + v;
+}
+
+static inline t_lanes load(const unsigned char* p) {
+    t_lanes v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store(unsigned char* p, const t_lanes& v) {
+    std::memcpy(p, &v, sizeof(v));
+}
+
+// a bit for each lane with bit 7 of its byte set
+static inline std::uint32_t bits(const t_lanes& v) {
+    __m128i lo, hi;
+    std::memcpy(&lo, &v, 16);
+    std::memcpy(&hi, reinterpret_cast<const char*>(&v) + 16, 16);
+    return unsigned(_mm_movemask_epi8(lo)) |
+           unsigned(_mm_movemask_epi8(hi)) << 16;
+}
+
+// 0xff in the lanes of a mask
+static inline t_lanes lanes_of(std::uint32_t m) {
+    t_lanes v;
+    for (int i = 0; i < 4; i++) {
+        std::memcpy(reinterpret_cast<char*>(&v) + 8 * i,
+                    &expand[(m >> (8 * i)) & 0xff], 8);
+    }
+    return v;
+}
+
+// 1 in the lanes of a mask
+static inline t_counts ones_of(std::uint32_t m) {
+    return ((t_counts{} + m) >> lane_index) & 1;
+}
+
+static inline t_lanes pick(const t_lanes& m, const t_lanes& a,
+                           const t_lanes& b) {
+    return (a & m) | (b & ~m);
+}
+
+// whether v holds a single value over the lanes of m, f being one of them
+static inline bool same(const t_lanes& v, std::uint32_t m, int f) {
+    return (bits(t_lanes(v != splat(v[f]))) & m) == 0;
+}
+
+static inline t_lanes status(const t_lanes& p, const t_lanes& zr,
+                             const t_lanes& nr, const t_lanes& c,
+                             const t_lanes& v) {
+    return (p & 0x3c) | c | (t_lanes(zr == 0) & 2) | (v << 6) | (nr & 0x80);
+}
+
+// an effective address, shared by the lanes of a group or one per lane
+struct t_where {
+    bool same;
+    std::uint32_t addr;
+    std::uint32_t each[32];
+};
+
+static inline void locate(t_where& w, const t_lanes& lo, const t_lanes& hi,
+                          std::uint32_t m, int f) {
+    w.same = same(lo, m, f) && same(hi, m, f);
+    if (w.same) {
+        w.addr = lo[f] | hi[f] << 8;
+        return;
+    }
+    for (int l = 0; l < 32; l++) {
+        w.each[l] = lo[l] | hi[l] << 8;
+    }
+}
+
+static inline void locate_page(t_where& w, const t_lanes& lo, unsigned page,
+                               std::uint32_t m, int f) {
+    w.same = same(lo, m, f);
+    if (w.same) {
+        w.addr = page << 8 | lo[f];
+        return;
+    }
+    for (int l = 0; l < 32; l++) {
+        w.each[l] = page << 8 | lo[l];
+    }
+}
+
+static inline void gather(t_lanes& v, const unsigned char* mem,
+                          const t_where& w, std::uint32_t m) {
+    if (w.same) {
+        v = load(mem + w.addr * 32);
+        return;
+    }
+    for (; m; m &= m - 1) {
+        auto l = __builtin_ctz(m);
+        v[l] = mem[w.each[l] * 32 + l];
+    }
+}
+
+t_machine_vector::t_machine_vector() {
+    memory.resize(0x10000 * lanes);
+    page_mixed.resize(0x100);
+    stop_pc = 0x10000;
+    max_groups = 8;
+    init();
+}
+
+// every lane as t_machine::init() leaves it
+void t_machine_vector::init() {
+    std::fill(memory.begin(), memory.end(), 0xff);
+    std::fill(page_mixed.begin(), page_mixed.end(), 0);
+    for (int l = 0; l < lanes; l++) {
+        set_registers(l, {0x0200, char(0xff), 0, 0, 0, 0x24});
+        step_count[l] = 0;
+        total_cycles[l] = 0;
+    }
+    fallbacks = 0;
+}
+
+void t_machine_vector::load_program(const std::vector<char>& v, t_addr addr) {
+    for (std::size_t i = 0; i < v.size(); i++) {
+        std::memset(&memory[(addr + i) * lanes], v[i], lanes);
+    }
+    set_program_counter(addr);
+}
+
+void t_machine_vector::set_program_counter(t_addr addr) {
+    for (int l = 0; l < lanes; l++) {
+        pc[l] = addr;
+        stop[l] = {stop_count, addr};
+    }
+}
+
+void t_machine_vector::set_registers(int l, const t_registers& r) {
+    pc[l] = r.pc;
+    sp[l] = r.sp;
+    ra[l] = r.ra;
+    rx[l] = r.rx;
+    ry[l] = r.ry;
+    rp[l] = r.rp;
+    stop[l] = {stop_count, r.pc};
+}
+
+t_registers t_machine_vector::get_registers(int l) {
+    return {pc[l], char(sp[l]), char(ra[l]), char(rx[l]), char(ry[l]),
+            char(rp[l])};
+}
+
+void t_machine_vector::write_memory(int l, t_addr addr, char val) {
+    memory[(addr & 0xffff) * lanes + l] = val;
+    page_mixed[(addr >> 8) & 0xff] = 1;
+}
+
+char t_machine_vector::read_memory(int l, t_addr addr) {
+    return memory[(addr & 0xffff) * lanes + l];
+}
+
+unsigned long t_machine_vector::get_step_counter(int l) {
+    return step_count[l];
+}
+
+t_cycles t_machine_vector::get_cycle_counter(int l) {
+    return total_cycles[l];
+}
+
+t_stop t_machine_vector::get_stop(int l) {
+    return stop[l];
+}
+
+// lanes stop with stop_break on reaching addr, 0x10000 for none
+void t_machine_vector::set_stop_pc(t_addr addr) {
+    stop_pc = addr;
+}
+
+// groups of diverged lanes to keep in lockstep before going lane by lane
+void t_machine_vector::set_max_groups(unsigned n) {
+    max_groups = std::max(1u, n);
+}
+
+// runs handed to a t_machine lane by lane
+unsigned long t_machine_vector::get_fallbacks() {
+    return fallbacks;
+}
+
+// each running lane executes count steps unless it stops first
+void t_machine_vector::run(unsigned long count) {
+    // the per-run counters are 32 bits wide
+    const unsigned long chunk = 1ul << 28;
+    while (count > 0) {
+        auto n = std::min(count, chunk);
+        run_lanes(n);
+        count -= n;
+    }
+}
+
+// one lane through a t_machine; memory is copied out and back
+void t_machine_vector::run_scalar(int l, std::uint32_t n) {
+    std::unique_ptr<t_machine> m(new t_machine);
+    std::vector<char> image(0x10000);
+    for (t_addr a = 0; a < 0x10000; a++) {
+        image[a] = memory[a * lanes + l];
+    }
+    m->load_program(image, 0);
+    m->set_registers(get_registers(l));
+    if (stop_pc < 0x10000) {
+        m->set_breakpoint(stop_pc, true);
+    }
+    auto s = m->run_to_stop(n);
+    set_registers(l, m->get_registers());
+    stop[l] = s;
+    step_count[l] += m->get_step_counter();
+    total_cycles[l] += m->get_cycle_counter();
+    for (t_addr a = 0; a < 0x10000; a++) {
+        memory[a * lanes + l] = m->read_memory(a);
+    }
+    fallbacks++;
+}
+
+__attribute__((target_clones("avx2", "default")))
+void t_machine_vector::run_lanes(std::uint32_t n) {
+    auto mem = memory.data();
+    auto mixed = page_mixed.data();
+
+    auto a = load(ra);
+    auto x = load(rx);
+    auto y = load(ry);
+    auto s = load(sp);
+    auto p = load(rp);
+    auto c = p & 1;
+    auto zr = ~p & 2;
+    auto v = (p >> 6) & 1;
+    auto nr = p;
+    t_counts done{};
+    t_counts cyc{};
+
+    std::vector<t_group> groups;
+    for (int l = 0; l < lanes; l++) {
+        if (stop[l].reason != stop_count) {
+            continue;
+        }
+        auto it = std::find_if(groups.begin(), groups.end(),
+                               [&](const t_group& g) { return g.pc == pc[l]; });
+        if (it == groups.end()) {
+            groups.push_back({pc[l], 0, 0, 0, 0});
+            it = groups.end() - 1;
+        }
+        it->mask |= 1u << l;
+    }
+
+    auto flush = [&](t_group& g) {
+        auto ones = ones_of(g.mask);
+        done += ones * g.steps;
+        cyc += ones * g.cycles;
+        g.most += g.steps;
+        g.steps = 0;
+        g.cycles = 0;
+    };
+    auto park = [&](const t_group& g, t_stop_reason reason, std::uint32_t to,
+                    t_addr addr) {
+        for (auto m = g.mask; m; m &= m - 1) {
+            auto l = __builtin_ctz(m);
+            pc[l] = to;
+            stop[l] = {reason, addr};
+        }
+    };
+
+    std::size_t cur = 0;
+    std::uint32_t lm_mask = 0;
+    t_lanes lm{};
+    t_where w{};
+    bool diverged = false;
+    while (!groups.empty()) {
+        if (groups.size() > max_groups) {
+            diverged = true;
+            break;
+        }
+        if (groups.size() > 1) {
+            cur = 0;
+            for (std::size_t i = 1; i < groups.size(); i++) {
+                if (groups[i].pc < groups[cur].pc) {
+                    cur = i;
+                }
+            }
+        } else {
+            cur = 0;
+        }
+        auto g = groups[cur];
+
+        if (g.most + g.steps >= n) {
+            // some lanes are done; the others run on
+            flush(g);
+            g.most = 0;
+            for (auto m = g.mask; m; m &= m - 1) {
+                auto l = __builtin_ctz(m);
+                if (done[l] >= n) {
+                    pc[l] = g.pc;
+                    g.mask &= ~(1u << l);
+                } else {
+                    g.most = std::max(g.most, done[l]);
+                }
+            }
+            if (g.mask == 0) {
+                groups[cur] = groups.back();
+                groups.pop_back();
+            } else {
+                groups[cur] = g;
+            }
+            continue;
+        }
+        if (g.pc == stop_pc) {
+            flush(g);
+            park(g, stop_break, g.pc, g.pc);
+            groups[cur] = groups.back();
+            groups.pop_back();
+            continue;
+        }
+
+        // fetch, and split off lanes holding other code
+        auto f = __builtin_ctz(g.mask);
+        auto pc0 = g.pc & 0xffff;
+        auto opcode = mem[pc0 * 32 + f];
+        auto len = op_length[opcode];
+        if (mixed[pc0 >> 8] || mixed[((pc0 + len - 1) >> 8) & 0xff]) {
+            std::uint32_t bad = 0;
+            for (unsigned i = 0; i < len; i++) {
+                auto code = load(mem + ((pc0 + i) & 0xffff) * 32);
+                bad |= bits(t_lanes(code != splat(code[f]))) & g.mask;
+            }
+            if (bad) {
+                auto h = g;
+                h.mask = bad;
+                g.mask &= ~bad;
+                groups.push_back(h);
+            }
+        }
+        if (g.mask != lm_mask) {
+            lm_mask = g.mask;
+            lm = lanes_of(lm_mask);
+        }
+        auto info = opinfo[opcode];
+        if (info.op == op_none) {
+            flush(g);
+            park(g, stop_illegal, g.pc + 1, pc0);
+            groups[cur] = groups.back();
+            groups.pop_back();
+            continue;
+        }
+        unsigned o1 = mem[((pc0 + 1) & 0xffff) * 32 + f];
+        unsigned o2 = mem[((pc0 + 2) & 0xffff) * 32 + f];
+        std::uint32_t npc = g.pc + len;
+
+        // effective address; rc and wc as in t_machine's addressing modes
+        unsigned rc = 0;
+        unsigned wc = 0;
+        t_lanes cross{};
+        bool crossed = false;
+        switch (info.mode) {
+        case mode_zpg:
+            w.same = true;
+            w.addr = o1;
+            rc = wc = 1;
+            break;
+        case mode_zpx:
+            locate_page(w, splat(o1) + x, 0, g.mask, f);
+            rc = wc = 2;
+            break;
+        case mode_zpy:
+            locate_page(w, splat(o1) + y, 0, g.mask, f);
+            rc = wc = 2;
+            break;
+        case mode_abs:
+            w.same = true;
+            w.addr = o1 | o2 << 8;
+            rc = wc = 2;
+            break;
+        case mode_abx:
+        case mode_aby: {
+            auto i = info.mode == mode_abx ? x : y;
+            auto lo = splat(o1) + i;
+            cross = t_lanes(lo < i);
+            locate(w, lo, splat(o2) - cross, g.mask, f);
+            crossed = true;
+            rc = 2;
+            wc = 3;
+            break;
+        }
+        case mode_inx: {
+            t_where q;
+            locate_page(q, splat(o1) + x, 0, g.mask, f);
+            t_lanes lo{};
+            t_lanes hi{};
+            gather(lo, mem, q, g.mask);
+            if (q.same) {
+                q.addr++;
+            } else {
+                for (auto& e : q.each) {
+                    e++;
+                }
+            }
+            gather(hi, mem, q, g.mask);
+            locate(w, lo, hi, g.mask, f);
+            rc = wc = 4;
+            break;
+        }
+        case mode_iny: {
+            auto lo = load(mem + o1 * 32) + y;
+            cross = t_lanes(lo < y);
+            auto hi = load(mem + ((o1 + 1) & 0xff) * 32) - cross;
+            locate(w, lo, hi, g.mask, f);
+            crossed = true;
+            rc = 3;
+            wc = 4;
+            break;
+        }
+        default:
+            break;
+        }
+
+#define READ(r) do {                                                      \
+        if (info.mode == mode_imm) {                                      \
+            r = splat(o1);                                                \
+        } else {                                                          \
+            gather(r, mem, w, g.mask);                                    \
+        }                                                                 \
+    } while (0)
+#define SET(r, val) r = pick(lm, val, r)
+#define SET_NZ(val) do { auto t_ = val; SET(zr, t_); SET(nr, t_); } while (0)
+#define WRITE(val) do {                                                   \
+        auto t_ = val;                                                    \
+        if (w.same) {                                                     \
+            auto at_ = mem + w.addr * 32;                                 \
+            store(at_, pick(lm, t_, load(at_)));                          \
+            if (!mixed[w.addr >> 8] &&                                    \
+                (g.mask != all_lanes || !same(t_, all_lanes, 0))) {       \
+                mixed[w.addr >> 8] = 1;                                   \
+            }                                                             \
+        } else {                                                          \
+            for (auto m_ = g.mask; m_; m_ &= m_ - 1) {                    \
+                auto l_ = __builtin_ctz(m_);                              \
+                mem[w.each[l_] * 32 + l_] = t_[l_];                       \
+                mixed[w.each[l_] >> 8] = 1;                               \
+            }                                                             \
+        }                                                                 \
+    } while (0)
+#define PUSH(val) do {                                                    \
+        locate_page(w, s, 1, g.mask, f);                                  \
+        WRITE(val);                                                       \
+        SET(s, s - 1);                                                    \
+    } while (0)
+#define PULL(r) do {                                                      \
+        SET(s, s + 1);                                                    \
+        locate_page(w, s, 1, g.mask, f);                                  \
+        gather(r, mem, w, g.mask);                                        \
+    } while (0)
+#define SET_STATUS(st) do {                                               \
+        SET(p, st);                                                       \
+        SET(c, st & 1);                                                   \
+        SET(zr, ~st & 2);                                                 \
+        SET(v, (st >> 6) & 1);                                            \
+        SET(nr, st);                                                      \
+    } while (0)
+
+        // control flow: fall through, a jump shared by the group, a branch
+        // taken by the lanes of cond, or a jump to each lane's own target
+        enum { flow_next, flow_jump, flow_branch, flow_each } flow = flow_next;
+        std::uint32_t target = 0;
+        t_lanes cond{};
+        t_lanes to_lo{};
+        t_lanes to_hi{};
+        unsigned to_add = 0;
+        unsigned cycles = 0;
+        t_lanes val{};
+        t_lanes r{};
+        switch (info.op) {
+        case op_lda: READ(val); SET(a, val); SET_NZ(a); cycles = 2 + rc; break;
+        case op_ldx: READ(val); SET(x, val); SET_NZ(x); cycles = 2 + rc; break;
+        case op_ldy: READ(val); SET(y, val); SET_NZ(y); cycles = 2 + rc; break;
+        case op_sta: WRITE(a); cycles = 2 + wc; crossed = false; break;
+        case op_stx: WRITE(x); cycles = 2 + rc; break;
+        case op_sty: WRITE(y); cycles = 2 + rc; break;
+        case op_tax: SET(x, a); SET_NZ(a); cycles = 2; break;
+        case op_tay: SET(y, a); SET_NZ(a); cycles = 2; break;
+        case op_txa: SET(a, x); SET_NZ(x); cycles = 2; break;
+        case op_tya: SET(a, y); SET_NZ(y); cycles = 2; break;
+        case op_tsx: SET(x, s); SET_NZ(s); cycles = 2; break;
+        case op_txs: SET(s, x); cycles = 2; break;
+        case op_pha: PUSH(a); cycles = 3; break;
+        case op_pla: PULL(val); SET(a, val); SET_NZ(val); cycles = 4; break;
+        case op_php: PUSH(status(p, zr, nr, c, v) | 0x30); cycles = 3; break;
+        case op_plp: PULL(val); SET_STATUS(val); cycles = 4; break;
+        case op_and: READ(val); SET(a, a & val); SET_NZ(a); cycles = 2 + rc; break;
+        case op_eor: READ(val); SET(a, a ^ val); SET_NZ(a); cycles = 2 + rc; break;
+        case op_ora: READ(val); SET(a, a | val); SET_NZ(a); cycles = 2 + rc; break;
+        case op_bit:
+            READ(val);
+            SET(zr, a & val);
+            SET(nr, val);
+            SET(v, (val >> 6) & 1);
+            cycles = 2 + rc;
+            break;
+        case op_inc:
+            READ(val);
+            r = val + 1;
+            WRITE(r);
+            SET_NZ(r);
+            cycles = 4 + wc;
+            crossed = false;
+            break;
+        case op_dec:
+            READ(val);
+            r = val - 1;
+            WRITE(r);
+            SET_NZ(r);
+            cycles = 4 + wc;
+            crossed = false;
+            break;
+        case op_inx: SET(x, x + 1); SET_NZ(x); cycles = 2; break;
+        case op_dex: SET(x, x - 1); SET_NZ(x); cycles = 2; break;
+        case op_iny: SET(y, y + 1); SET_NZ(y); cycles = 2; break;
+        case op_dey: SET(y, y - 1); SET_NZ(y); cycles = 2; break;
+        case op_asl:
+        case op_lsr:
+        case op_rol:
+        case op_ror:
+            if (info.mode == mode_acc) {
+                val = a;
+            } else {
+                READ(val);
+            }
+            if (info.op == op_asl) {
+                r = val << 1;
+            } else if (info.op == op_lsr) {
+                r = val >> 1;
+            } else if (info.op == op_rol) {
+                r = (val << 1) | c;
+            } else {
+                r = (val >> 1) | (c << 7);
+            }
+            if (info.op == op_asl || info.op == op_rol) {
+                SET(c, val >> 7);
+            } else {
+                SET(c, val & 1);
+            }
+            if (info.mode == mode_acc) {
+                SET(a, r);
+                cycles = 2;
+            } else {
+                WRITE(r);
+                cycles = 4 + wc;
+            }
+            SET_NZ(r);
+            crossed = false;
+            break;
+        case op_adc:
+        case op_sbc: {
+            READ(val);
+            if (info.op == op_sbc) {
+                val = ~val;
+            }
+            auto t = a + val;
+            auto sum = t + c;
+            SET(c, (t_lanes(t < a) | t_lanes(sum < t)) & 1);
+            SET(v, ((a ^ sum) & (val ^ sum)) >> 7);
+            SET(a, sum);
+            SET_NZ(sum);
+            cycles = 2 + rc;
+            break;
+        }
+        case op_cmp:
+        case op_cpx:
+        case op_cpy: {
+            auto reg = info.op == op_cmp ? a : info.op == op_cpx ? x : y;
+            READ(val);
+            SET(c, t_lanes(reg >= val) & 1);
+            SET_NZ(reg - val);
+            cycles = 2 + rc;
+            break;
+        }
+        case op_jmp:
+            if (info.mode == mode_abs) {
+                flow = flow_jump;
+                target = o1 | o2 << 8;
+                cycles = 3;
+            } else {
+                auto ptr = o1 | o2 << 8;
+                to_lo = load(mem + ptr * 32);
+                to_hi = load(mem + ((ptr + 1) & 0xffff) * 32);
+                flow = flow_each;
+                cycles = 5;
+            }
+            break;
+        case op_jsr:
+            PUSH(splat((npc - 1) >> 8));
+            PUSH(splat(npc - 1));
+            flow = flow_jump;
+            target = o1 | o2 << 8;
+            cycles = 6;
+            break;
+        case op_rts:
+            PULL(to_lo);
+            PULL(to_hi);
+            to_add = 1;
+            flow = flow_each;
+            cycles = 6;
+            break;
+        case op_rti:
+            PULL(val);
+            SET_STATUS(val);
+            PULL(to_lo);
+            PULL(to_hi);
+            flow = flow_each;
+            cycles = 6;
+            break;
+        case op_brk:
+            npc = g.pc + 2;
+            PUSH(splat(npc >> 8));
+            PUSH(splat(npc));
+            PUSH(status(p, zr, nr, c, v) | 0x30);
+            SET(p, p | 0x14);
+            to_lo = load(mem + 0xfffe * 32);
+            to_hi = load(mem + 0xffff * 32);
+            flow = flow_each;
+            cycles = 7;
+            break;
+        case op_clc: SET(c, splat(0)); cycles = 2; break;
+        case op_sec: SET(c, splat(1)); cycles = 2; break;
+        case op_clv: SET(v, splat(0)); cycles = 2; break;
+        case op_cld: SET(p, p & ~8); cycles = 2; break;
+        case op_sed: SET(p, p | 8); cycles = 2; break;
+        case op_cli: SET(p, p & ~4); cycles = 2; break;
+        case op_sei: SET(p, p | 4); cycles = 2; break;
+        case op_bcc: cond = t_lanes(c == 0); flow = flow_branch; break;
+        case op_bcs: cond = t_lanes(c != 0); flow = flow_branch; break;
+        case op_bpl: cond = t_lanes(nr < 0x80); flow = flow_branch; break;
+        case op_bmi: cond = t_lanes(nr >= 0x80); flow = flow_branch; break;
+        case op_bne: cond = t_lanes(zr != 0); flow = flow_branch; break;
+        case op_beq: cond = t_lanes(zr == 0); flow = flow_branch; break;
+        case op_bvc: cond = t_lanes(v == 0); flow = flow_branch; break;
+        case op_bvs: cond = t_lanes(v != 0); flow = flow_branch; break;
+        case op_nop: cycles = 2; break;
+        default: break;
+        }
+
+        g.steps++;
+        g.cycles += cycles;
+        if (crossed) {
+            auto cb = bits(cross) & g.mask;
+            if (cb == g.mask) {
+                g.cycles++;
+            } else if (cb) {
+                cyc += ones_of(cb);
+            }
+        }
+
+        if (flow == flow_next) {
+            g.pc = npc;
+        } else if (flow == flow_jump) {
+            g.pc = target;
+        } else if (flow == flow_branch) {
+            g.cycles += 2;
+            target = npc + static_cast<signed char>(o1);
+            auto taken = bits(cond) & g.mask;
+            auto extra = 1 + (((target ^ npc) & 0xff00) != 0);
+            if (taken == g.mask) {
+                g.pc = target;
+                g.cycles += extra;
+            } else if (taken) {
+                auto h = g;
+                h.mask = taken;
+                h.pc = target;
+                h.cycles += extra;
+                groups.push_back(h);
+                g.mask &= ~taken;
+                g.pc = npc;
+            } else {
+                g.pc = npc;
+            }
+        } else {
+            // one group for each distinct target
+            auto rest = g.mask;
+            bool first = true;
+            while (rest) {
+                auto l = __builtin_ctz(rest);
+                auto eq = t_lanes(to_lo == splat(to_lo[l])) &
+                          t_lanes(to_hi == splat(to_hi[l]));
+                auto m = bits(eq) & rest;
+                std::uint32_t to = (to_lo[l] | to_hi[l] << 8) + to_add;
+                if (first) {
+                    g.mask = m;
+                    g.pc = to;
+                    first = false;
+                } else {
+                    auto h = g;
+                    h.mask = m;
+                    h.pc = to;
+                    groups.push_back(h);
+                }
+                rest &= ~m;
+            }
+        }
+
+        // lanes meeting at the same pc run together again
+        for (std::size_t i = 0; i < groups.size(); i++) {
+            if (i != cur && groups[i].pc == g.pc) {
+                flush(g);
+                flush(groups[i]);
+                g.mask |= groups[i].mask;
+                g.most = std::max(g.most, groups[i].most);
+                groups[i] = groups.back();
+                groups.pop_back();
+                if (cur == groups.size()) {
+                    cur = i;
+                }
+                break;
+            }
+        }
+        groups[cur] = g;
+
+#undef READ
+#undef SET
+#undef SET_NZ
+#undef WRITE
+#undef PUSH
+#undef PULL
+#undef SET_STATUS
+    }
+
+    for (auto& g : groups) {
+        flush(g);
+        for (auto m = g.mask; m; m &= m - 1) {
+            pc[__builtin_ctz(m)] = g.pc;
+        }
+    }
+    store(ra, a);
+    store(rx, x);
+    store(ry, y);
+    store(sp, s);
+    store(rp, status(p, zr, nr, c, v));
+    for (int l = 0; l < lanes; l++) {
+        step_count[l] += done[l];
+        total_cycles[l] += cyc[l];
+    }
+
+    if (diverged) {
+        // too many groups; the rest of the run goes lane by lane
+        for (auto& g : groups) {
+            for (auto m = g.mask; m; m &= m - 1) {
+                auto l = __builtin_ctz(m);
+                run_scalar(l, n - done[l]);
+            }
+        }
+        for (unsigned page = 0; page < 0x100; page++) {
+            auto at = mem + page * 0x100 * 32;
+            bool differ = false;
+            for (unsigned i = 0; i < 0x100 && !differ; i++) {
+                auto b = load(at + i * 32);
+                differ = !same(b, all_lanes, 0);
+            }
+            mixed[page] = differ;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "machine.hpp"
+
+// Many machines running the same program on different data, kept in
+// lockstep. Registers and memory are stored lane by lane, so an instruction
+// executes for all lanes with a few vector operations. Lanes that take
+// different paths are split into groups sharing a pc, and merged again when
+// they meet; once there are more groups than set_max_groups() allows, the
+// rest of the run goes lane by lane through a t_machine.
+//
+// The lanes have no interrupts and no watchpoints; a lane stops on an
+// illegal opcode or at the pc given to set_stop_pc() and stays stopped until
+// its registers or the program are set again.
+class t_machine_vector {
+public:
+    static const int lanes = 32;
+
+private:
+    struct t_group {
+        std::uint32_t pc;
+        std::uint32_t mask; // lanes of the group
+        std::uint32_t most; // steps of its furthest lane, up to the last flush
+        std::uint32_t steps; // steps and cycles since the last flush
+        std::uint32_t cycles;
+    };
+
+    // byte addr of lane l is at memory[addr * lanes + l]
+    std::vector<unsigned char> memory;
+    std::vector<char> page_mixed; // pages whose lanes may differ
+
+    std::uint32_t pc[lanes];
+    unsigned char sp[lanes];
+    unsigned char ra[lanes];
+    unsigned char rx[lanes];
+    unsigned char ry[lanes];
+    unsigned char rp[lanes];
+    unsigned long step_count[lanes];
+    t_cycles total_cycles[lanes];
+    t_stop stop[lanes];
+
+    t_addr stop_pc;
+    unsigned max_groups;
+    unsigned long fallbacks;
+
+    void run_lanes(std::uint32_t);
+    void run_scalar(int, std::uint32_t);
+
+public:
+    t_machine_vector();
+    void init();
+    void load_program(const std::vector<char>&, t_addr);
+    void set_program_counter(t_addr);
+    void set_registers(int, const t_registers&);
+    t_registers get_registers(int);
+    void write_memory(int, t_addr, char);
+    char read_memory(int, t_addr);
+    unsigned long get_step_counter(int);
+    t_cycles get_cycle_counter(int);
+    t_stop get_stop(int);
+    void set_stop_pc(t_addr);
+    void set_max_groups(unsigned);
+    unsigned long get_fallbacks();
+    void run(unsigned long);
+};
@@ -6,7 +6,13 @@
 #include <functional>
 
 #include "machine.hpp"
+#include "jit.hpp"
+#include "opcodes.hpp"
+#include "trace.hpp"
 #include "misc.hpp"
+#include "profile.hpp"
+#include "record.hpp"
+#include "recomp.hpp"
 
 t_addr make_addr(char hi, char lo) {
     return (t_addr(hi) << 8) | lo;
@@ -19,22 +25,34 @@ void add_with_carry(char& x, char y, bool& c) {
     x = z;
 }
 
-const t_addr addr_ra = 0x10000;
-const t_addr addr_rx = 0x10001;
-const t_addr addr_ry = 0x10002;
-const t_addr addr_rp = 0x10003;
-const t_addr addr_sp = 0x10004;
+// the call graph of a profile follows jsr, brk and interrupts in and rts
+// and rti out, each call keeping the stack pointer from before it pushed
+#ifdef PROFILE
+#define PROFILE_SP(s) auto s = (unsigned char)(sp)
+#define PROFILE_CALL(call) \
+    do { \
+        if (profile) { \
+            profile->call; \
+        } \
+    } while (0)
+#else
+#define PROFILE_SP(s)
+#define PROFILE_CALL(call)
+#endif
 
 void t_machine::process_interrupt() {
+    total_cycles += 7;
     if (nmi_flag == 1) {
         nmi_flag = 0;
+        PROFILE_SP(s);
         push_addr(pc);
-        auto val = rp;
+        auto val = get_status();
         set_bit(val, 5, 1);
         set_bit(val, 4, 0);
         push(val);
         set_interrupt_disable_flag(1);
         pc = read_mem_2(0xfffa);
+        PROFILE_CALL(interrupt(pc, s));
     }
     if (reset_flag == 1) {
         reset_flag = 0;
@@ -42,23 +60,520 @@ void t_machine::process_interrupt() {
         pc = read_mem_2(0xfffc);
     } else if (irq_flag == 1) {
         irq_flag = 0;
+        PROFILE_SP(s);
         push_addr(pc);
-        auto val = rp;
+        auto val = get_status();
         set_bit(val, 5, 1);
         set_bit(val, 4, 0);
         push(val);
         set_interrupt_disable_flag(1);
         pc = read_mem_2(0xfffe);
+        PROFILE_CALL(interrupt(pc, s));
     }
 }
 
-int t_machine::step() {
+// Sets stop and returns true if process_interrupt() would push to or read
+// a vector from a watched address, for the checked threaded core.
+bool t_machine::watch_interrupt() {
+    auto s = sp;
+    auto hit = [this](std::array<std::uint64_t, 0x400>& map, t_addr addr,
+                      t_stop_reason reason) {
+        if (map[addr >> 6] >> (addr & 63) & 1) {
+            stop = {reason, addr};
+            return true;
+        }
+        return false;
+    };
+    auto vector = [&](t_addr addr) {
+        return hit(read_map, addr, stop_read) ||
+               hit(read_map, addr + 1, stop_read);
+    };
+    auto entry = [&](t_addr addr) {
+        for (int i = 0; i < 3; i++, s--) {
+            if (hit(write_map, 0x100 + s, stop_write)) {
+                return true;
+            }
+        }
+        return vector(addr);
+    };
+    if (nmi_flag == 1 && entry(0xfffa)) {
+        return true;
+    }
+    if (reset_flag == 1) {
+        return vector(0xfffc);
+    }
+    return irq_flag == 1 && entry(0xfffe);
+}
+
+// Lists the bytes the instruction at pc reads and writes other than its
+// own, in the order the checked threaded core tests them; five at most.
+// A pointer on a device page reads as 0.
+unsigned t_machine::next_accesses(t_access* list) {
+    unsigned n = 0;
+    auto add = [&](t_addr addr, bool write) {
+        list[n++] = {addr, write};
+    };
+    auto op = peek(pc);
+    auto in = decode(op);
+    t_addr lo = (unsigned char)(peek(pc + 1));
+    t_addr hi = (unsigned char)(peek(pc + 2));
+    auto s = sp;
+    switch (in.op) {
+    case op_pha: case op_php:
+        add(0x100 + s, true);
+        return n;
+    case op_pla: case op_plp:
+        add(0x100 + char(s + 1), false);
+        return n;
+    case op_jsr:
+        add(0x100 + s, true);
+        add(0x100 + char(s - 1), true);
+        return n;
+    case op_rts:
+        add(0x100 + char(s + 1), false);
+        add(0x100 + char(s + 2), false);
+        return n;
+    case op_brk:
+        add(0x100 + s, true);
+        add(0x100 + char(s - 1), true);
+        add(0x100 + char(s - 2), true);
+        add(0xfffe, false);
+        add(0xffff, false);
+        return n;
+    case op_rti:
+        add(0x100 + char(s + 1), false);
+        add(0x100 + char(s + 2), false);
+        add(0x100 + char(s + 3), false);
+        return n;
+    default: break;
+    }
+    t_addr ea;
+    switch (in.mode) {
+    case mode_zpg: ea = lo; break;
+    case mode_zpx: ea = char(lo + rx); break;
+    case mode_zpy: ea = char(lo + ry); break;
+    case mode_abs: ea = lo | hi << 8; break;
+    case mode_abx: ea = ((lo | hi << 8) + rx) & 0xffff; break;
+    case mode_aby: ea = ((lo | hi << 8) + ry) & 0xffff; break;
+    case mode_ind:
+        ea = lo | hi << 8;
+        add(ea, false);
+        add((ea + 1) & 0xffff, false);
+        return n;
+    case mode_inx:
+        ea = char(lo + rx);
+        add(ea, false);
+        add(ea + 1, false);
+        ea = (unsigned char)(peek(ea)) |
+             t_addr((unsigned char)(peek(ea + 1))) << 8;
+        break;
+    case mode_iny:
+        ea = lo;
+        add(ea, false);
+        add(char(ea + 1), false);
+        ea = (unsigned char)(peek(ea)) |
+             t_addr((unsigned char)(peek(char(ea + 1)))) << 8;
+        ea = (ea + ry) & 0xffff;
+        break;
+    default:
+        return n;
+    }
+    switch (in.op) {
+    case op_jmp:
+        break;
+    case op_sta: case op_stx: case op_sty:
+        add(ea, true);
+        break;
+    case op_inc: case op_dec: case op_asl: case op_lsr: case op_rol:
+    case op_ror:
+        add(ea, false);
+        add(ea, true);
+        break;
+    default:
+        add(ea, false);
+        break;
+    }
+    return n;
+}
+
+// sets stop and returns true if the instruction at pc would access a
+// watched byte
+bool t_machine::watch_step() {
+    t_access list[5];
+    auto n = next_accesses(list);
+    for (unsigned i = 0; i < n; i++) {
+        auto addr = list[i].addr;
+        auto& map = list[i].write ? write_map : read_map;
+        if (map[addr >> 6] >> (addr & 63) & 1) {
+            stop = {list[i].write ? stop_write : stop_read, addr};
+            return true;
+        }
+    }
+    return false;
+}
+
+// a byte as the program would read it, but 0 on a device, which is left
+// unread
+char t_machine::peek(t_addr addr) {
+    auto page = page_read[(addr >> 8) & 0xff];
+    return page ? page[addr & 0xff] : char(0);
+}
+
+bool t_machine::interrupt_pending() {
     auto idf = get_interrupt_disable_flag();
-    if (nmi_flag || (idf == 0 && (reset_flag || irq_flag))) {
+    return nmi_flag || (idf == 0 && (reset_flag || irq_flag));
+}
+
+int t_machine::step() {
+    if (!events.empty()) {
+        fire_events();
+    }
+    running = true;
+    auto ret = step_run();
+    end_run();
+    return ret;
+}
+
+int t_machine::step_run() {
+    if (undo_log) {
+        return step_logged();
+    }
+#ifdef PROFILE
+    if (profile) {
+        return step_switch();
+    }
+#endif
+    if (core == core_threaded && !bus_pages) {
+        return exec_threaded(1);
+    }
+    if (core == core_cached && !bus_pages) {
+        return exec_cached(1);
+    }
+    return step_switch();
+}
+
+// returns 0 once count steps ran, -1 on an illegal opcode and 1 when
+// stopped by a breakpoint, see get_stop()
+int t_machine::exec(unsigned long count) {
+    if (!events.empty()) {
+        return exec_events(count);
+    }
+    return exec_slice(count);
+}
+
+// Runs straight up to the next event, takes the events due and goes on. As
+// in run_until(), no instruction of a slice starts at or past the deadline,
+// so an event is taken at the first instruction boundary at or past it.
+int t_machine::exec_events(unsigned long count) {
+    while (true) {
+        fire_events();
+        if (count == 0) {
+            return 0;
+        }
+        auto n = count;
+        if (!events.empty()) {
+            auto gap = events.front().at - total_cycles;
+            n = std::min<t_cycles>(n, (gap + 6) / 7);
+        }
+        auto ret = exec_slice(n);
+        if (ret != 0) {
+            return ret;
+        }
+        count -= n;
+    }
+}
+
+// a run, the lines raised during it waiting for its end
+int t_machine::exec_slice(unsigned long count) {
+    running = true;
+    auto ret = exec_run(count);
+    end_run();
+    return ret;
+}
+
+int t_machine::exec_run(unsigned long count) {
+    if (undo_log) {
+        return exec_stepped(count);
+    }
+#ifdef PROFILE
+    if (profile) {
+        return exec_stepped(count);
+    }
+#endif
+    if (watch_count || step_limit || idle_mode || bus_pages || trace) {
+        return exec_checked(count);
+    }
+    return exec_core(count);
+}
+
+// exec() with breakpoints or idle detection armed, pages mapped away from
+// ram or a trace attached. Except for a step limit, which only shortens the
+// run, they need the checked threaded core whatever core is selected; a
+// trace alone takes the traced one, which checks nothing else.
+int t_machine::exec_checked(unsigned long count) {
+    if (step_limit) {
+        if (step_count >= step_limit) {
+            stop = {stop_steps, pc};
+            return 1;
+        }
+        count = std::min(count, step_limit - step_count);
+    }
+    int ret;
+    if (watch_count || idle_mode || bus_pages) {
+        ret = exec_watched(count);
+    } else if (trace) {
+        ret = exec_traced(count);
+    } else {
+        ret = exec_core(count);
+    }
+    if (ret == 0 && step_limit && step_count >= step_limit) {
+        stop = {stop_steps, pc};
+        return 1;
+    }
+    return ret;
+}
+
+int t_machine::exec_core(unsigned long count) {
+    if (core == core_threaded) {
+        return exec_threaded(count);
+    }
+    if (core == core_cached) {
+        return exec_cached(count);
+    }
+    if (core == core_jit) {
+        return exec_jit(count);
+    }
+    if (core == core_recompiled) {
+        return exec_recompiled(count);
+    }
+    // with none latched, no interrupt can become pending until the run
+    // ends: events are taken between runs
+    if (!nmi_flag && !reset_flag && !irq_flag) {
+        for (; count > 0; count--) {
+            if (step_instruction() < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for (; count > 0; count--) {
+        auto ret = step_switch();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// The switch core a step at a time, as a profile and the undo log need.
+// It stops where the checked threaded core would: at pc breakpoints, the
+// step limit, an access to a watched byte, found ahead of the step with
+// next_accesses() or watch_interrupt(), and with idle_trap in an idle
+// loop, found as IDLE_CHECK does. With idle_skip the loop's iterations
+// just run. A trace records each instruction.
+int t_machine::exec_stepped(unsigned long count) {
+    // the target of the last backward jump or branch, as it was reached
+    struct {
+        t_addr pc;
+        unsigned long writes;
+        char a, x, y, s, p;
+    } loop{0x10000, 0, 0, 0, 0, 0, 0};
+    unsigned long writes = 0;
+    for (; count > 0; count--) {
+        if (step_limit && step_count >= step_limit) {
+            stop = {stop_steps, pc};
+            return 1;
+        }
+        auto pending = interrupt_pending();
+        // nothing stops the instruction a run resumes from
+        if (pc != resume_pc) {
+            if (break_map[(pc >> 6) & 0x3ff] >> (pc & 63) & 1) {
+                stop = {stop_break, pc};
+                resume_pc = pc;
+                return 1;
+            }
+            if (watch_count && (pending ? watch_interrupt() : watch_step())) {
+                resume_pc = pc;
+                return 1;
+            }
+        }
+        resume_pc = 0x10000;
+        auto at = pc;
+        auto op = peek(pc);
+        if (!pending && trace) {
+            trace->record(pc, op, peek(pc + 1), peek(pc + 2), ra, rx, ry, sp,
+                          get_status(), total_cycles);
+        }
+        if (!pending && idle_mode == idle_trap) {
+            t_access list[5];
+            auto n = next_accesses(list);
+            for (unsigned i = 0; i < n; i++) {
+                writes += list[i].write;
+            }
+        }
+        auto ret = step_logged();
+        if (ret < 0) {
+            return ret;
+        }
+        if (!pending && idle_mode == idle_trap && pc <= at &&
+            ((unsigned char)(op) == 0x4c || decode(op).mode == mode_rel)) {
+            auto p = get_status();
+            if (pc == loop.pc && writes + io_count == loop.writes &&
+                ra == loop.a && rx == loop.x && ry == loop.y &&
+                sp == loop.s && p == loop.p) {
+                stop = {stop_trap, pc};
+                return 1;
+            }
+            loop = {pc, writes + io_count, ra, rx, ry, sp, p};
+        }
+    }
+    return 0;
+}
+
+int t_machine::exec_jit(unsigned long count) {
+    while (count > 0) {
+        if (jit && pc < 0x10000 && !interrupt_pending()) {
+            auto code = jit->lookup(pc);
+            if (code) {
+                auto& ctx = jit->ctx;
+                ctx.pc = pc;
+                ctx.ra = ra;
+                ctx.rx = rx;
+                ctx.ry = ry;
+                ctx.rp = get_status();
+                ctx.sp = sp;
+                ctx.budget = count;
+                ctx.cycles = total_cycles;
+                ctx.link = nullptr;
+                ctx.bail = 0;
+                ctx.irq = reset_flag || irq_flag;
+                jit->enter(code);
+                pc = ctx.pc;
+                ra = ctx.ra;
+                rx = ctx.rx;
+                ry = ctx.ry;
+                set_status(ctx.rp);
+                total_cycles = ctx.cycles;
+                sp = ctx.sp;
+                auto n = count - ctx.budget;
+                step_count += n;
+                count -= n;
+                if (ctx.link) {
+                    jit->link(ctx.link, pc);
+                }
+                if (!ctx.bail || count == 0) {
+                    continue;
+                }
+                // a block longer than the steps left bails at once, as a
+                // run sliced up to an event ends; finish such a short run
+                // here rather than entering and bailing at every step
+                if (n == 0 && count < t_jit::max_block) {
+                    for (; count > 0; count--) {
+                        if (step_switch() < 0) {
+                            return -1;
+                        }
+                    }
+                    return 0;
+                }
+            }
+        }
+        // not translated, or handed back by a block
+        auto ret = step_switch();
+        if (ret < 0) {
+            return ret;
+        }
+        count--;
+    }
+    return 0;
+}
+
+// Runs recompiled code from where it has a live block, the switch core
+// anywhere else; an interrupt is taken between the runs.
+int t_machine::exec_recompiled(unsigned long count) {
+    if (recomp) {
+        recomp->check();
+    }
+    while (count > 0) {
+        if (recomp && pc < 0x10000 && recomp->lookup(pc) &&
+            !interrupt_pending()) {
+            auto& ctx = recomp->ctx;
+            ctx.pc = pc;
+            ctx.ra = ra;
+            ctx.rx = rx;
+            ctx.ry = ry;
+            ctx.rp = get_status();
+            ctx.sp = sp;
+            ctx.budget = count;
+            ctx.cycles = total_cycles;
+            ctx.irq = reset_flag || irq_flag;
+            recomp->enter();
+            pc = ctx.pc;
+            ra = ctx.ra;
+            rx = ctx.rx;
+            ry = ctx.ry;
+            set_status(ctx.rp);
+            total_cycles = ctx.cycles;
+            sp = ctx.sp;
+            auto n = count - ctx.budget;
+            step_count += n;
+            count -= n;
+            for (unsigned i = 0; i < ctx.writes; i++) {
+                invalidate_code(ctx.written[i]);
+            }
+            if (n) {
+                continue;
+            }
+        }
+        // not translated, or too long for the steps left
+        auto ret = step_switch();
+        if (ret < 0) {
+            return ret;
+        }
+        count--;
+    }
+    return 0;
+}
+
+int t_machine::step_switch() {
+    if (interrupt_pending()) {
         process_interrupt();
         step_count++;
         return 0;
     }
+    return step_instruction();
+}
+
+// step_switch(), logging the state before it when the undo log is on; an
+// illegal opcode changes nothing but pc, which the step before it restores
+int t_machine::step_logged() {
+    if (!undo_log) {
+        return step_switch();
+    }
+    t_undo_entry e{std::uint16_t(pc), sp, ra, rx, ry, get_status(),
+                   char(0x80 | reset_flag << 6 | nmi_flag << 5 |
+                        irq_flag << 4)};
+    auto cycles = total_cycles;
+    auto ret = step_switch();
+    if (ret == 0) {
+        e.info |= total_cycles - cycles;
+        log_undo(e);
+    }
+    return ret;
+}
+
+// appends to the undo log, dropping the oldest step when it is full
+void t_machine::log_undo(const t_undo_entry& e) {
+    if (undo_head - undo_tail > undo_mask) {
+        while (!(undo_log[undo_tail++ & undo_mask].info & 0x80)) {
+        }
+    }
+    undo_log[undo_head++ & undo_mask] = e;
+}
+
+int t_machine::step_instruction() {
+#ifdef PROFILE
+    auto at = pc;
+#endif
 
     // fetch an instruction
     auto opcode = read_mem(pc);
@@ -97,26 +612,26 @@ int t_machine::step() {
     case 0x24: m_zpg(); i_bit(); break;
     case 0x2c: m_abs(); i_bit(); break;
 
-    case 0xa9: m_imm(); i_lda(); break;
-    case 0xa5: m_zpg(); i_lda(); break;
-    case 0xb5: m_zpx(); i_lda(); break;
-    case 0xad: m_abs(); i_lda(); break;
-    case 0xbd: m_abx(); i_lda(); break;
-    case 0xb9: m_aby(); i_lda(); break;
-    case 0xa1: m_inx(); i_lda(); break;
-    case 0xb1: m_iny(); i_lda(); break;
-
-    case 0xa2: m_imm(); i_ldx(); break;
-    case 0xa6: m_zpg(); i_ldx(); break;
-    case 0xb6: m_zpy(); i_ldx(); break;
-    case 0xae: m_abs(); i_ldx(); break;
-    case 0xbe: m_aby(); i_ldx(); break;
-
-    case 0xa0: m_imm(); i_ldy(); break;
-    case 0xa4: m_zpg(); i_ldy(); break;
-    case 0xb4: m_zpx(); i_ldy(); break;
-    case 0xac: m_abs(); i_ldy(); break;
-    case 0xbc: m_abx(); i_ldy(); break;
+    case 0xa9: m_imm(); i_ld<op_ra>(); break;
+    case 0xa5: m_zpg(); i_ld<op_ra>(); break;
+    case 0xb5: m_zpx(); i_ld<op_ra>(); break;
+    case 0xad: m_abs(); i_ld<op_ra>(); break;
+    case 0xbd: m_abx(); i_ld<op_ra>(); break;
+    case 0xb9: m_aby(); i_ld<op_ra>(); break;
+    case 0xa1: m_inx(); i_ld<op_ra>(); break;
+    case 0xb1: m_iny(); i_ld<op_ra>(); break;
+
+    case 0xa2: m_imm(); i_ld<op_rx>(); break;
+    case 0xa6: m_zpg(); i_ld<op_rx>(); break;
+    case 0xb6: m_zpy(); i_ld<op_rx>(); break;
+    case 0xae: m_abs(); i_ld<op_rx>(); break;
+    case 0xbe: m_aby(); i_ld<op_rx>(); break;
+
+    case 0xa0: m_imm(); i_ld<op_ry>(); break;
+    case 0xa4: m_zpg(); i_ld<op_ry>(); break;
+    case 0xb4: m_zpx(); i_ld<op_ry>(); break;
+    case 0xac: m_abs(); i_ld<op_ry>(); break;
+    case 0xbc: m_abx(); i_ld<op_ry>(); break;
 
     case 0x85: m_zpg(); i_sta(); break;
     case 0x95: m_zpx(); i_sta(); break;
@@ -134,50 +649,50 @@ int t_machine::step() {
     case 0x94: m_zpx(); i_sty(); break;
     case 0x8c: m_abs(); i_sty(); break;
 
-    case 0xaa: m_imp(); i_tax(); break;
-    case 0xa8: m_imp(); i_tay(); break;
-    case 0x8a: m_imp(); i_txa(); break;
-    case 0x98: m_imp(); i_tya(); break;
-
-    case 0xe6: m_zpg(); i_inc(); break;
-    case 0xf6: m_zpx(); i_inc(); break;
-    case 0xee: m_abs(); i_inc(); break;
-    case 0xfe: m_abx(); i_inc(); break;
-    case 0xe8: m_imp(); i_inx(); break;
-    case 0xc8: m_imp(); i_iny(); break;
-
-    case 0xc6: m_zpg(); i_dec(); break;
-    case 0xd6: m_zpx(); i_dec(); break;
-    case 0xce: m_abs(); i_dec(); break;
-    case 0xde: m_abx(); i_dec(); break;
-    case 0xca: m_imp(); i_dex(); break;
-    case 0x88: m_imp(); i_dey(); break;
-
-    case 0x0a: m_acc(); i_asl(); break;
-    case 0x06: m_zpg(); i_asl(); break;
-    case 0x16: m_zpx(); i_asl(); break;
-    case 0x0e: m_abs(); i_asl(); break;
-    case 0x1e: m_abx(); i_asl(); break;
-
-    case 0x4a: m_acc(); i_lsr(); break;
-    case 0x46: m_zpg(); i_lsr(); break;
-    case 0x56: m_zpx(); i_lsr(); break;
-    case 0x4e: m_abs(); i_lsr(); break;
-    case 0x5e: m_abx(); i_lsr(); break;
-
-    case 0x2a: m_acc(); i_rol(); break;
-    case 0x26: m_zpg(); i_rol(); break;
-    case 0x36: m_zpx(); i_rol(); break;
-    case 0x2e: m_abs(); i_rol(); break;
-    case 0x3e: m_abx(); i_rol(); break;
-
-    case 0x6a: m_acc(); i_ror(); break;
-    case 0x66: m_zpg(); i_ror(); break;
-    case 0x76: m_zpx(); i_ror(); break;
-    case 0x6e: m_abs(); i_ror(); break;
-    case 0x7e: m_abx(); i_ror(); break;
-
-    case 0xba: m_imp(); i_tsx(); break;
+    case 0xaa: m_imp(); i_t<op_rx, op_ra>(); break;
+    case 0xa8: m_imp(); i_t<op_ry, op_ra>(); break;
+    case 0x8a: m_imp(); i_t<op_ra, op_rx>(); break;
+    case 0x98: m_imp(); i_t<op_ra, op_ry>(); break;
+
+    case 0xe6: m_zpg(); i_inc<op_mem>(); break;
+    case 0xf6: m_zpx(); i_inc<op_mem>(); break;
+    case 0xee: m_abs(); i_inc<op_mem>(); break;
+    case 0xfe: m_abx(); i_inc<op_mem>(); break;
+    case 0xe8: m_imp(); i_inc<op_rx>(); break;
+    case 0xc8: m_imp(); i_inc<op_ry>(); break;
+
+    case 0xc6: m_zpg(); i_dec<op_mem>(); break;
+    case 0xd6: m_zpx(); i_dec<op_mem>(); break;
+    case 0xce: m_abs(); i_dec<op_mem>(); break;
+    case 0xde: m_abx(); i_dec<op_mem>(); break;
+    case 0xca: m_imp(); i_dec<op_rx>(); break;
+    case 0x88: m_imp(); i_dec<op_ry>(); break;
+
+    case 0x0a: m_acc(); i_asl<op_ra>(); break;
+    case 0x06: m_zpg(); i_asl<op_mem>(); break;
+    case 0x16: m_zpx(); i_asl<op_mem>(); break;
+    case 0x0e: m_abs(); i_asl<op_mem>(); break;
+    case 0x1e: m_abx(); i_asl<op_mem>(); break;
+
+    case 0x4a: m_acc(); i_lsr<op_ra>(); break;
+    case 0x46: m_zpg(); i_lsr<op_mem>(); break;
+    case 0x56: m_zpx(); i_lsr<op_mem>(); break;
+    case 0x4e: m_abs(); i_lsr<op_mem>(); break;
+    case 0x5e: m_abx(); i_lsr<op_mem>(); break;
+
+    case 0x2a: m_acc(); i_rol<op_ra>(); break;
+    case 0x26: m_zpg(); i_rol<op_mem>(); break;
+    case 0x36: m_zpx(); i_rol<op_mem>(); break;
+    case 0x2e: m_abs(); i_rol<op_mem>(); break;
+    case 0x3e: m_abx(); i_rol<op_mem>(); break;
+
+    case 0x6a: m_acc(); i_ror<op_ra>(); break;
+    case 0x66: m_zpg(); i_ror<op_mem>(); break;
+    case 0x76: m_zpx(); i_ror<op_mem>(); break;
+    case 0x6e: m_abs(); i_ror<op_mem>(); break;
+    case 0x7e: m_abx(); i_ror<op_mem>(); break;
+
+    case 0xba: m_imp(); i_t<op_rx, op_sp>(); break;
     case 0x9a: m_imp(); i_txs(); break;
     case 0x48: m_imp(); i_pha(); break;
     case 0x08: m_imp(); i_php(); break;
@@ -250,6 +765,12 @@ int t_machine::step() {
     }
 
     step_count++;
+    total_cycles += cyc;
+#ifdef PROFILE
+    if (profile) {
+        profile->count(at, opcode, cyc);
+    }
+#endif
     return 0;
 }
 
@@ -261,7 +782,6 @@ void t_machine::m_imp() {
 void t_machine::m_acc() {
     rcyc = 0;
     wcyc = 0;
-    set_arg(addr_ra, 0);
 }
 
 void t_machine::m_imm() {
@@ -346,18 +866,9 @@ void t_machine::m_iny() {
     wcyc = 4;
 }
 
-void t_machine::i_lda() {
-    set_with_flags(addr_ra, read_mem(arg));
-    cyc += 2 + rcyc;
-}
-
-void t_machine::i_ldx() {
-    set_with_flags(addr_rx, read_mem(arg));
-    cyc += 2 + rcyc;
-}
-
-void t_machine::i_ldy() {
-    set_with_flags(addr_ry, read_mem(arg));
+template <t_operand o>
+void t_machine::i_ld() {
+    set_with_flags<o>(read_mem(arg));
     cyc += 2 + rcyc;
 }
 
@@ -376,28 +887,9 @@ void t_machine::i_sty() {
     cyc += 2 + rcyc;
 }
 
-void t_machine::i_tax() {
-    set_with_flags(addr_rx, ra);
-    cyc += 2;
-}
-
-void t_machine::i_tay() {
-    set_with_flags(addr_ry, ra);
-    cyc += 2;
-}
-
-void t_machine::i_txa() {
-    set_with_flags(addr_ra, rx);
-    cyc += 2;
-}
-
-void t_machine::i_tya() {
-    set_with_flags(addr_ra, ry);
-    cyc += 2;
-}
-
-void t_machine::i_tsx() {
-    set_with_flags(addr_rx, sp);
+template <t_operand d, t_operand s>
+void t_machine::i_t() {
+    set_with_flags<d>(load<s>());
     cyc += 2;
 }
 
@@ -412,12 +904,12 @@ void t_machine::i_pha() {
 }
 
 void t_machine::i_pla() {
-    set_with_flags(addr_ra, pull());
+    set_with_flags<op_ra>(pull());
     cyc += 4;
 }
 
 void t_machine::i_php() {
-    auto val = rp;
+    auto val = get_status();
     set_bit(val, 5, 1);
     set_bit(val, 4, 1);
     push(val);
@@ -425,61 +917,43 @@ void t_machine::i_php() {
 }
 
 void t_machine::i_plp() {
-    rp = pull();
+    set_status(pull());
     cyc += 4;
 }
 
 void t_machine::i_and() {
-    set_with_flags(addr_ra, ra & read_mem(arg));
+    set_with_flags<op_ra>(ra & read_mem(arg));
     cyc += 2 + rcyc;
 }
 
 void t_machine::i_eor() {
-    set_with_flags(addr_ra, ra ^ read_mem(arg));
+    set_with_flags<op_ra>(ra ^ read_mem(arg));
     cyc += 2 + rcyc;
 }
 
 void t_machine::i_ora() {
-    set_with_flags(addr_ra, ra | read_mem(arg));
+    set_with_flags<op_ra>(ra | read_mem(arg));
     cyc += 2 + rcyc;
 }
 
 void t_machine::i_bit() {
     auto val = read_mem(arg);
-    set_zero_flag((ra & val) == 0);
+    zres = ra & val;
+    nres = val;
     set_overflow_flag(get_bit(val, 6));
-    set_negative_flag(get_bit(val, 7));
     cyc += 2 + rcyc;
 };
 
+template <t_operand o>
 void t_machine::i_inc() {
-    set_with_flags(arg, read_mem(arg) + 1);
-    cyc += 4 + wcyc;
+    set_with_flags<o>(load<o>() + 1);
+    cyc += (o == op_mem) ? 4 + wcyc : 2;
 }
 
+template <t_operand o>
 void t_machine::i_dec() {
-    set_with_flags(arg, read_mem(arg) - 1);
-    cyc += 4 + wcyc;
-}
-
-void t_machine::i_inx() {
-    set_with_flags(addr_rx, rx + 1);
-    cyc += 2;
-}
-
-void t_machine::i_dex() {
-    set_with_flags(addr_rx, rx - 1);
-    cyc += 2;
-}
-
-void t_machine::i_iny() {
-    set_with_flags(addr_ry, ry + 1);
-    cyc += 2;
-}
-
-void t_machine::i_dey() {
-    set_with_flags(addr_ry, ry - 1);
-    cyc += 2;
+    set_with_flags<o>(load<o>() - 1);
+    cyc += (o == op_mem) ? 4 + wcyc : 2;
 }
 
 void t_machine::i_jmp() {
@@ -488,13 +962,16 @@ void t_machine::i_jmp() {
 }
 
 void t_machine::i_jsr() {
+    PROFILE_SP(s);
     push_addr(pc - 1);
     pc = arg;
+    PROFILE_CALL(call(pc, s));
     cyc += 4 + rcyc;
 }
 
 void t_machine::i_rts() {
     pc = pull_addr() + 1;
+    PROFILE_CALL(ret(sp));
     cyc += 6;
 }
 
@@ -566,20 +1043,23 @@ void t_machine::i_bvs() {
 }
 
 void t_machine::i_brk() {
+    PROFILE_SP(s);
     push_addr(pc + 1);
-    auto val = rp;
+    auto val = get_status();
     set_bit(val, 5, 1);
     set_bit(val, 4, 1);
     push(val);
     pc = read_mem_2(0xfffe);
     set_break_flag(1);
     set_interrupt_disable_flag(1);
+    PROFILE_CALL(call(pc, s));
     cyc += 7;
 }
 
 void t_machine::i_rti() {
-    rp = pull();
+    set_status(pull());
     pc = pull_addr();
+    PROFILE_CALL(ret(sp));
     cyc += 6;
 }
 
@@ -587,38 +1067,42 @@ void t_machine::i_nop() {
     cyc += 2;
 }
 
+template <t_operand o>
 void t_machine::i_asl() {
-    auto val = read_mem(arg);
+    auto val = load<o>();
     set_carry_flag(get_bit(val, 7));
-    set_with_flags(arg, val << 1);
-    cyc += (arg == addr_ra) ? 2 : (4 + wcyc);
+    set_with_flags<o>(val << 1);
+    cyc += (o == op_mem) ? 4 + wcyc : 2;
 }
 
+template <t_operand o>
 void t_machine::i_lsr() {
-    auto val = read_mem(arg);
+    auto val = load<o>();
     set_carry_flag(get_bit(val, 0));
-    set_with_flags(arg, val >> 1);
-    cyc += (arg == addr_ra) ? 2 : (4 + wcyc);
+    set_with_flags<o>(val >> 1);
+    cyc += (o == op_mem) ? 4 + wcyc : 2;
 }
 
+template <t_operand o>
 void t_machine::i_rol() {
-    auto val = read_mem(arg);
+    auto val = load<o>();
     auto ca = get_carry_flag();
     set_carry_flag(get_bit(val, 7));
     val <<= 1;
     set_bit(val, 0, ca);
-    set_with_flags(arg, val);
-    cyc += (arg == addr_ra) ? 2 : (4 + wcyc);
+    set_with_flags<o>(val);
+    cyc += (o == op_mem) ? 4 + wcyc : 2;
 }
 
+template <t_operand o>
 void t_machine::i_ror() {
-    auto val = read_mem(arg);
+    auto val = load<o>();
     auto ca = get_carry_flag();
     set_carry_flag(get_bit(val, 0));
     val >>= 1;
     set_bit(val, 7, ca);
-    set_with_flags(arg, val);
-    cyc += (arg == addr_ra) ? 2 : (4 + wcyc);
+    set_with_flags<o>(val);
+    cyc += (o == op_mem) ? 4 + wcyc : 2;
 }
 
 void t_machine::i_adc() {
@@ -629,7 +1113,7 @@ void t_machine::i_adc() {
     auto a7 = get_bit(ra, 7);
     auto b7 = get_bit(v, 7);
     res += v;
-    set_with_flags(addr_ra, res);
+    set_with_flags<op_ra>(res);
     auto c7 = get_bit(ra, 7);
     if (ca == 1 && v == 0x80u) {
         set_overflow_flag(a7 == 0);
@@ -648,7 +1132,7 @@ void t_machine::i_sbc() {
     auto a7 = get_bit(ra, 7);
     auto b7 = get_bit(xx, 7);
     res -= xx;
-    set_with_flags(addr_ra, res);
+    set_with_flags<op_ra>(res);
     auto c7 = get_bit(ra, 7);
     if (nc == 1 && xx == 0x80u) {
         set_overflow_flag(a7 == 1);
@@ -662,65 +1146,592 @@ void t_machine::i_sbc() {
 void t_machine::i_cmp() {
     auto val = read_mem(arg);
     set_carry_flag(ra >= val);
-    set_zero_flag(ra == val);
-    set_negative_flag(get_bit(ra - val, 7));
+    zres = ra - val;
+    nres = zres;
     cyc += 2 + rcyc;
 }
 
 void t_machine::i_cpx() {
     auto val = read_mem(arg);
     set_carry_flag(rx >= val);
-    set_zero_flag(rx == val);
-    set_negative_flag(get_bit(rx - val, 7));
+    zres = rx - val;
+    nres = zres;
     cyc += 2 + rcyc;
 }
 
 void t_machine::i_cpy() {
     auto val = read_mem(arg);
     set_carry_flag(ry >= val);
-    set_zero_flag(ry == val);
-    set_negative_flag(get_bit(ry - val, 7));
+    zres = ry - val;
+    nres = zres;
     cyc += 2 + rcyc;
 }
 
 void t_machine::run() {
-    while (true) {
-        auto ret = step();
-        if (ret < 0) {
+    while (exec(~0ul) == 0) {
+    }
+}
+
+t_run_result t_machine::run_for(t_cycles cycles) {
+    return run_until(total_cycles + cycles);
+}
+
+// runs until the cycle counter reaches the deadline; the last instruction
+// may go past it
+t_run_result t_machine::run_until(t_cycles deadline) {
+    auto cycles = total_cycles;
+    auto steps = step_count;
+    int ret = 0;
+    while (ret == 0 && total_cycles < deadline) {
+        // no instruction takes more than 7 cycles, so none of these can
+        // start at or past the deadline
+        ret = exec((deadline - total_cycles + 6) / 7);
+    }
+    return {total_cycles - cycles, step_count - steps, ret};
+}
+
+// The interrupt lines, latched until taken. A device raising one from its
+// read() or write() during a run has it seen once the run ends or reaches
+// an event; to be taken at a given cycle, schedule it.
+void t_machine::raise_irq() {
+    raise(line_irq);
+}
+
+void t_machine::raise_nmi() {
+    raise(line_nmi);
+}
+
+void t_machine::interrupt_reset() {
+    raise(line_reset);
+}
+
+// Between runs a line goes up at once, and into a recording with the cycle
+// count; during one it waits for the run to end. So lines only go up where
+// a run stopped, and a replay raises them at the same instruction boundary
+// whichever core runs it.
+void t_machine::raise(t_line line) {
+    if (running) {
+        raised |= 1 << line;
+        return;
+    }
+    if (recording) {
+        recording->inputs.push_back({total_cycles, line});
+    }
+    switch (line) {
+    case line_irq: irq_flag = 1; break;
+    case line_nmi: nmi_flag = 1; break;
+    case line_reset: reset_flag = 1; break;
+    }
+}
+
+void t_machine::end_run() {
+    running = false;
+    if (raised) {
+        auto lines = raised;
+        raised = 0;
+        for (auto line : {line_irq, line_nmi, line_reset}) {
+            if (lines & (1 << line)) {
+                raise(line);
+            }
+        }
+    }
+}
+
+static bool event_later(const t_event& e, const t_event& f) {
+    return e.at > f.at || (e.at == f.at && e.id > f.id);
+}
+
+unsigned long t_machine::add_event(t_cycles at, t_event_kind kind,
+                                   std::function<void(t_machine&)> call) {
+    events.push_back({at, ++event_id, kind, std::move(call)});
+    std::push_heap(events.begin(), events.end(), event_later);
+    return event_id;
+}
+
+// Raises an interrupt line once the cycle counter reaches at; returns an id
+// for cancel(). Events at the same cycle go in the order scheduled.
+unsigned long t_machine::schedule_irq(t_cycles at) {
+    return add_event(at, event_irq, nullptr);
+}
+
+unsigned long t_machine::schedule_nmi(t_cycles at) {
+    return add_event(at, event_nmi, nullptr);
+}
+
+// Calls a device back once the cycle counter reaches at. The callback may
+// raise interrupts, schedule more events, its next tick say, and change
+// the machine. Events belong to the machine until taken, cancelled or
+// dropped by init(); snapshots do not hold them.
+unsigned long t_machine::schedule(t_cycles at,
+                                  std::function<void(t_machine&)> call) {
+    return add_event(at, event_call, std::move(call));
+}
+
+// false if the event was taken already or never scheduled
+bool t_machine::cancel(unsigned long id) {
+    auto it = std::find_if(events.begin(), events.end(),
+                           [&](const t_event& e) { return e.id == id; });
+    if (it == events.end()) {
+        return false;
+    }
+    events.erase(it);
+    std::make_heap(events.begin(), events.end(), event_later);
+    return true;
+}
+
+// takes every event due at the current cycle count, in order
+void t_machine::fire_events() {
+    while (!events.empty() && events.front().at <= total_cycles) {
+        std::pop_heap(events.begin(), events.end(), event_later);
+        auto e = std::move(events.back());
+        events.pop_back();
+        switch (e.kind) {
+        case event_irq: raise(line_irq); break;
+        case event_nmi: raise(line_nmi); break;
+        case event_call: e.call(*this); break;
+        }
+    }
+}
+
+char t_machine::read_io(t_addr addr) {
+    io_count++;
+    if (replaying) {
+        // past the end of the log nothing drives the bus
+        auto& reads = replaying->reads;
+        return replay_read < reads.size() ? reads[replay_read++] : char(0xff);
+    }
+    auto val = page_io[addr >> 8]->read(addr);
+    if (recording) {
+        recording->reads.push_back(val);
+    }
+    return val;
+}
+
+void t_machine::write_io(t_addr addr, char val) {
+    io_count++;
+    if (!replaying) {
+        page_io[addr >> 8]->write(addr, val);
+    }
+}
+
+// Logs every interrupt line raised and every value read from a device into
+// the recording, which it clears first, and checkpoints the machine now and
+// every interval cycles, until init() or record(nullptr, 0).
+void t_machine::record(t_recording* r, t_cycles interval) {
+    if (recording) {
+        cancel(checkpoint_id);
+    }
+    recording = r;
+    if (!r) {
+        return;
+    }
+    end_replay();
+    *r = t_recording();
+    r->interval = std::max<t_cycles>(interval, 1);
+    checkpoint();
+    schedule_checkpoint(total_cycles + r->interval);
+}
+
+void t_machine::checkpoint() {
+    auto& checkpoints = recording->checkpoints;
+    auto s = snapshot();
+    if (!checkpoints.empty() && s.pages != checkpoints.back().state.pages) {
+        // keep the pages of the last one that did not change
+        auto pages = std::make_shared<t_pages>(*s.pages);
+        auto& last = *checkpoints.back().state.pages;
+        for (unsigned page = 0; page < 0x100; page++) {
+            auto& p = (*pages)[page];
+            if (p != last[page] && *p == *last[page]) {
+                p = last[page];
+            }
+        }
+        s.pages = pages;
+    }
+    checkpoints.push_back({s, recording->inputs.size(),
+                           recording->reads.size()});
+}
+
+// the checkpoints are events, so runs slice at them
+void t_machine::schedule_checkpoint(t_cycles at) {
+    checkpoint_id = schedule(at, [at](t_machine& m) {
+        m.checkpoint();
+        m.schedule_checkpoint(at + m.recording->interval);
+    });
+}
+
+// Replays a recording up to cycle at, as run_until() would run to it: from
+// the last checkpoint at or before at, with the lines raised where they
+// were and the values read from devices served from the log. Devices are
+// not called while replaying, but the machine has to map the pages the
+// recorded one mapped to them. Events scheduled before are dropped. The
+// replay goes on past at, until init() or end_replay(). Returns false if
+// the recording starts after at or the run stopped short of it.
+bool t_machine::seek(const t_recording& r, t_cycles at) {
+    auto cp = std::upper_bound(r.checkpoints.begin(), r.checkpoints.end(), at,
+                               [](t_cycles t, const t_checkpoint& c) {
+                                   return t < c.state.total_cycles;
+                               });
+    if (cp == r.checkpoints.begin()) {
+        return false;
+    }
+    cp--;
+    record(nullptr, 0);
+    events.clear();
+    restore(cp->state);
+    replaying = &r;
+    replay_input = cp->inputs;
+    replay_read = cp->reads;
+    schedule_input();
+    return run_until(at).ret == 0;
+}
+
+void t_machine::end_replay() {
+    replaying = nullptr;
+}
+
+// an event raising the next line of the log
+void t_machine::schedule_input() {
+    if (replay_input == replaying->inputs.size()) {
+        return;
+    }
+    schedule(replaying->inputs[replay_input].at, [](t_machine& m) {
+        if (m.replaying) {
+            m.raise(m.replaying->inputs[m.replay_input++].line);
+            m.schedule_input();
+        }
+    });
+}
+
+// Logs what each step of step() and exec() overwrites, so step_back() can
+// take it back: the registers, the latched lines and the counters, and
+// each byte written to ram, eight bytes an entry. The log is a ring of at
+// least entries entries, a step taking one and one more for each write,
+// and the oldest steps make room for new ones. 0 turns it off. While it is
+// on exec() runs the switch core a step at a time, which stops where the
+// other cores would, see exec_stepped(). Writes to devices, events taken
+// and changes made other than by a step are not logged; restore() and
+// reset_to_baseline() clear the log and init() turns it off.
+void t_machine::set_undo(std::size_t entries) {
+    undo_log.reset();
+    undo_mask = 0;
+    undo_head = 0;
+    undo_tail = 0;
+    if (entries) {
+        std::size_t size = 0x100;
+        while (size < entries) {
+            size <<= 1;
+        }
+        undo_log.reset(new t_undo_entry[size]);
+        undo_mask = size - 1;
+    }
+    count_bus_pages();
+}
+
+// Takes back the last step logged, putting back the bytes it wrote in the
+// reverse order; false if there is none. A run from here does not stop at
+// a breakpoint on the instruction it starts with.
+bool t_machine::step_back() {
+    if (undo_head == undo_tail) {
+        return false;
+    }
+    auto e = undo_log[--undo_head & undo_mask];
+    while (undo_head != undo_tail) {
+        auto& w = undo_log[(undo_head - 1) & undo_mask];
+        if (w.info) {
+            break;
+        }
+        undo_head--;
+        auto page = w.addr >> 8;
+        // unless mapped away since
+        if (page_write[page]) {
+            page_write[page][w.addr & 0xff] = w.ra;
+            page_dirty[page] = 1;
+            if (code_page[page]) {
+                invalidate_code(w.addr);
+            }
+        }
+    }
+    pc = e.addr;
+    sp = e.sp;
+    ra = e.ra;
+    rx = e.rx;
+    ry = e.ry;
+    set_status(e.rp);
+    reset_flag = e.info & 0x40;
+    nmi_flag = e.info & 0x20;
+    irq_flag = e.info & 0x10;
+    total_cycles -= e.info & 0x0f;
+    step_count--;
+    resume_pc = pc;
+    return true;
+}
+
+// steps back until pc is at addr; ret is 1 if the log ran out first
+t_run_result t_machine::run_back_until(t_addr addr) {
+    auto cycles = total_cycles;
+    auto steps = step_count;
+    int ret = 1;
+    while (step_back()) {
+        if (pc == (addr & 0xffff)) {
+            ret = 0;
             break;
         }
     }
+    return {cycles - total_cycles, steps - step_count, ret};
 }
 
-char t_machine::read_mem(t_addr addr) {
-    if (addr == addr_ra) {
-        return ra;
-    } else if (addr == addr_rx) {
-        return rx;
-    } else if (addr == addr_ry) {
-        return ry;
-    } else if (addr == addr_rp) {
-        return rp;
-    } else if (addr == addr_sp) {
-        return sp;
-    } else {
-        return memory[addr];
+// a write to a page without host memory to write to: a device, or rom
+void t_machine::write_fault(t_addr addr, char val) {
+    if (page_io[addr >> 8]) {
+        write_io(addr, val);
     }
 }
 
-void t_machine::write_mem(t_addr addr, char val) {
-    if (addr == addr_ra) {
-        ra = val;
-    } else if (addr == addr_rx) {
-        rx = val;
-    } else if (addr == addr_ry) {
-        ry = val;
-    } else if (addr == addr_rp) {
-        rp = val;
-    } else if (addr == addr_sp) {
-        sp = val;
-    } else {
-        memory[addr] = val;
+// for a page about to be written or mapped other than by a core, which
+// would mark it dirty
+void t_machine::unshare(unsigned page) {
+    page_shared[page] = 0;
+    if (--shared_count == 0) {
+        shared.reset();
+    }
+}
+
+// Maps a page to host memory, or back to the machine's own ram when data is
+// null. Pages sharing data mirror each other; writes to a read-only page are
+// dropped. Only step_switch() and the bus instance of the checked threaded
+// core look at the page table, so while any page is mapped elsewhere exec()
+// runs the latter.
+void t_machine::map_page(unsigned page, char* data, bool read_only) {
+    page &= 0xff;
+    if (page_shared[page]) {
+        unshare(page);
+    }
+    if (!data) {
+        data = &memory[page << 8];
+    }
+    page_read[page] = data;
+    page_write[page] = read_only ? nullptr : data;
+    page_io[page] = nullptr;
+    count_bus_pages();
+    flush_code();
+}
+
+// hands every access to the page to a device, which the caller owns
+void t_machine::map_io(unsigned page, t_io* io) {
+    page &= 0xff;
+    if (page_shared[page]) {
+        unshare(page);
+    }
+    page_read[page] = nullptr;
+    page_write[page] = nullptr;
+    page_io[page] = io;
+    count_bus_pages();
+    flush_code();
+}
+
+// an undo log takes every write through write_bus() too
+void t_machine::count_bus_pages() {
+    bus_pages = undo_log != nullptr;
+    for (unsigned page = 0; page < 0x100; page++) {
+        auto own = &memory[page << 8];
+        bus_pages += page_read[page] != own || page_write[page] != own;
+    }
+}
+
+// true if the page holds the page of the snapshot last taken or restored
+bool t_machine::is_shared(unsigned page) {
+    return page_shared[page] && page_dirty[page] != 1;
+}
+
+// Only copies the pages written since the snapshot last taken or restored,
+// and shares the rest with it; a snapshot right after a restore only copies
+// the registers. A page mapped to host memory is copied as the program
+// reads it, a device page from the machine's own memory.
+t_snapshot t_machine::snapshot() {
+    t_snapshot s{get_registers(), step_count, total_cycles, reset_flag,
+                 nmi_flag, irq_flag, shared};
+    auto all = shared_count == 0x100;
+    for (unsigned page = 0; all && page < 0x100; page++) {
+        all = is_shared(page);
+    }
+    if (all) {
+        return s;
+    }
+    auto pages = std::make_shared<t_pages>();
+    unsigned long count = 0;
+    for (unsigned page = 0; page < 0x100; page++) {
+        auto own = memory.begin() + (page << 8);
+        if (is_shared(page)) {
+            (*pages)[page] = (*shared)[page];
+        } else {
+            auto from = page_read[page] ? page_read[page] : &*own;
+            auto copy = std::make_shared<t_page>();
+            std::copy(from, from + 0x100, copy->begin());
+            (*pages)[page] = copy;
+        }
+        page_shared[page] = page_read[page] == &*own;
+        if (page_shared[page]) {
+            // dirty still, but not since the snapshot
+            if (page_dirty[page]) {
+                page_dirty[page] = 2;
+            }
+            count++;
+        }
+    }
+    s.pages = pages;
+    shared = pages;
+    shared_count = count;
+    return s;
+}
+
+// Returns to a snapshot. Its ram and rom pages are copied back into the
+// machine's own memory, but for those that still hold the same page of the
+// snapshot last taken or restored, so the page table stays as it was and a
+// core writes to the pages as usual. Pages mapped elsewhere keep their
+// mapping, and are written back through it unless read-only.
+void t_machine::restore(const t_snapshot& s) {
+    set_registers(s.registers);
+    step_count = s.step_count;
+    total_cycles = s.total_cycles;
+    reset_flag = s.reset_flag;
+    nmi_flag = s.nmi_flag;
+    irq_flag = s.irq_flag;
+    unsigned long count = 0;
+    bool code = false;
+    for (unsigned page = 0; page < 0x100; page++) {
+        auto own = &memory[page << 8];
+        auto& data = *(*s.pages)[page];
+        auto same = is_shared(page) && (*shared)[page] == (*s.pages)[page];
+        auto to = page_read[page] && page_read[page] != own ?
+                  page_write[page] : own;
+        if (!same && to) {
+            std::copy(data.begin(), data.end(), to);
+            page_dirty[page] = 2;
+            code |= code_page[page] != 0;
+        }
+        page_shared[page] = page_read[page] == own;
+        count += page_shared[page];
+    }
+    shared = s.pages;
+    shared_count = count;
+    if (!count) {
+        shared.reset();
+    }
+    undo_head = undo_tail;
+    if (code) {
+        flush_code();
+    }
+}
+
+// A machine like this one, down to the core, the page table and the
+// breakpoints. Only snapshots share pages: a machine's ram is one array the
+// cores index directly, so the new one is allocated, cleared and given a
+// copy of all 64 KB, see fork_bench(). For many branches from one state,
+// restoring a snapshot into a machine at hand only copies the pages the
+// last branch wrote.
+std::unique_ptr<t_machine> t_machine::fork() {
+    auto s = snapshot();
+    restore(s);
+    std::unique_ptr<t_machine> m(new t_machine);
+    m->set_core(core);
+    m->fusion = fusion;
+    for (unsigned page = 0; page < 0x100; page++) {
+        auto own = &memory[page << 8];
+        if (page_io[page]) {
+            m->map_io(page, page_io[page]);
+        } else if (page_read[page] != own) {
+            m->map_page(page, page_read[page], !page_write[page]);
+        } else if (!page_write[page]) {
+            m->map_page(page, nullptr, true);
+        }
+    }
+    m->break_map = break_map;
+    m->read_map = read_map;
+    m->write_map = write_map;
+    m->watch_count = watch_count;
+    m->step_limit = step_limit;
+    m->resume_pc = resume_pc;
+    m->idle_mode = idle_mode;
+    m->restore(s);
+    return m;
+}
+
+// the state reset_to_baseline() returns to
+void t_machine::set_baseline() {
+    baseline = snapshot();
+    for (unsigned page = 0; page < 0x100; page++) {
+        page_stale[page] |= page_dirty[page] != 0;
+    }
+    page_dirty.fill(0);
+}
+
+// Back to the state set_baseline() saved, with breakpoints, mapping and
+// core kept. Only the pages written since are copied back, which for short
+// runs is far cheaper than init() and load_program(); a page mapped to
+// host memory through the mapping, unless read-only or a device. Without
+// a baseline it is init().
+void t_machine::reset_to_baseline() {
+    if (!baseline.pages) {
+        init();
+        return;
+    }
+    set_registers(baseline.registers);
+    step_count = baseline.step_count;
+    total_cycles = baseline.total_cycles;
+    reset_flag = baseline.reset_flag;
+    nmi_flag = baseline.nmi_flag;
+    irq_flag = baseline.irq_flag;
+    cyc = 0;
+    resume_pc = 0x10000;
+    undo_head = undo_tail;
+    bool code = false;
+    for (unsigned page = 0; page < 0x100; page++) {
+        if (!page_dirty[page]) {
+            continue;
+        }
+        if (page_shared[page]) {
+            unshare(page);
+        }
+        auto own = &memory[page << 8];
+        auto to = page_read[page] != own ? page_write[page] : own;
+        if (to) {
+            auto& data = *(*baseline.pages)[page];
+            std::copy(data.begin(), data.end(), to);
+            code |= code_page[page] != 0;
+        }
+    }
+    page_dirty.fill(0);
+    if (code) {
+        flush_code();
+    }
+}
+
+// a write to a page flagged in code_page; decoded instructions ending on
+// the page may start on the one before
+void t_machine::invalidate_code(t_addr addr) {
+    auto page = addr >> 8;
+    page_gen[page]++;
+    if ((addr & 0xff) < 2) {
+        page_gen[(page - 1) & 0xff]++;
+    }
+    if (jit) {
+        jit->invalidate(addr);
+    }
+    if (recomp) {
+        recomp->invalidate(addr);
+    }
+}
+
+void t_machine::flush_code() {
+    std::fill(code_page.begin(), code_page.end(), 0);
+    for (auto& g : page_gen) {
+        g++;
+    }
+    if (jit) {
+        jit->flush();
+    }
+    if (recomp) {
+        recomp->flush();
     }
 }
 
@@ -730,10 +1741,33 @@ t_addr t_machine::read_mem_2(t_addr addr) {
     return make_addr(u, v);
 }
 
-void t_machine::set_with_flags(t_addr addr, char v) {
-    write_mem(addr, v);
-    set_zero_flag(v == 0);
-    set_negative_flag(get_bit(v, 7));
+template <t_operand o>
+char t_machine::load() {
+    switch (o) {
+    case op_ra: return ra;
+    case op_rx: return rx;
+    case op_ry: return ry;
+    case op_sp: return sp;
+    default: return read_mem(arg);
+    }
+}
+
+template <t_operand o>
+void t_machine::store(char v) {
+    switch (o) {
+    case op_ra: ra = v; break;
+    case op_rx: rx = v; break;
+    case op_ry: ry = v; break;
+    case op_sp: sp = v; break;
+    default: write_mem(arg, v); break;
+    }
+}
+
+template <t_operand o>
+void t_machine::set_with_flags(char v) {
+    store<o>(v);
+    zres = v;
+    nres = v;
 }
 
 void t_machine::push(char val) {
@@ -782,20 +1816,40 @@ void t_machine::set_arg(t_addr addr, int n) {
     pc += n;
 }
 
+// n, z, c and v are kept apart from rp: z is set when zres is zero and n
+// is bit 7 of nres, so most instructions just store their result
+
+char t_machine::get_status() {
+    char val = rp & 0x3c;
+    val |= carry;
+    val |= (zres == 0) << 1;
+    val |= overflow << 6;
+    val |= nres & 0x80;
+    return val;
+}
+
+void t_machine::set_status(char val) {
+    rp = val;
+    carry = get_bit(val, 0);
+    zres = !get_bit(val, 1);
+    overflow = get_bit(val, 6);
+    nres = val;
+}
+
 void t_machine::set_carry_flag(bool x) {
-    set_bit(rp, 0, x);
+    carry = x;
 }
 
 bool t_machine::get_carry_flag() {
-    return get_bit(rp, 0);
+    return carry;
 }
 
 void t_machine::set_zero_flag(bool x) {
-    set_bit(rp, 1, x);
+    zres = !x;
 }
 
 bool t_machine::get_zero_flag() {
-    return get_bit(rp, 1);
+    return zres == 0;
 }
 
 void t_machine::set_interrupt_disable_flag(bool x) {
@@ -807,19 +1861,19 @@ bool t_machine::get_interrupt_disable_flag() {
 }
 
 void t_machine::set_overflow_flag(bool x) {
-    set_bit(rp, 6, x);
+    overflow = x;
 }
 
 bool t_machine::get_overflow_flag() {
-    return get_bit(rp, 6);
+    return overflow;
 }
 
 void t_machine::set_negative_flag(bool x) {
-    set_bit(rp, 7, x);
+    nres = x ? 0x80 : 0;
 }
 
 bool t_machine::get_negative_flag() {
-    return get_bit(rp, 7);
+    return get_bit(nres, 7);
 }
 
 void t_machine::set_break_flag(bool x) {
@@ -844,17 +1898,41 @@ int t_machine::load_program_from_file(const std::string& file, t_addr addr) {
         return -1;
     }
     pc = addr;
+    for (auto page = pc >> 8; page < 0x100; page++) {
+        if (page_shared[page]) {
+            unshare(page);
+        }
+        page_dirty[page] = 1;
+    }
     input.read(&memory[pc], memory.size() - pc);
+    flush_code();
     return 0;
 }
 
 void t_machine::load_program(const std::vector<char>& v, t_addr addr) {
     pc = addr;
+    for (auto page = pc >> 8; page < (pc + v.size() + 0xff) >> 8; page++) {
+        if (page_shared[page]) {
+            unshare(page);
+        }
+        page_dirty[page] = 1;
+    }
     std::copy(v.begin(), v.end(), memory.begin() + pc);
+    flush_code();
 }
 
+// as the program would read it, but left out of a profile and of a
+// recording
 char t_machine::read_memory(t_addr addr) {
-    return read_mem(addr);
+    if (!bus_pages) {
+        return memory[addr & 0xffff];
+    }
+    auto page = page_read[(addr >> 8) & 0xff];
+    if (page) {
+        return page[addr & 0xff];
+    }
+    addr &= 0xffff;
+    return replaying ? char(0xff) : page_io[addr >> 8]->read(addr);
 }
 
 void t_machine::print_info() {
@@ -863,7 +1941,7 @@ void t_machine::print_info() {
     std::cout << " | y : "; print_hex(ry);
     std::cout << " | sp : "; print_hex(sp);
     std::cout << " | pc : "; print_hex(pc);
-    std::cout << " | p : "; print_hex(rp);
+    std::cout << " | p : "; print_hex(get_status());
     std::cout << " | sc : "; print_hex(step_count);
     std::cout << " |\n";
 }
@@ -872,20 +1950,208 @@ unsigned long t_machine::get_step_counter() {
     return step_count;
 }
 
+t_cycles t_machine::get_cycle_counter() {
+    return total_cycles;
+}
+
+void t_machine::set_watch(std::array<std::uint64_t, 0x400>& map, t_addr addr,
+                          bool on) {
+    auto& word = map[(addr >> 6) & 0x3ff];
+    auto bit = std::uint64_t(1) << (addr & 63);
+    if (bool(word & bit) != on) {
+        word ^= bit;
+        watch_count += on ? 1 : -1;
+    }
+}
+
+void t_machine::set_breakpoint(t_addr addr, bool on) {
+    set_watch(break_map, addr, on);
+}
+
+void t_machine::set_read_watch(t_addr addr, bool on) {
+    set_watch(read_map, addr, on);
+}
+
+void t_machine::set_write_watch(t_addr addr, bool on) {
+    set_watch(write_map, addr, on);
+}
+
+// stop once the step counter reaches n, 0 for no limit
+void t_machine::set_step_limit(unsigned long n) {
+    step_limit = n;
+}
+
+void t_machine::clear_breakpoints() {
+    break_map.fill(0);
+    read_map.fill(0);
+    write_map.fill(0);
+    watch_count = 0;
+    step_limit = 0;
+}
+
+void t_machine::set_idle_mode(t_idle mode) {
+    idle_mode = mode;
+}
+
+// Records every instruction exec() runs into the trace, which the caller
+// owns and keeps open, until init() or set_trace(nullptr). Like breakpoints
+// it takes the checked threaded core; step() is not traced.
+void t_machine::set_trace(t_trace* t) {
+    trace = t;
+}
+
+// Counts every instruction and memory access into the profile, which the
+// caller owns, until init() or set_profile(nullptr). The counting is in
+// the switch core, so a profiled exec() runs it whatever core is selected,
+// a step at a time; it stops where the other cores would, see
+// exec_stepped(). Returns false, counting nothing, unless built with
+// PROFILE.
+bool t_machine::set_profile(t_profile* p) {
+#ifdef PROFILE
+    profile = p;
+    heat_reads = p ? p->reads.data() : heat_sink.data();
+    heat_writes = p ? p->writes.data() : heat_sink.data();
+    return true;
+#else
+    (void)p;
+    return false;
+#endif
+}
+
+t_stop t_machine::run_to_stop(unsigned long count) {
+    auto ret = exec(count);
+    if (ret < 0) {
+        return {stop_illegal, (pc - 1) & 0xffff};
+    }
+    if (ret == 0) {
+        return {stop_count, pc};
+    }
+    return stop;
+}
+
+t_stop t_machine::get_stop() {
+    return stop;
+}
+
+void t_machine::set_core(t_core c) {
+    core = c;
+    flush_code();
+    if (core == core_cached && !decoded) {
+        decoded.reset(new t_decoded[0x10000]());
+    }
+    if (core == core_jit && !jit) {
+        jit.reset(new t_jit(memory.data(), code_page.data(),
+                           page_dirty.data()));
+    }
+}
+
+// Hands core_recompiled the code tools/recompile.cpp wrote for an image,
+// linked into the program; null drops it. A block runs wherever memory
+// holds the bytes it was translated from, and stores to it leave it to the
+// switch core. It is kept across init(), like the core.
+void t_machine::set_recompiled(const t_recompiled* code) {
+    recomp.reset(code ? new t_recomp(*code, memory.data(), code_page.data(),
+                                     page_dirty.data())
+                      : nullptr);
+    flush_code();
+}
+
+// Lets core_cached run the pairs of instructions it knows, one straight
+// after the other, as one, and the copy and fill loops it knows in bulk,
+// see threaded.cpp. It is on unless turned off, and kept across init(),
+// like the core.
+void t_machine::set_fusion(bool on) {
+    fusion = on;
+    flush_code();
+}
+
+// the dispatches fusion saved since init(): the instructions run as the
+// second of a pair
+unsigned long t_machine::get_fused_count() {
+    return fused_count;
+}
+
+t_core t_machine::get_core() {
+    return core;
+}
+
+t_registers t_machine::get_registers() {
+    return {pc, sp, ra, rx, ry, get_status()};
+}
+
+void t_machine::set_registers(const t_registers& r) {
+    pc = r.pc;
+    sp = r.sp;
+    ra = r.ra;
+    rx = r.rx;
+    ry = r.ry;
+    set_status(r.rp);
+}
+
 void t_machine::init() {
     pc = 0x0200;
     sp = 0xff;
     ra = 0x00;
     rx = 0x00;
     ry = 0x00;
-    rp = 0x24;
-    std::fill(memory.begin(), memory.end(), 0xff);
+    set_status(0x24);
+    // pages not written since the last init() are still 0xff
+    for (unsigned page = 0; page < 0x100; page++) {
+        if (page_dirty[page] || page_stale[page]) {
+            std::fill_n(memory.begin() + (page << 8), 0x100, 0xff);
+        }
+    }
+    page_dirty.fill(0);
+    page_stale.fill(0);
+    baseline = t_snapshot();
     nmi_flag = 0;
     irq_flag = 0;
     reset_flag = 0;
     step_count = 0;
+    total_cycles = 0;
+    cyc = 0;
+    clear_breakpoints();
+    resume_pc = 0x10000;
+    idle_mode = idle_off;
+    trace = nullptr;
+    events.clear();
+    running = false;
+    raised = 0;
+    recording = nullptr;
+    replaying = nullptr;
+    undo_log.reset();
+    undo_mask = 0;
+    undo_head = 0;
+    undo_tail = 0;
+    fused_count = 0;
+#ifdef PROFILE
+    set_profile(nullptr);
+#endif
+    for (unsigned page = 0; page < 0x100; page++) {
+        page_read[page] = &memory[page << 8];
+        page_write[page] = &memory[page << 8];
+        page_io[page] = nullptr;
+    }
+    bus_pages = 0;
+    io_count = 0;
+    shared.reset();
+    page_shared.fill(0);
+    shared_count = 0;
+    flush_code();
 }
 
 t_machine::t_machine() {
+    core = core_switch;
+    fusion = true;
+    page_gen.fill(0);
+    page_dirty.fill(1);
+    page_stale.fill(0);
+    event_id = 0;
+#ifdef PROFILE
+    heat_sink.resize(0x10000);
+#endif
     init();
 }
+
+t_machine::~t_machine() {
+}
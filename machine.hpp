@@ -1,9 +1,156 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 using t_addr = unsigned long;
+using t_cycles = std::uint64_t;
+
+// execution cores selectable at runtime
+enum t_core {
+    core_switch, // opcode switch in step()
+    core_threaded, // computed-goto dispatch, see threaded.cpp
+    core_cached, // threaded dispatch from predecoded instructions
+    core_jit, // x86-64 translation of basic blocks, see jit.cpp
+    core_recompiled // C++ translated ahead of time, see set_recompiled()
+};
+
+// an instruction of the predecoded cache used by core_cached
+struct t_decoded {
+    const void* handler;
+    std::uint32_t gen; // generation of its page when decoded
+    std::uint16_t operand; // operand, or target address of a branch
+    char len;
+    char cycles; // base cycles, or cycles of a taken branch
+};
+
+// where an instruction takes its operand from or leaves its result
+enum t_operand {
+    op_ra,
+    op_rx,
+    op_ry,
+    op_sp,
+    op_mem // memory at the effective address
+};
+
+// why exec() stopped early, or what ended run_to_stop()
+enum t_stop_reason {
+    stop_count, // ran the requested number of steps
+    stop_illegal, // illegal opcode
+    stop_break, // pc breakpoint
+    stop_read, // read watchpoint
+    stop_write, // write watchpoint
+    stop_steps, // step limit reached
+    stop_trap // idle loop, see set_idle_mode()
+};
+
+// what to do about code looping until an interrupt
+enum t_idle {
+    idle_off,
+    idle_trap, // stop with stop_trap
+    idle_skip // skip the iterations up to the end of the run
+};
+
+struct t_stop {
+    t_stop_reason reason;
+    t_addr addr; // instruction or watched address
+};
+
+class t_jit;
+class t_recomp;
+struct t_recompiled;
+class t_trace;
+struct t_profile;
+
+// a memory-mapped device, given the full address of each access
+class t_io {
+public:
+    virtual ~t_io() {}
+    virtual char read(t_addr) = 0;
+    virtual void write(t_addr, char) = 0;
+};
+
+class t_machine;
+struct t_recording;
+
+// the interrupt lines
+enum t_line {
+    line_irq,
+    line_nmi,
+    line_reset
+};
+
+enum t_event_kind {
+    event_irq, // raise_irq()
+    event_nmi, // raise_nmi()
+    event_call // a device callback
+};
+
+// something to happen once the cycle counter reaches at, see schedule()
+struct t_event {
+    t_cycles at;
+    unsigned long id; // in order of scheduling, which breaks ties
+    t_event_kind kind;
+    std::function<void(t_machine&)> call;
+};
+
+// what a call to run_for() or run_until() consumed
+struct t_run_result {
+    t_cycles cycles;
+    unsigned long steps;
+    int ret; // as returned by exec()
+};
+
+struct t_registers {
+    t_addr pc;
+    char sp;
+    char ra;
+    char rx;
+    char ry;
+    char rp;
+};
+
+// 256 bytes of ram; snapshots share the pages a machine did not write to
+// between them
+using t_page = std::array<char, 0x100>;
+using t_pages = std::array<std::shared_ptr<const t_page>, 0x100>;
+
+// registers, counters and ram as snapshot() found them; copies share the
+// pages
+struct t_snapshot {
+    t_registers registers;
+    unsigned long step_count;
+    t_cycles total_cycles;
+    bool reset_flag;
+    bool nmi_flag;
+    bool irq_flag;
+    std::shared_ptr<const t_pages> pages;
+};
+
+// an entry of the undo log: the state before a step, or a byte of ram the
+// step wrote over, logged ahead of the step's own entry; see set_undo()
+struct t_undo_entry {
+    std::uint16_t addr; // pc before the step, or the address written
+    char sp;
+    char ra; // or the byte written over
+    char rx;
+    char ry;
+    char rp;
+    // 0 for a write; for a step 0x80, the reset, nmi and irq lines latched
+    // before it as 0x40, 0x20 and 0x10, and its cycles
+    char info;
+};
+
+// a byte the next instruction reads or writes other than its own, see
+// next_accesses()
+struct t_access {
+    t_addr addr;
+    bool write;
+};
 
 class t_machine {
     t_addr arg;
@@ -11,13 +158,83 @@ class t_machine {
     unsigned rcyc;
     unsigned wcyc;
     unsigned long step_count;
+    t_cycles total_cycles;
 
     bool reset_flag;
     bool nmi_flag;
     bool irq_flag;
 
+    t_core core;
+
     std::array<char, 0x10000> memory;
 
+    // the page table: host memory to read and write each page, null for a
+    // device (or a read-only page when writing); see map_page()
+    std::array<char*, 0x100> page_read;
+    std::array<char*, 0x100> page_write;
+    std::array<t_io*, 0x100> page_io;
+    unsigned long bus_pages; // pages other than the machine's own ram
+    unsigned long io_count; // device accesses, for idle detection
+
+    // the snapshot last taken or restored; page_shared is set for a page
+    // of the machine's own memory that held the snapshot's page since, and
+    // still does unless page_dirty is 1, see restore()
+    std::shared_ptr<const t_pages> shared;
+    std::array<char, 0x100> page_shared;
+    unsigned long shared_count;
+
+    // pages written since init() or set_baseline(), only these are cleared
+    // or copied back, see reset_to_baseline(); 1 if by a core since the
+    // last snapshot() or restore(), which leave 2
+    std::array<char, 0x100> page_dirty;
+    // pages written before the last set_baseline(), which init() clears too
+    std::array<char, 0x100> page_stale;
+    t_snapshot baseline;
+
+    // pages holding translated or decoded code, see invalidate_code()
+    std::array<char, 0x100> code_page;
+    std::array<std::uint32_t, 0x100> page_gen;
+    std::unique_ptr<t_decoded[]> decoded;
+    bool fusion; // see set_fusion()
+    unsigned long fused_count;
+    std::unique_ptr<t_jit> jit;
+    std::unique_ptr<t_recomp> recomp;
+
+    // breakpoints, one bit per address, see exec_checked()
+    std::array<std::uint64_t, 0x400> break_map;
+    std::array<std::uint64_t, 0x400> read_map;
+    std::array<std::uint64_t, 0x400> write_map;
+    unsigned long watch_count; // bits set in the three maps
+    unsigned long step_limit; // 0 if none
+    t_stop stop;
+    t_addr resume_pc; // where a breakpoint stopped, 0x10000 if none
+    t_idle idle_mode;
+    t_trace* trace; // see set_trace()
+    std::vector<t_event> events; // a heap, the next one first
+    unsigned long event_id;
+    // lines raised during a run wait for its end, see raise()
+    bool running;
+    char raised;
+    t_recording* recording; // see record()
+    unsigned long checkpoint_id; // the event taking the next checkpoint
+    const t_recording* replaying; // see seek()
+    std::size_t replay_input; // the next entries of its logs
+    std::size_t replay_read;
+    // the undo log, a ring of undo_mask + 1 entries holding those from
+    // undo_tail up to undo_head, null if off; see set_undo()
+    std::unique_ptr<t_undo_entry[]> undo_log;
+    std::size_t undo_mask;
+    std::size_t undo_head;
+    std::size_t undo_tail;
+#ifdef PROFILE
+    t_profile* profile; // see set_profile()
+    // counted into by every read_mem() and write_mem(), without a test:
+    // the profile's counts, or heat_sink with none set
+    std::uint64_t* heat_reads;
+    std::uint64_t* heat_writes;
+    std::vector<std::uint64_t> heat_sink;
+#endif
+
     // registers
 
     t_addr pc; // program counter
@@ -25,7 +242,13 @@ class t_machine {
     char ra; // accumulator
     char rx; // register x
     char ry; // register y
-    char rp; // processor status
+    char rp; // processor status, see get_status()
+
+    // lazily evaluated flags
+    char zres;
+    char nres;
+    bool carry;
+    bool overflow;
 
     // addressing modes
 
@@ -45,19 +268,13 @@ class t_machine {
 
     // instructions
 
-    void i_lda();
-    void i_ldx();
-    void i_ldy();
+    template <t_operand> void i_ld();
 
     void i_sta();
     void i_stx();
     void i_sty();
 
-    void i_tax();
-    void i_tay();
-    void i_txa();
-    void i_tya();
-    void i_tsx();
+    template <t_operand, t_operand> void i_t();
     void i_txs();
 
     void i_pha();
@@ -71,13 +288,8 @@ class t_machine {
     void i_ora();
     void i_bit();
 
-    void i_inc();
-    void i_dec();
-
-    void i_inx();
-    void i_dex();
-    void i_iny();
-    void i_dey();
+    template <t_operand> void i_inc();
+    template <t_operand> void i_dec();
 
     void i_jmp();
     void i_jsr();
@@ -104,10 +316,10 @@ class t_machine {
     void i_rti();
     void i_nop();
 
-    void i_asl();
-    void i_lsr();
-    void i_rol();
-    void i_ror();
+    template <t_operand> void i_asl();
+    template <t_operand> void i_lsr();
+    template <t_operand> void i_rol();
+    template <t_operand> void i_ror();
 
     void i_adc();
     void i_sbc();
@@ -115,6 +327,8 @@ class t_machine {
     void i_cpx();
     void i_cpy();
 
+    char get_status();
+    void set_status(char);
     void set_carry_flag(bool);
     bool get_carry_flag();
     void set_zero_flag(bool);
@@ -131,27 +345,166 @@ class t_machine {
     char read_mem(t_addr);
     t_addr read_mem_2(t_addr);
     void write_mem(t_addr, char);
-    void set_with_flags(t_addr, char);
+    char read_bus(t_addr);
+    void write_bus(t_addr, char);
+    void write_fault(t_addr, char);
+    char read_io(t_addr);
+    void write_io(t_addr, char);
+    void count_bus_pages();
+    bool watch_interrupt();
+    bool watch_step();
+    unsigned next_accesses(t_access*);
+    char peek(t_addr);
+    void unshare(unsigned);
+    bool is_shared(unsigned);
+    template <t_operand> char load();
+    template <t_operand> void store(char);
+    template <t_operand> void set_with_flags(char);
     void set_arg(t_addr, int);
     void push(char);
     char pull();
     void push_addr(t_addr);
     t_addr pull_addr();
     void short_jump_if(bool);
+    bool interrupt_pending();
+    int step_switch();
+    int step_instruction();
+    int step_logged();
+    void log_undo(const t_undo_entry&);
+    template <bool cached, bool checked, bool bus, bool traced>
+    int run_threaded(unsigned long);
+    int exec_threaded(unsigned long);
+    int exec_cached(unsigned long);
+    int exec_traced(unsigned long);
+    int exec_watched(unsigned long);
+    int exec_checked(unsigned long);
+    int exec_core(unsigned long);
+    int exec_slice(unsigned long);
+    int exec_run(unsigned long);
+    int step_run();
+    void end_run();
+    int exec_events(unsigned long);
+    void fire_events();
+    void raise(t_line);
+    void checkpoint();
+    void schedule_checkpoint(t_cycles);
+    void schedule_input();
+    unsigned long add_event(t_cycles, t_event_kind,
+                            std::function<void(t_machine&)>);
+    void set_watch(std::array<std::uint64_t, 0x400>&, t_addr, bool);
+    int exec_jit(unsigned long);
+    int exec_recompiled(unsigned long);
+    int exec_stepped(unsigned long);
+    void invalidate_code(t_addr);
+    void flush_code();
 
 public:
 
     t_machine();
+    ~t_machine();
     void init();
+    void set_core(t_core);
+    void set_recompiled(const t_recompiled*);
+    void set_fusion(bool);
+    unsigned long get_fused_count();
+    t_core get_core();
+    t_registers get_registers();
+    void set_registers(const t_registers&);
     t_addr get_program_counter();
     unsigned long get_step_counter();
+    t_cycles get_cycle_counter();
     void print_info();
     void set_program_counter(t_addr);
     char read_memory(t_addr);
     void load_program(const std::vector<char>&, t_addr);
     int load_program_from_file(const std::string&, t_addr);
     void interrupt_reset();
+    void raise_irq();
+    void raise_nmi();
+    unsigned long schedule_irq(t_cycles);
+    unsigned long schedule_nmi(t_cycles);
+    unsigned long schedule(t_cycles, std::function<void(t_machine&)>);
+    bool cancel(unsigned long);
+    void record(t_recording*, t_cycles);
+    bool seek(const t_recording&, t_cycles);
+    void end_replay();
+    void set_undo(std::size_t);
+    bool step_back();
+    t_run_result run_back_until(t_addr);
     void process_interrupt();
     int step();
+    int exec(unsigned long);
+    t_run_result run_for(t_cycles);
+    t_run_result run_until(t_cycles);
+    void set_breakpoint(t_addr, bool);
+    void set_read_watch(t_addr, bool);
+    void set_write_watch(t_addr, bool);
+    void set_step_limit(unsigned long);
+    void clear_breakpoints();
+    void set_idle_mode(t_idle);
+    void set_trace(t_trace*);
+    bool set_profile(t_profile*);
+    void map_page(unsigned, char*, bool);
+    void map_io(unsigned, t_io*);
+    t_snapshot snapshot();
+    void restore(const t_snapshot&);
+    std::unique_ptr<t_machine> fork();
+    void set_baseline();
+    void reset_to_baseline();
+    t_stop run_to_stop(unsigned long);
+    t_stop get_stop();
     void run();
 };
+
+// with nothing mapped the machine's own ram is read directly; otherwise ram
+// and rom pages cost an indexed load, devices a call through read_io();
+// writes to devices and read-only pages go through write_fault()
+
+inline char t_machine::read_mem(t_addr addr) {
+#ifdef PROFILE
+    heat_reads[addr & 0xffff]++;
+#endif
+    if (!bus_pages) {
+        return memory[addr & 0xffff];
+    }
+    return read_bus(addr);
+}
+
+inline void t_machine::write_mem(t_addr addr, char val) {
+#ifdef PROFILE
+    heat_writes[addr & 0xffff]++;
+#endif
+    if (!bus_pages) {
+        memory[addr & 0xffff] = val;
+        page_dirty[(addr >> 8) & 0xff] = 1;
+        if (code_page[(addr >> 8) & 0xff]) {
+            invalidate_code(addr);
+        }
+        return;
+    }
+    write_bus(addr, val);
+}
+
+inline char t_machine::read_bus(t_addr addr) {
+    auto page = page_read[(addr >> 8) & 0xff];
+    if (page) {
+        return page[addr & 0xff];
+    }
+    return read_io(addr & 0xffff);
+}
+
+inline void t_machine::write_bus(t_addr addr, char val) {
+    auto page = page_write[(addr >> 8) & 0xff];
+    if (page) {
+        if (undo_log) {
+            log_undo({std::uint16_t(addr), 0, page[addr & 0xff], 0, 0, 0, 0});
+        }
+        page[addr & 0xff] = val;
+        page_dirty[(addr >> 8) & 0xff] = 1;
+        if (code_page[(addr >> 8) & 0xff]) {
+            invalidate_code(addr);
+        }
+    } else {
+        write_fault(addr & 0xffff, val);
+    }
+}
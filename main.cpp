@@ -7,5 +7,19 @@ int main() {
 
     // full_test();
 
+    // core_test();
+
+    // memory_bench();
+    // batch_bench();
+    // lockstep_bench();
+    // reset_bench();
+    // trace_bench();
+    // compare_bench();
+    // profile_report();
+    // record_bench();
+    // undo_bench();
+    // fusion_bench();
+    // fork_bench();
+
     func_test();
 }
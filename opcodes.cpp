@@ -0,0 +1,211 @@
+#include "opcodes.hpp"
+
+t_opinfo decode(char opcode) {
+    switch (opcode) {
+    case 0x29: return {op_and, mode_imm};
+    case 0x25: return {op_and, mode_zpg};
+    case 0x35: return {op_and, mode_zpx};
+    case 0x2d: return {op_and, mode_abs};
+    case 0x3d: return {op_and, mode_abx};
+    case 0x39: return {op_and, mode_aby};
+    case 0x21: return {op_and, mode_inx};
+    case 0x31: return {op_and, mode_iny};
+    case 0x49: return {op_eor, mode_imm};
+    case 0x45: return {op_eor, mode_zpg};
+    case 0x55: return {op_eor, mode_zpx};
+    case 0x4d: return {op_eor, mode_abs};
+    case 0x5d: return {op_eor, mode_abx};
+    case 0x59: return {op_eor, mode_aby};
+    case 0x41: return {op_eor, mode_inx};
+    case 0x51: return {op_eor, mode_iny};
+    case 0x09: return {op_ora, mode_imm};
+    case 0x05: return {op_ora, mode_zpg};
+    case 0x15: return {op_ora, mode_zpx};
+    case 0x0d: return {op_ora, mode_abs};
+    case 0x1d: return {op_ora, mode_abx};
+    case 0x19: return {op_ora, mode_aby};
+    case 0x01: return {op_ora, mode_inx};
+    case 0x11: return {op_ora, mode_iny};
+    case 0x24: return {op_bit, mode_zpg};
+    case 0x2c: return {op_bit, mode_abs};
+    case 0xa9: return {op_lda, mode_imm};
+    case 0xa5: return {op_lda, mode_zpg};
+    case 0xb5: return {op_lda, mode_zpx};
+    case 0xad: return {op_lda, mode_abs};
+    case 0xbd: return {op_lda, mode_abx};
+    case 0xb9: return {op_lda, mode_aby};
+    case 0xa1: return {op_lda, mode_inx};
+    case 0xb1: return {op_lda, mode_iny};
+    case 0xa2: return {op_ldx, mode_imm};
+    case 0xa6: return {op_ldx, mode_zpg};
+    case 0xb6: return {op_ldx, mode_zpy};
+    case 0xae: return {op_ldx, mode_abs};
+    case 0xbe: return {op_ldx, mode_aby};
+    case 0xa0: return {op_ldy, mode_imm};
+    case 0xa4: return {op_ldy, mode_zpg};
+    case 0xb4: return {op_ldy, mode_zpx};
+    case 0xac: return {op_ldy, mode_abs};
+    case 0xbc: return {op_ldy, mode_abx};
+    case 0x85: return {op_sta, mode_zpg};
+    case 0x95: return {op_sta, mode_zpx};
+    case 0x8d: return {op_sta, mode_abs};
+    case 0x9d: return {op_sta, mode_abx};
+    case 0x99: return {op_sta, mode_aby};
+    case 0x81: return {op_sta, mode_inx};
+    case 0x91: return {op_sta, mode_iny};
+    case 0x86: return {op_stx, mode_zpg};
+    case 0x96: return {op_stx, mode_zpy};
+    case 0x8e: return {op_stx, mode_abs};
+    case 0x84: return {op_sty, mode_zpg};
+    case 0x94: return {op_sty, mode_zpx};
+    case 0x8c: return {op_sty, mode_abs};
+    case 0xaa: return {op_tax, mode_imp};
+    case 0xa8: return {op_tay, mode_imp};
+    case 0x8a: return {op_txa, mode_imp};
+    case 0x98: return {op_tya, mode_imp};
+    case 0xe6: return {op_inc, mode_zpg};
+    case 0xf6: return {op_inc, mode_zpx};
+    case 0xee: return {op_inc, mode_abs};
+    case 0xfe: return {op_inc, mode_abx};
+    case 0xe8: return {op_inx, mode_imp};
+    case 0xc8: return {op_iny, mode_imp};
+    case 0xc6: return {op_dec, mode_zpg};
+    case 0xd6: return {op_dec, mode_zpx};
+    case 0xce: return {op_dec, mode_abs};
+    case 0xde: return {op_dec, mode_abx};
+    case 0xca: return {op_dex, mode_imp};
+    case 0x88: return {op_dey, mode_imp};
+    case 0x0a: return {op_asl, mode_acc};
+    case 0x06: return {op_asl, mode_zpg};
+    case 0x16: return {op_asl, mode_zpx};
+    case 0x0e: return {op_asl, mode_abs};
+    case 0x1e: return {op_asl, mode_abx};
+    case 0x4a: return {op_lsr, mode_acc};
+    case 0x46: return {op_lsr, mode_zpg};
+    case 0x56: return {op_lsr, mode_zpx};
+    case 0x4e: return {op_lsr, mode_abs};
+    case 0x5e: return {op_lsr, mode_abx};
+    case 0x2a: return {op_rol, mode_acc};
+    case 0x26: return {op_rol, mode_zpg};
+    case 0x36: return {op_rol, mode_zpx};
+    case 0x2e: return {op_rol, mode_abs};
+    case 0x3e: return {op_rol, mode_abx};
+    case 0x6a: return {op_ror, mode_acc};
+    case 0x66: return {op_ror, mode_zpg};
+    case 0x76: return {op_ror, mode_zpx};
+    case 0x6e: return {op_ror, mode_abs};
+    case 0x7e: return {op_ror, mode_abx};
+    case 0xba: return {op_tsx, mode_imp};
+    case 0x9a: return {op_txs, mode_imp};
+    case 0x48: return {op_pha, mode_imp};
+    case 0x08: return {op_php, mode_imp};
+    case 0x68: return {op_pla, mode_imp};
+    case 0x28: return {op_plp, mode_imp};
+    case 0x4c: return {op_jmp, mode_abs};
+    case 0x6c: return {op_jmp, mode_ind};
+    case 0x20: return {op_jsr, mode_abs};
+    case 0x60: return {op_rts, mode_imp};
+    case 0x90: return {op_bcc, mode_rel};
+    case 0xb0: return {op_bcs, mode_rel};
+    case 0xf0: return {op_beq, mode_rel};
+    case 0x30: return {op_bmi, mode_rel};
+    case 0xd0: return {op_bne, mode_rel};
+    case 0x10: return {op_bpl, mode_rel};
+    case 0x50: return {op_bvc, mode_rel};
+    case 0x70: return {op_bvs, mode_rel};
+    case 0x18: return {op_clc, mode_imp};
+    case 0xd8: return {op_cld, mode_imp};
+    case 0x58: return {op_cli, mode_imp};
+    case 0xb8: return {op_clv, mode_imp};
+    case 0x38: return {op_sec, mode_imp};
+    case 0xf8: return {op_sed, mode_imp};
+    case 0x78: return {op_sei, mode_imp};
+    case 0x69: return {op_adc, mode_imm};
+    case 0x65: return {op_adc, mode_zpg};
+    case 0x75: return {op_adc, mode_zpx};
+    case 0x6d: return {op_adc, mode_abs};
+    case 0x7d: return {op_adc, mode_abx};
+    case 0x79: return {op_adc, mode_aby};
+    case 0x61: return {op_adc, mode_inx};
+    case 0x71: return {op_adc, mode_iny};
+    case 0xe9: return {op_sbc, mode_imm};
+    case 0xe5: return {op_sbc, mode_zpg};
+    case 0xf5: return {op_sbc, mode_zpx};
+    case 0xed: return {op_sbc, mode_abs};
+    case 0xfd: return {op_sbc, mode_abx};
+    case 0xf9: return {op_sbc, mode_aby};
+    case 0xe1: return {op_sbc, mode_inx};
+    case 0xf1: return {op_sbc, mode_iny};
+    case 0xc9: return {op_cmp, mode_imm};
+    case 0xc5: return {op_cmp, mode_zpg};
+    case 0xd5: return {op_cmp, mode_zpx};
+    case 0xcd: return {op_cmp, mode_abs};
+    case 0xdd: return {op_cmp, mode_abx};
+    case 0xd9: return {op_cmp, mode_aby};
+    case 0xc1: return {op_cmp, mode_inx};
+    case 0xd1: return {op_cmp, mode_iny};
+    case 0xe0: return {op_cpx, mode_imm};
+    case 0xe4: return {op_cpx, mode_zpg};
+    case 0xec: return {op_cpx, mode_abs};
+    case 0xc0: return {op_cpy, mode_imm};
+    case 0xc4: return {op_cpy, mode_zpg};
+    case 0xcc: return {op_cpy, mode_abs};
+    case 0xea: return {op_nop, mode_imp};
+    case 0x00: return {op_brk, mode_imp};
+    case 0x40: return {op_rti, mode_imp};
+    default: return {op_none, mode_imp};
+    }
+}
+
+const unsigned char op_length[0x100] = {
+    1, 2, 1, 1, 1, 2, 2, 1, 1, 2, 1, 1, 1, 3, 3, 1,
+    2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1,
+    3, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1,
+    1, 2, 1, 1, 1, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1,
+    1, 2, 1, 1, 1, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1,
+    1, 2, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 1, 3, 1, 1,
+    2, 2, 2, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 2, 2, 2, 1, 1, 3, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1,
+    2, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1,
+    2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1,
+};
+
+const unsigned char op_cycles[0x100] = {
+    7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0,
+    2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0,
+    2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0,
+    2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0,
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+};
+
+const char* const op_names[] = {
+    "???",
+    "lda", "ldx", "ldy", "sta", "stx", "sty",
+    "tax", "tay", "txa", "tya", "tsx", "txs",
+    "pha", "pla", "php", "plp",
+    "and", "eor", "ora", "bit",
+    "inc", "dec", "inx", "dex", "iny", "dey",
+    "jmp", "jsr", "rts",
+    "clc", "sec", "clv", "cld", "sed", "cli", "sei",
+    "bcc", "bcs", "bpl", "bmi", "bne", "beq", "bvc", "bvs",
+    "brk", "rti", "nop",
+    "asl", "lsr", "rol", "ror",
+    "adc", "sbc", "cmp", "cpx", "cpy"
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+// The instruction set as the decoding cores see it.
+
+enum t_op {
+    op_none,
+    op_lda, op_ldx, op_ldy, op_sta, op_stx, op_sty,
+    op_tax, op_tay, op_txa, op_tya, op_tsx, op_txs,
+    op_pha, op_pla, op_php, op_plp,
+    op_and, op_eor, op_ora, op_bit,
+    op_inc, op_dec, op_inx, op_dex, op_iny, op_dey,
+    op_jmp, op_jsr, op_rts,
+    op_clc, op_sec, op_clv, op_cld, op_sed, op_cli, op_sei,
+    op_bcc, op_bcs, op_bpl, op_bmi, op_bne, op_beq, op_bvc, op_bvs,
+    op_brk, op_rti, op_nop,
+    op_asl, op_lsr, op_rol, op_ror,
+    op_adc, op_sbc, op_cmp, op_cpx, op_cpy
+};
+
+enum t_mode {
+    mode_imp, mode_acc, mode_imm, mode_rel, mode_zpg, mode_zpx, mode_zpy,
+    mode_abs, mode_abx, mode_aby, mode_ind, mode_inx, mode_iny
+};
+
+struct t_opinfo {
+    t_op op;
+    t_mode mode;
+};
+
+t_opinfo decode(char);
+
+// instruction lengths and base cycles by opcode; branches not taken, reads
+// without a page crossing
+extern const unsigned char op_length[0x100];
+extern const unsigned char op_cycles[0x100];
+
+// mnemonics by t_op, "???" for op_none
+extern const char* const op_names[];
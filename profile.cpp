@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "profile.hpp"
+
+t_profile::t_profile()
+    : steps(0x10000), cycles(0x10000), branches(0x10000), taken(0x10000),
+      crossings(0x10000), reads(0x10000), writes(0x10000),
+      pairs(0x10000) {
+    clear();
+}
+
+void t_profile::clear() {
+    std::fill(steps.begin(), steps.end(), 0);
+    std::fill(cycles.begin(), cycles.end(), 0);
+    std::fill(branches.begin(), branches.end(), 0);
+    std::fill(taken.begin(), taken.end(), 0);
+    std::fill(crossings.begin(), crossings.end(), 0);
+    std::fill(reads.begin(), reads.end(), 0);
+    std::fill(writes.begin(), writes.end(), 0);
+    opcode_steps.fill(0);
+    opcode_cycles.fill(0);
+    std::fill(pairs.begin(), pairs.end(), 0);
+    nodes.assign(1, t_call_node{0x10000, 0, 0, 0});
+    children.clear();
+    frames.clear();
+    node = 0;
+    charged = 0;
+    next = 0x10000;
+    last = 0;
+}
+
+// Drops the calls a return to sp, or a stack pointer moved back above
+// them, left. A routine that pulls its return address and jumps on stays
+// on the stack until then.
+void t_profile::unwind(unsigned char sp) {
+    while (!frames.empty() && frames.back().sp <= sp) {
+        frames.pop_back();
+    }
+    node = frames.empty() ? 0 : frames.back().node;
+}
+
+// A call to routine with the stack pointer at sp before it pushed.
+void t_profile::call(std::uint32_t routine, unsigned char sp) {
+    unwind(sp);
+    auto key = std::uint64_t(node) << 16 | routine;
+    auto it = children.find(key);
+    if (it == children.end()) {
+        it = children.emplace(key, nodes.size()).first;
+        nodes.push_back({routine, node, 0, 0});
+    }
+    node = it->second;
+    nodes[node].calls++;
+    frames.push_back({node, sp});
+}
+
+// An interrupt entered its handler, taking the 7 cycles no instruction
+// counts.
+void t_profile::interrupt(std::uint32_t handler, unsigned char sp) {
+    call(handler, sp);
+    nodes[node].cycles += 7;
+    charged = node;
+}
+
+// An rts or rti left the stack pointer at sp.
+void t_profile::ret(unsigned char sp) {
+    unwind(sp);
+}
+
+bool load_symbols(const std::string& file, t_symbols& symbols) {
+    std::ifstream in(file);
+    if (!in.good()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::string al, addr, name;
+        if (!(words >> al >> addr >> name) || al != "al") {
+            continue;
+        }
+        if (addr.compare(0, 2, "C:") == 0) {
+            addr.erase(0, 2);
+        }
+        if (name[0] == '.') {
+            name.erase(0, 1);
+        }
+        char* end;
+        auto v = std::strtoul(addr.c_str(), &end, 16);
+        if (*end || addr.empty() || name.empty() || v > 0xffff) {
+            continue;
+        }
+        symbols.emplace(v, name);
+    }
+    return true;
+}
+
+static std::string routine_name(const t_symbols& symbols,
+                                std::uint32_t routine) {
+    if (routine > 0xffff) {
+        return "[top]";
+    }
+    auto it = symbols.find(routine);
+    if (it != symbols.end()) {
+        return it->second;
+    }
+    char name[8];
+    std::snprintf(name, sizeof(name), "$%04x", unsigned(routine));
+    return name;
+}
+
+// the n indices with the largest keys, largest first, leaving out zeros
+template <typename T>
+static std::vector<unsigned> top(const T& key, unsigned n) {
+    std::vector<unsigned> v;
+    for (unsigned i = 0; i < key.size(); i++) {
+        if (key[i]) {
+            v.push_back(i);
+        }
+    }
+    n = std::min<std::size_t>(n, v.size());
+    std::partial_sort(v.begin(), v.begin() + n, v.end(),
+                      [&](unsigned a, unsigned b) {
+                          return key[a] > key[b] ||
+                                 (key[a] == key[b] && a < b);
+                      });
+    v.resize(n);
+    return v;
+}
+
+static double share(std::uint64_t part, std::uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0;
+}
+
+void print_profile(const t_profile& p, std::ostream& os, unsigned n) {
+    std::uint64_t total = 0;
+    std::uint64_t steps = 0;
+    for (unsigned op = 0; op < 0x100; op++) {
+        total += p.opcode_cycles[op];
+        steps += p.opcode_steps[op];
+    }
+    char line[96];
+    std::snprintf(line, sizeof(line), "steps : %llu | cycles : %llu\n",
+                  (unsigned long long)(steps), (unsigned long long)(total));
+    os << line;
+
+    os << "\nhot addresses\n";
+    os << "  pc           steps          cycles  cycles %  crossings\n";
+    for (auto pc : top(p.cycles, n)) {
+        std::snprintf(line, sizeof(line),
+                      "  $%04x  %12llu  %14llu  %7.2f%%  %9llu\n", pc,
+                      (unsigned long long)(p.steps[pc]),
+                      (unsigned long long)(p.cycles[pc]),
+                      share(p.cycles[pc], total),
+                      (unsigned long long)(p.crossings[pc]));
+        os << line;
+    }
+
+    os << "\nhot opcodes\n";
+    os << "  op   name         steps   steps %          cycles\n";
+    for (auto op : top(p.opcode_steps, n)) {
+        std::snprintf(line, sizeof(line),
+                      "  $%02x  %-4s  %12llu  %7.2f%%  %14llu\n", op,
+                      op_names[decode(op).op],
+                      (unsigned long long)(p.opcode_steps[op]),
+                      share(p.opcode_steps[op], steps),
+                      (unsigned long long)(p.opcode_cycles[op]));
+        os << line;
+    }
+
+    os << "\nhot pairs\n";
+    os << "  ops    names              steps   steps %\n";
+    for (auto pair : top(p.pairs, n)) {
+        std::snprintf(line, sizeof(line),
+                      "  $%02x $%02x  %-4s %-4s  %12llu  %7.2f%%\n",
+                      pair >> 8, pair & 0xff, op_names[decode(pair >> 8).op],
+                      op_names[decode(pair & 0xff).op],
+                      (unsigned long long)(p.pairs[pair]),
+                      share(p.pairs[pair], steps));
+        os << line;
+    }
+
+    os << "\nhot branches\n";
+    os << "  pc           steps   taken %  crossings\n";
+    for (auto pc : top(p.branches, n)) {
+        std::snprintf(line, sizeof(line), "  $%04x  %12llu  %7.2f%%  %9llu\n",
+                      pc, (unsigned long long)(p.branches[pc]),
+                      share(p.taken[pc], p.branches[pc]),
+                      (unsigned long long)(p.crossings[pc]));
+        os << line;
+    }
+}
+
+void print_calls(const t_profile& p, const t_symbols& symbols,
+                 std::ostream& os, unsigned n) {
+    // by routine, 0x10000 for code outside any call
+    std::vector<std::uint64_t> calls(0x10001), inclusive(0x10001),
+        exclusive(0x10001);
+    std::vector<std::uint32_t> seen;
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < p.nodes.size(); i++) {
+        auto& c = p.nodes[i];
+        total += c.cycles;
+        calls[c.routine] += c.calls;
+        exclusive[c.routine] += c.cycles;
+        // every routine on the path, once
+        seen.clear();
+        for (auto j = i; ; j = p.nodes[j].parent) {
+            auto r = p.nodes[j].routine;
+            if (std::find(seen.begin(), seen.end(), r) == seen.end()) {
+                seen.push_back(r);
+                inclusive[r] += c.cycles;
+            }
+            if (j == 0) {
+                break;
+            }
+        }
+    }
+    char line[128];
+    os << "  routine                  calls       inclusive   incl %"
+          "       exclusive   excl %\n";
+    for (auto r : top(inclusive, n)) {
+        std::snprintf(line, sizeof(line),
+                      "  %-20s  %9llu  %14llu  %6.2f%%  %14llu  %6.2f%%\n",
+                      routine_name(symbols, r).c_str(),
+                      (unsigned long long)(calls[r]),
+                      (unsigned long long)(inclusive[r]),
+                      share(inclusive[r], total),
+                      (unsigned long long)(exclusive[r]),
+                      share(exclusive[r], total));
+        os << line;
+    }
+}
+
+void print_collapsed(const t_profile& p, const t_symbols& symbols,
+                     std::ostream& os) {
+    std::vector<std::uint32_t> path;
+    for (std::size_t i = 0; i < p.nodes.size(); i++) {
+        if (!p.nodes[i].cycles) {
+            continue;
+        }
+        path.clear();
+        for (auto j = i; j != 0; j = p.nodes[j].parent) {
+            path.push_back(p.nodes[j].routine);
+        }
+        if (path.empty()) {
+            path.push_back(p.nodes[0].routine);
+        }
+        for (auto r = path.rbegin(); r != path.rend(); r++) {
+            os << (r == path.rbegin() ? "" : ";")
+               << routine_name(symbols, *r);
+        }
+        os << ' ' << p.nodes[i].cycles << '\n';
+    }
+}
+
+// reads, writes and executions of each page
+static std::vector<std::array<std::uint64_t, 3>> page_heat(
+    const t_profile& p) {
+    std::vector<std::array<std::uint64_t, 3>> pages(0x100);
+    for (unsigned a = 0; a < 0x10000; a++) {
+        auto& page = pages[a >> 8];
+        page[0] += p.reads[a];
+        page[1] += p.writes[a];
+        page[2] += p.steps[a];
+    }
+    return pages;
+}
+
+void print_heat(const t_profile& p, std::ostream& os, unsigned n) {
+    auto pages = page_heat(p);
+    std::vector<std::uint64_t> total(0x100);
+    for (unsigned i = 0; i < 0x100; i++) {
+        total[i] = pages[i][0] + pages[i][1] + pages[i][2];
+    }
+    char line[96];
+    os << "  page           reads          writes           execs\n";
+    for (auto i : top(total, n)) {
+        std::snprintf(line, sizeof(line), "  $%02x    %14llu  %14llu  %14llu\n",
+                      i, (unsigned long long)(pages[i][0]),
+                      (unsigned long long)(pages[i][1]),
+                      (unsigned long long)(pages[i][2]));
+        os << line;
+    }
+    std::vector<std::uint64_t> zero(0x100);
+    for (unsigned a = 0; a < 0x100; a++) {
+        zero[a] = p.reads[a] + p.writes[a];
+    }
+    os << "\n  addr           reads          writes\n";
+    for (auto a : top(zero, n)) {
+        std::snprintf(line, sizeof(line), "  $%02x    %14llu  %14llu\n", a,
+                      (unsigned long long)(p.reads[a]),
+                      (unsigned long long)(p.writes[a]));
+        os << line;
+    }
+}
+
+void write_heat_csv(const t_profile& p, std::ostream& os, bool pages) {
+    char line[80];
+    os << (pages ? "page" : "addr") << ",reads,writes,execs\n";
+    if (pages) {
+        auto heat = page_heat(p);
+        for (unsigned i = 0; i < 0x100; i++) {
+            auto& h = heat[i];
+            if (h[0] || h[1] || h[2]) {
+                std::snprintf(line, sizeof(line), "%02x,%llu,%llu,%llu\n", i,
+                              (unsigned long long)(h[0]),
+                              (unsigned long long)(h[1]),
+                              (unsigned long long)(h[2]));
+                os << line;
+            }
+        }
+        return;
+    }
+    for (unsigned a = 0; a < 0x10000; a++) {
+        if (p.reads[a] || p.writes[a] || p.steps[a]) {
+            std::snprintf(line, sizeof(line), "%04x,%llu,%llu,%llu\n", a,
+                          (unsigned long long)(p.reads[a]),
+                          (unsigned long long)(p.writes[a]),
+                          (unsigned long long)(p.steps[a]));
+            os << line;
+        }
+    }
+}
+
+void write_heat_pgm(const t_profile& p, std::ostream& os) {
+    std::vector<std::uint64_t> heat(0x10000);
+    std::uint64_t most = 0;
+    for (unsigned a = 0; a < 0x10000; a++) {
+        heat[a] = p.reads[a] + p.writes[a];
+        most = std::max(most, heat[a]);
+    }
+    os << "P5\n256 256\n255\n";
+    auto scale = most ? 255 / std::log1p(double(most)) : 0;
+    std::vector<char> pixels(0x10000);
+    for (unsigned a = 0; a < 0x10000; a++) {
+        pixels[a] = char(std::lround(std::log1p(double(heat[a])) * scale));
+    }
+    os.write(pixels.data(), pixels.size());
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "opcodes.hpp"
+
+// A path of calls seen, from code outside any call at node 0. Its cycles
+// are those of its own instructions, the call that entered it included.
+struct t_call_node {
+    std::uint32_t routine; // called address, or 0x10000 at node 0
+    std::uint32_t parent;
+    std::uint64_t calls;
+    std::uint64_t cycles;
+};
+
+// A call on the shadow stack; sp is the stack pointer before the call
+// pushed its return address.
+struct t_call_frame {
+    std::uint32_t node;
+    unsigned char sp;
+};
+
+// Where a program spends its time: steps and cycles by pc and by opcode,
+// pairs of opcodes run one straight after the other, branches taken and
+// page crossing penalties by pc, reads and writes by address, and cycles by
+// call path. The steps at an address count how often it was executed. The
+// switch core fills it, see t_machine::set_profile(); only a build with
+// PROFILE defined (make PROFILE=1) has the counting compiled in.
+struct t_profile {
+    std::vector<std::uint64_t> steps;
+    std::vector<std::uint64_t> cycles;
+    std::vector<std::uint64_t> branches; // steps of branches
+    std::vector<std::uint64_t> taken;
+    std::vector<std::uint64_t> crossings; // page crossing penalties
+    std::vector<std::uint64_t> reads; // by address, fetches included
+    std::vector<std::uint64_t> writes;
+    std::array<std::uint64_t, 0x100> opcode_steps;
+    std::array<std::uint64_t, 0x100> opcode_cycles;
+    // by opcode << 8 | the opcode of the instruction right after it in
+    // memory, when that ran next
+    std::vector<std::uint64_t> pairs;
+    std::vector<t_call_node> nodes;
+    std::unordered_map<std::uint64_t, std::uint32_t> children;
+    std::vector<t_call_frame> frames;
+    std::uint32_t node; // the call path running
+    std::uint32_t charged; // the one the running instruction is charged to
+    std::uint32_t next; // where the last instruction counted ends
+    unsigned char last; // and its opcode
+
+    t_profile();
+    void clear();
+    void count(std::uint32_t, unsigned char, unsigned);
+    void call(std::uint32_t, unsigned char);
+    void interrupt(std::uint32_t, unsigned char);
+    void ret(unsigned char);
+
+private:
+    void unwind(unsigned char);
+};
+
+// Routine names by address.
+typedef std::map<std::uint32_t, std::string> t_symbols;
+
+// Adds the labels of a VICE label file, as ca65 and VICE write them, one
+// "al C:0810 .main" or "al 000810 .main" a line. Returns false if the file
+// cannot be read.
+bool load_symbols(const std::string&, t_symbols&);
+
+// Prints the n addresses taking the most cycles, the n opcodes run most,
+// the n opcode pairs run most and the n branches run most with the share
+// taken.
+void print_profile(const t_profile&, std::ostream&, unsigned);
+
+// Prints the n routines taking the most cycles, counting the routines they
+// call (inclusive) and without them (exclusive). A recursive routine
+// counts its cycles once.
+void print_calls(const t_profile&, const t_symbols&, std::ostream&,
+                 unsigned);
+
+// Prints the n pages with the most accesses, and the n zero page addresses
+// with the most reads and writes.
+void print_heat(const t_profile&, std::ostream&, unsigned);
+
+// Writes "addr,reads,writes,execs" lines, in hex and decimal, of every
+// address accessed, or with pages set of every page.
+void write_heat_csv(const t_profile&, std::ostream&, bool);
+
+// Writes a 256 by 256 portable graymap, a row a page, each address as
+// bright as its accesses on a log scale.
+void write_heat_pgm(const t_profile&, std::ostream&);
+
+// Prints a line of each call path, its routines from the outermost joined
+// by ';' and then its cycles, as flame graph tools read them.
+void print_collapsed(const t_profile&, const t_symbols&, std::ostream&);
+
+// An instruction at pc took cyc cycles. Above the base cycles of the
+// opcode, a branch was taken (1) and crossed a page (2); any other
+// instruction crossed a page with an indexed read. The cycles go to the
+// call path the instruction started in, so a jsr counts in the caller and
+// an rts in the routine it leaves.
+inline void t_profile::count(std::uint32_t pc, unsigned char opcode,
+                             unsigned cyc) {
+    unsigned extra = cyc - op_cycles[opcode];
+    steps[pc]++;
+    cycles[pc] += cyc;
+    opcode_steps[opcode]++;
+    opcode_cycles[opcode] += cyc;
+    if (pc == next) {
+        pairs[last << 8 | opcode]++;
+    }
+    next = (pc + op_length[opcode]) & 0xffff;
+    last = opcode;
+    nodes[charged].cycles += cyc;
+    charged = node;
+    if ((opcode & 0x1f) == 0x10) {
+        branches[pc]++;
+        taken[pc] += extra > 0;
+        crossings[pc] += extra > 1;
+    } else {
+        crossings[pc] += extra;
+    }
+}
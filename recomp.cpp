@@ -0,0 +1,71 @@
+#include <algorithm>
+
+#include "recomp.hpp"
+
+t_recomp::t_recomp(const t_recompiled& c, char* m, char* pages, char* dirty)
+    : code(c), mem(m), code_page(pages), start(0x10000, -1),
+      live(c.count), code_map(0x10000), page_blocks(0x100),
+      checked(false) {
+    for (std::uint32_t b = 0; b < code.count; b++) {
+        auto& block = code.blocks[b];
+        start[block.start] = b;
+        for (auto page = block.start >> 8; page <= (block.end - 1) >> 8;
+             page++) {
+            page_blocks[page].push_back(b);
+        }
+    }
+    ctx.mem = mem;
+    ctx.page_dirty = dirty;
+    ctx.code_map = code_map.data();
+    ctx.live = live.data();
+}
+
+// Brings a block back to life wherever memory holds its bytes again, and
+// kills the others. Memory is only read here, when the machine runs the
+// code, since it may be stale while pages are shared with a snapshot.
+void t_recomp::validate() {
+    std::fill(code_map.begin(), code_map.end(), 0);
+    for (std::uint32_t b = 0; b < code.count; b++) {
+        auto& block = code.blocks[b];
+        live[b] = recomp_hash(mem + block.start, block.end - block.start) ==
+                  block.hash;
+        if (!live[b]) {
+            continue;
+        }
+        for (auto addr = block.start; addr < block.end; addr++) {
+            code_map[addr]++;
+        }
+        for (auto page = block.start >> 8; page <= (block.end - 1) >> 8;
+             page++) {
+            code_page[page] = 1;
+        }
+    }
+    checked = true;
+}
+
+void t_recomp::kill(std::uint32_t b) {
+    auto& block = code.blocks[b];
+    live[b] = 0;
+    for (auto addr = block.start; addr < block.end; addr++) {
+        code_map[addr]--;
+    }
+}
+
+// a write to a page flagged in code_page; the blocks holding addr are
+// left to the interpreter until validate() finds them intact again
+void t_recomp::invalidate(std::uint32_t addr) {
+    addr &= 0xffff;
+    if (!checked || !code_map[addr]) {
+        return;
+    }
+    for (auto b : page_blocks[addr >> 8]) {
+        auto& block = code.blocks[b];
+        if (live[b] && block.start <= addr && addr < block.end) {
+            kill(b);
+        }
+    }
+}
+
+void t_recomp::flush() {
+    checked = false;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// State shared with recompiled code. The registers are loaded from and
+// stored back to this structure on entry and exit; run() keeps them in
+// locals in between.
+struct t_recomp_ctx {
+    char* mem;
+    char* page_dirty; // set for each page stored to
+    const char* code_map; // live blocks covering each guest byte
+    const char* live; // by block
+    long budget; // instructions the blocks may still execute
+    std::uint64_t cycles;
+    std::uint32_t pc;
+    std::uint32_t written[3]; // code stored to by the last instruction
+    unsigned writes;
+    char ra;
+    char rx;
+    char ry;
+    char rp;
+    char sp;
+    char irq; // an irq or reset is waiting for the interrupt disable flag
+};
+
+// a basic block as the recompiler found it; it only runs while its bytes,
+// from start up to end, still hash to hash
+struct t_recomp_block {
+    std::uint32_t start;
+    std::uint32_t end;
+    std::uint32_t hash;
+};
+
+// What tools/recompile.cpp writes for an image: its blocks, and a function
+// running them from ctx.pc until the budget runs out, control reaches code
+// that was not translated or is no longer live, an instruction stores to
+// translated code, or an interrupt disable flag cleared lets a waiting
+// interrupt in. It hands back ctx.pc, the instruction to go on from.
+struct t_recompiled {
+    const t_recomp_block* blocks;
+    std::uint32_t count;
+    void (*run)(t_recomp_ctx&);
+};
+
+// FNV-1a
+inline std::uint32_t recomp_hash(const char* p, std::size_t n) {
+    std::uint32_t h = 2166136261u;
+    for (std::size_t i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)(p[i])) * 16777619u;
+    }
+    return h;
+}
+
+// the status register as t_machine::get_status() builds it
+inline unsigned char recomp_status(unsigned char rp, bool carry,
+                                   unsigned char zres, bool overflow,
+                                   unsigned char nres) {
+    return (rp & 0x3c) | carry | (zres == 0) << 1 | overflow << 6 |
+           (nres & 0x80);
+}
+
+// adc and sbc as t_machine::i_adc() and i_sbc() compute them
+inline void recomp_adc(unsigned char& ra, unsigned char m, bool& carry,
+                       bool& overflow) {
+    unsigned v = m + carry;
+    bool a7 = ra & 0x80;
+    bool b7 = v & 0x80;
+    unsigned res = ra + v;
+    bool ca = carry;
+    ra = res;
+    bool c7 = ra & 0x80;
+    overflow = ca && v == 0x80 ? !a7 : a7 == b7 && a7 != c7;
+    carry = res >= 0x100;
+}
+
+inline void recomp_sbc(unsigned char& ra, unsigned char m, bool& carry,
+                       bool& overflow) {
+    bool nc = !carry;
+    unsigned v = m + nc;
+    bool a7 = ra & 0x80;
+    bool b7 = v & 0x80;
+    unsigned res = ra - v;
+    ra = res;
+    bool c7 = ra & 0x80;
+    overflow = nc && v == 0x80 ? a7 : a7 != b7 && b7 == c7;
+    carry = res < 0x100;
+}
+
+// Runs the recompiled code of an image for a machine. A block is live while
+// memory holds the bytes it was translated from; a page holding live blocks
+// is flagged in code_page, and the owner must call invalidate() when such a
+// page is written and flush() when memory may have changed behind its back.
+class t_recomp {
+    const t_recompiled& code;
+    char* mem;
+    char* code_page;
+    std::vector<std::int32_t> start; // block at each address, -1 if none
+    std::vector<char> live;
+    std::vector<char> code_map;
+    std::vector<std::vector<std::uint32_t>> page_blocks;
+    bool checked; // live is up to date with memory
+
+    void validate();
+    void kill(std::uint32_t);
+
+public:
+    t_recomp_ctx ctx;
+
+    t_recomp(const t_recompiled&, char*, char*, char*);
+    void check();
+    bool lookup(std::uint32_t);
+    void enter();
+    void invalidate(std::uint32_t);
+    void flush();
+};
+
+inline void t_recomp::check() {
+    if (!checked) {
+        validate();
+    }
+}
+
+inline bool t_recomp::lookup(std::uint32_t pc) {
+    auto b = start[pc];
+    return b >= 0 && live[b];
+}
+
+inline void t_recomp::enter() {
+    code.run(ctx);
+}
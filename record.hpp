@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+
+#include "machine.hpp"
+
+// an interrupt line raised, at the cycle count where the machine took it up
+struct t_input {
+    t_cycles at;
+    t_line line;
+};
+
+// the machine every interval cycles, and how far the logs had got
+struct t_checkpoint {
+    t_snapshot state;
+    std::size_t inputs;
+    std::size_t reads;
+};
+
+// Everything from outside a machine that a run depends on: the interrupt
+// lines raised and the values devices returned, in order, with checkpoints
+// of the whole machine to start a replay from. See t_machine::record() and
+// t_machine::seek(). Checkpoints share the pages that did not change since
+// the one before.
+struct t_recording {
+    t_cycles interval;
+    std::vector<t_input> inputs;
+    std::vector<char> reads;
+    std::vector<t_checkpoint> checkpoints;
+};
@@ -1,12 +1,35 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <thread>
 #include <string>
 #include <vector>
 
 #include "test.hpp"
+#include "batch.hpp"
+#include "compare.hpp"
+#include "lockstep.hpp"
 #include "machine.hpp"
 #include "misc.hpp"
+#include "profile.hpp"
+#include "record.hpp"
+#include "recomp.hpp"
+#include "trace.hpp"
+
+// the images translated by the makefile, see tools/recompile.cpp
+extern const t_recompiled func_test_rc;
+extern const t_recompiled full_test_rc;
 
 static t_machine mach;
+static t_machine ref_mach;
+
+static bool same_state(t_machine&, t_machine&);
 
 static int pass_count;
 static int total_count;
@@ -177,6 +200,945 @@ test_mode()
     vfy(mem(0x0300) == 0xfd);
 }
 
+static void
+test_breakpoint()
+{
+    std::vector<char> prog = {
+        0xa9, 0x12, 0x85, 0x00, // lda #$12, sta $00
+        0xa5, 0x00, 0xe8, // lda $00, inx
+        0xe6, 0x01 // inc $01
+    };
+    std::cout << "test : breakpoint\n";
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.set_write_watch(0x00, true);
+    mach.set_breakpoint(0x206, true);
+    auto s1 = mach.run_to_stop(~0ul);
+    auto tmp = mem(0) == 0xff;
+    auto s2 = mach.run_to_stop(~0ul);
+    tmp = tmp && mem(0) == 0x12;
+    mach.set_step_limit(mach.get_step_counter() + 1);
+    auto s3 = mach.run_to_stop(~0ul);
+    mach.set_step_limit(0);
+    mach.set_read_watch(0x01, true);
+    auto s4 = mach.run_to_stop(~0ul);
+    mach.clear_breakpoints();
+    auto s5 = mach.run_to_stop(~0ul);
+    tmp = tmp && s1.reason == stop_write && s1.addr == 0x00;
+    tmp = tmp && s2.reason == stop_break && s2.addr == 0x206;
+    tmp = tmp && s3.reason == stop_steps && s3.addr == 0x207;
+    tmp = tmp && s4.reason == stop_read && s4.addr == 0x01;
+    vfy(tmp && s5.reason == stop_illegal && s5.addr == 0x209);
+}
+
+static void
+test_watch_stack()
+{
+    std::vector<char> prog = {
+        0xa9, 0x01, 0x48, 0x68, // lda #$01, pha, pla
+        0x20, 0x0a, 0x02, // jsr $020a
+        0xb1, 0x10, 0x00, // lda ($10),y, brk
+        0x60 // rts
+    };
+    std::cout << "test : watch stack\n";
+    auto tmp = true;
+    // the undo log runs the switch core a step at a time, which must stop
+    // where the checked threaded core does
+    for (int undo = 0; undo < 2; undo++) {
+        mach.init();
+        mach.load_program(prog, 0x200);
+        mach.load_program({0x00, 0x03}, 0x10);
+        mach.load_program({0x00, 0x04}, 0xfffe);
+        mach.set_program_counter(0x200);
+        mach.set_undo(undo ? 0x100 : 0);
+        // each stops before the instruction, which runs in full once resumed
+        mach.set_write_watch(0x1ff, true);
+        auto s1 = mach.run_to_stop(~0ul);
+        tmp = tmp && s1.reason == stop_write && s1.addr == 0x1ff &&
+              mach.get_program_counter() == 0x202;
+        auto s2 = mach.run_to_stop(~0ul);
+        tmp = tmp && s2.reason == stop_write && s2.addr == 0x1ff &&
+              mach.get_program_counter() == 0x204 &&
+              mach.get_registers().sp == char(0xff);
+        mach.clear_breakpoints();
+        mach.set_read_watch(0x1fe, true);
+        auto s3 = mach.run_to_stop(~0ul);
+        tmp = tmp && s3.reason == stop_read && s3.addr == 0x1fe &&
+              mach.get_program_counter() == 0x20a;
+        mach.clear_breakpoints();
+        mach.set_read_watch(0x11, true);
+        auto s4 = mach.run_to_stop(~0ul);
+        tmp = tmp && s4.reason == stop_read && s4.addr == 0x11 &&
+              mach.get_program_counter() == 0x207;
+        mach.clear_breakpoints();
+        mach.set_read_watch(0xffff, true);
+        auto s5 = mach.run_to_stop(~0ul);
+        tmp = tmp && s5.reason == stop_read && s5.addr == 0xffff &&
+              mach.get_program_counter() == 0x209 &&
+              mach.get_registers().sp == char(0xff);
+        mach.clear_breakpoints();
+        auto s6 = mach.run_to_stop(~0ul);
+        tmp = tmp && s6.reason == stop_illegal && s6.addr == 0x400;
+        // an interrupt stops before its pushes too
+        mach.set_write_watch(0x1fa, true);
+        mach.raise_nmi();
+        auto s7 = mach.run_to_stop(~0ul);
+        tmp = tmp && s7.reason == stop_write && s7.addr == 0x1fa &&
+              mach.get_registers().sp == char(0xfc);
+        auto s8 = mach.run_to_stop(~0ul);
+        tmp = tmp && s8.reason == stop_illegal && s8.addr == 0xffff;
+    }
+    vfy(tmp);
+}
+
+static void
+test_idle()
+{
+    std::vector<char> prog = {
+        0xa6, 0x10, 0xd0, 0xfc, // ldx $10, bne $0200
+        0x4c, 0x04, 0x02 // jmp $0204
+    };
+    std::cout << "test : idle\n";
+    auto tmp = true;
+    // with the undo log on too
+    for (int undo = 0; undo < 2; undo++) {
+        mach.init();
+        mach.load_program(prog, 0x200);
+        mach.set_undo(undo ? 0x100 : 0);
+        mach.set_idle_mode(idle_trap);
+        auto s1 = mach.run_to_stop(~0ul);
+        mach.set_program_counter(0x204);
+        auto s2 = mach.run_to_stop(~0ul);
+        tmp = tmp && s1.reason == stop_trap && s1.addr == 0x200;
+        tmp = tmp && s2.reason == stop_trap && s2.addr == 0x204;
+    }
+    // skipping iterations ends where running them does
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.set_idle_mode(idle_skip);
+    auto r = mach.run_for(1000001);
+    ref_mach.init();
+    ref_mach.load_program(prog, 0x200);
+    auto q = ref_mach.run_for(1000001);
+    tmp = tmp && r.cycles == q.cycles && r.steps == q.steps;
+    vfy(tmp && same_state(mach, ref_mach));
+}
+
+static void
+test_fork()
+{
+    std::vector<char> prog = {
+        0x18, 0x69, 0x03, 0x85, 0x10, // clc, adc #$03, sta $10
+        0xc5, 0x10, 0xd0, 0x00, // cmp $10, bne $0209
+        0x9d, 0x00, 0x03, 0xe8, // sta $0300,x, inx
+        0x4c, 0x00, 0x02 // jmp $0200
+    };
+    std::cout << "test : fork\n";
+    mach.init();
+    mach.set_core(core_cached);
+    mach.load_program(prog, 0x200);
+    mach.exec(100);
+    auto snap = mach.snapshot();
+    auto child = mach.fork();
+    // the child goes its own way without touching the parent's ram
+    auto r = child->get_registers();
+    r.ra = 0x55;
+    child->set_registers(r);
+    child->exec(100);
+    auto tmp = child->read_memory(0x10) != mach.read_memory(0x10);
+    mach.exec(100);
+    ref_mach.init();
+    ref_mach.load_program(prog, 0x200);
+    ref_mach.exec(200);
+    tmp = tmp && same_state(mach, ref_mach);
+    mach.exec(100);
+    mach.restore(snap);
+    // ram shared with the snapshot is read in place, so the run stays on
+    // the core selected, the only one to fuse the cmp and bne
+    auto fused = mach.get_fused_count();
+    mach.exec(100);
+    tmp = tmp && same_state(mach, ref_mach) && mach.get_fused_count() > fused;
+    child->restore(snap);
+    fused = child->get_fused_count();
+    child->exec(100);
+    tmp = tmp && child->get_fused_count() > fused;
+    mach.set_core(core_switch);
+    vfy(tmp && same_state(*child, ref_mach));
+}
+
+static void
+test_baseline()
+{
+    // the program rewrites its own first operand and dirties four pages
+    std::vector<char> prog = {
+        0xa9, 0x00, 0x85, 0x10, // lda #$00, sta $10
+        0xee, 0x01, 0x02, // inc $0201
+        0x9d, 0x00, 0x30, 0xe8, // sta $3000,x, inx
+        0x48, 0x68, // pha, pla
+        0x4c, 0x00, 0x02 // jmp $0200
+    };
+    std::cout << "test : baseline\n";
+    ref_mach.init();
+    ref_mach.set_core(core_switch);
+    ref_mach.load_program(prog, 0x200);
+    ref_mach.exec(300);
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.set_baseline();
+    auto tmp = true;
+    for (auto core : {core_switch, core_threaded, core_cached, core_jit}) {
+        mach.set_core(core);
+        for (int i = 0; i < 2; i++) {
+            mach.reset_to_baseline();
+            tmp = tmp && mach.read_memory(0x201) == 0x00 &&
+                  mach.read_memory(0x3000) == char(0xff) &&
+                  mach.get_step_counter() == 0;
+            mach.exec(300);
+            tmp = tmp && same_state(mach, ref_mach);
+        }
+    }
+    // a page mapped to host memory is reset through the mapping; lda #$22,
+    // sta $0810
+    std::vector<char> host(0x100, 0x11);
+    mach.init();
+    mach.map_page(0x08, host.data(), false);
+    mach.load_program({0xa9, 0x22, 0x8d, 0x10, 0x08}, 0x200);
+    mach.set_baseline();
+    mach.exec(2);
+    tmp = tmp && host[0x10] == 0x22;
+    mach.reset_to_baseline();
+    tmp = tmp && host[0x10] == 0x11 && mach.read_memory(0x810) == 0x11;
+    // init() only clears the pages written, but must clear all of them,
+    // before the baseline too
+    mach.reset_to_baseline();
+    mach.exec(300);
+    mach.set_baseline();
+    mach.init();
+    for (t_addr addr = 0; addr < 0x10000; addr++) {
+        tmp = tmp && mach.read_memory(addr) == char(0xff);
+    }
+    mach.set_core(core_switch);
+    vfy(tmp);
+}
+
+static void
+test_trace()
+{
+    std::vector<char> prog = {
+        0xa2, 0x03, 0xca, 0xd0, 0xfd, // ldx #$03, dex, bne $0202
+        0x8d, 0x00, 0x03 // sta $0300
+    };
+    std::cout << "test : trace\n";
+    auto tmp = true;
+    // alone on a core that fuses the dex and bne, with the undo log on and
+    // with a breakpoint armed
+    for (int run = 0; run < 3; run++) {
+        t_trace trace;
+        tmp = tmp && trace.open("test_trace.trc", 0x100);
+        mach.init();
+        mach.set_core(run == 0 ? core_cached : core_switch);
+        mach.load_program(prog, 0x200);
+        mach.set_undo(run == 1 ? 0x100 : 0);
+        mach.set_breakpoint(0x400, run == 2);
+        mach.set_trace(&trace);
+        mach.exec(8);
+        trace.close();
+        std::ostringstream text;
+        tmp = tmp && decode_trace("test_trace.trc", text);
+        std::remove("test_trace.trc");
+        tmp = tmp && text.str() ==
+            "0200  a2 03     ldx #$03      a:00 x:00 y:00 p:24 sp:ff cyc:0\n"
+            "0202  ca        dex           a:00 x:03 y:00 p:24 sp:ff cyc:2\n"
+            "0203  d0 fd     bne $0202     a:00 x:02 y:00 p:24 sp:ff cyc:4\n"
+            "0202  ca        dex           a:00 x:02 y:00 p:24 sp:ff cyc:7\n"
+            "0203  d0 fd     bne $0202     a:00 x:01 y:00 p:24 sp:ff cyc:9\n"
+            "0202  ca        dex           a:00 x:01 y:00 p:24 sp:ff cyc:12\n"
+            "0203  d0 fd     bne $0202     a:00 x:00 y:00 p:26 sp:ff cyc:14\n"
+            "0205  8d 00 03  sta $0300     a:00 x:00 y:00 p:26 sp:ff cyc:16\n";
+    }
+    mach.clear_breakpoints();
+    vfy(tmp);
+}
+
+static void
+test_compare()
+{
+    std::vector<char> prog = {
+        0xa2, 0x03, 0xca, 0xd0, 0xfd, // ldx #$03, dex, bne $0202
+        0x8d, 0x00, 0x03 // sta $0300
+    };
+    // as nestest logs it, cycles counted from 7
+    std::vector<std::string> log = {
+        "0200  A2 03    LDX #$03  A:00 X:00 Y:00 P:24 SP:FF PPU:  0, 21 CYC:7",
+        "0202  CA       DEX       A:00 X:03 Y:00 P:24 SP:FF PPU:  0, 27 CYC:9",
+        "0203  D0 FD    BNE $0202 A:00 X:02 Y:00 P:24 SP:FF PPU:  0, 33 CYC:11",
+        "0202  CA       DEX       A:00 X:02 Y:00 P:24 SP:FF PPU:  0, 42 CYC:14",
+        "0203  D0 FD    BNE $0202 A:00 X:01 Y:00 P:24 SP:FF PPU:  0, 48 CYC:16",
+        "0202  CA       DEX       A:00 X:01 Y:00 P:24 SP:FF PPU:  0, 57 CYC:19",
+        "0203  D0 FD    BNE $0202 A:00 X:00 Y:00 P:26 SP:FF PPU:  0, 63 CYC:21",
+        "0205  8D 00 03 STA $0300 A:00 X:00 Y:00 P:26 SP:FF PPU:  0, 69 CYC:23"
+    };
+    std::cout << "test : compare\n";
+    auto write_log = [&]() {
+        std::ofstream file("test_compare.log");
+        for (auto& line : log) {
+            file << line << "\n";
+        }
+    };
+    write_log();
+    mach.init();
+    mach.load_program(prog, 0x200);
+    auto d = compare_trace(mach, "test_compare.log", ~0ul);
+    auto tmp = d.result == compare_match && d.line == 8 && d.steps == 7;
+    // the machine is one dex behind from the fifth line on
+    log[4][log[4].find("X:") + 3] = '2';
+    write_log();
+    mach.init();
+    mach.load_program(prog, 0x200);
+    d = compare_trace(mach, "test_compare.log", ~0ul);
+    tmp = tmp && d.result == compare_diverged && d.line == 5 &&
+          d.steps == 4 && d.field == "x" && d.expected == log[4] &&
+          d.context.size() == 4 && d.context[3] == log[3];
+    // past the fifth line the context is the five lines before
+    log[4][log[4].find("X:") + 3] = '1';
+    log[7][log[7].find("X:") + 3] = '9';
+    write_log();
+    mach.init();
+    mach.load_program(prog, 0x200);
+    d = compare_trace(mach, "test_compare.log", ~0ul);
+    tmp = tmp && d.result == compare_diverged && d.line == 8 &&
+          d.expected == log[7] && d.context.size() == 5 &&
+          d.context[0] == log[2] && d.context[4] == log[6];
+    std::remove("test_compare.log");
+    vfy(tmp);
+}
+
+static void
+test_profile()
+{
+    std::vector<char> prog = {
+        0xa2, 0x03, 0xbd, 0xff, 0x10, // ldx #$03, lda $10ff,x
+        0xca, 0xd0, 0xfa // dex, bne $0202
+    };
+    std::cout << "test : profile\n";
+    t_profile prof;
+    mach.init();
+    mach.load_program(prog, 0x200);
+    auto on = mach.set_profile(&prof);
+    mach.exec(10);
+    mach.set_profile(nullptr);
+    // a watchpoint stops a profiled run all the same, at the second lda
+    t_profile watched;
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.set_profile(&watched);
+    mach.set_read_watch(0x1101, true);
+    auto s = mach.run_to_stop(~0ul);
+    mach.set_profile(nullptr);
+    auto tmp = s.reason == stop_read && s.addr == 0x1101 &&
+               mach.get_program_counter() == 0x202 &&
+               mach.get_registers().rx == 2;
+    if (!on) {
+        // built without PROFILE: nothing is counted
+        vfy(tmp &&
+            std::count(prof.steps.begin(), prof.steps.end(), 0) == 0x10000);
+        return;
+    }
+    // every lda crosses a page; the last bne falls through
+    vfy(tmp && watched.steps[0x202] == 1 && prof.steps[0x202] == 3 && prof.cycles[0x202] == 15 &&
+        prof.crossings[0x202] == 3 && prof.opcode_steps[0xbd] == 3 &&
+        prof.branches[0x206] == 3 && prof.taken[0x206] == 2 &&
+        prof.crossings[0x206] == 0 && prof.opcode_cycles[0xd0] == 8 &&
+        prof.pairs[0xa2bd] == 1 && prof.pairs[0xbdca] == 3 &&
+        prof.pairs[0xcad0] == 3 && prof.pairs[0xd0bd] == 0);
+}
+
+static void
+test_call_graph()
+{
+    std::vector<char> prog(0x22, 0xea);
+    // jsr $0210, jsr $0210; $0210: jsr $0220, rts
+    std::vector<char> top = {0x20, 0x10, 0x02, 0x20, 0x10, 0x02};
+    std::vector<char> outer = {0x20, 0x20, 0x02, 0x60};
+    std::copy(top.begin(), top.end(), prog.begin());
+    std::copy(outer.begin(), outer.end(), prog.begin() + 0x10);
+    prog[0x21] = 0x60; // $0220: nop, rts
+    std::cout << "test : call graph\n";
+    std::ofstream("test_calls.lbl") << "al C:0210 .outer\n"
+                                       "al C:0220 .inner\n";
+    t_symbols symbols;
+    auto tmp = load_symbols("test_calls.lbl", symbols);
+    std::remove("test_calls.lbl");
+    t_profile prof;
+    mach.init();
+    mach.load_program(prog, 0x200);
+    auto on = mach.set_profile(&prof);
+    mach.exec(10);
+    mach.set_profile(nullptr);
+    if (!on) {
+        // built without PROFILE: nothing is counted
+        vfy(tmp && prof.nodes.size() == 1 && prof.nodes[0].cycles == 0);
+        return;
+    }
+    std::ostringstream folded;
+    print_collapsed(prof, symbols, folded);
+    vfy(tmp && mach.get_registers().pc == 0x206 && prof.frames.empty() &&
+        prof.nodes.size() == 3 && prof.nodes[2].calls == 2 &&
+        folded.str() == "[top] 12\n"
+                        "outer 24\n"
+                        "outer;inner 16\n");
+}
+
+static void
+test_heat()
+{
+    std::vector<char> prog = {
+        0xa2, 0x03, 0xe6, 0x10, // ldx #$03, inc $10
+        0xca, 0xd0, 0xfb // dex, bne $0202
+    };
+    std::cout << "test : heat map\n";
+    t_profile prof;
+    mach.init();
+    mach.load_program(prog, 0x200);
+    auto on = mach.set_profile(&prof);
+    mach.exec(10);
+    mach.set_profile(nullptr);
+    std::ostringstream csv, pages, pgm;
+    write_heat_csv(prof, csv, false);
+    write_heat_csv(prof, pages, true);
+    write_heat_pgm(prof, pgm);
+    auto image = pgm.str();
+    auto tmp = image.size() == 15 + 0x10000 &&
+               image.compare(0, 15, "P5\n256 256\n255\n") == 0;
+    if (!on) {
+        // built without PROFILE: nothing is counted
+        vfy(tmp && csv.str() == "addr,reads,writes,execs\n");
+        return;
+    }
+    // instruction bytes are read as fetched, the offset of the branch
+    // falling through left out; inc $10 reads and writes it
+    vfy(tmp && (unsigned char)(image[15 + 0x10]) == 255 &&
+        csv.str() == "addr,reads,writes,execs\n"
+                     "0010,3,3,0\n"
+                     "0200,1,0,1\n"
+                     "0201,1,0,0\n"
+                     "0202,3,0,3\n"
+                     "0203,3,0,0\n"
+                     "0204,3,0,3\n"
+                     "0205,3,0,3\n"
+                     "0206,2,0,0\n" &&
+        pages.str() == "page,reads,writes,execs\n"
+                       "00,3,3,0\n"
+                       "02,16,0,10\n");
+}
+
+// raises an irq every 100 cycles
+struct t_timer {
+    t_cycles at;
+
+    void operator()(t_machine& m) const {
+        m.raise_irq();
+        m.schedule(at + 100, t_timer{at + 100});
+    }
+};
+
+// the timer, an nmi at 550 and an irq scheduled and cancelled
+static void setup_events(t_machine& m, t_core core, t_cycles& seen) {
+    std::vector<char> prog = {0x58, 0xe8, 0x4c, 0x01, 0x02}; // cli, inx, jmp
+    std::vector<char> handlers = {
+        0xe6, 0x10, 0x40, // $0300: inc $10, rti
+        0xe6, 0x11, 0x40 // $0303: inc $11, rti
+    };
+    m.init();
+    m.set_core(core);
+    m.load_program({0x00, 0x00}, 0x10);
+    m.load_program(handlers, 0x300);
+    m.load_program({0x03, 0x03, 0x00, 0x00, 0x00, 0x03}, 0xfffa);
+    m.load_program(prog, 0x200);
+    m.schedule(100, t_timer{100});
+    m.schedule_nmi(550);
+    m.schedule(333, [&seen](t_machine& m) { seen = m.get_cycle_counter(); });
+    auto id = m.schedule_irq(50);
+    seen = m.cancel(id) && !m.cancel(id);
+}
+
+static void
+test_events()
+{
+    std::cout << "test : events\n";
+    t_cycles seen;
+    setup_events(ref_mach, core_switch, seen);
+    auto tmp = seen == 1;
+    while (ref_mach.get_cycle_counter() < 1000) {
+        ref_mach.step();
+    }
+    tmp = tmp && seen >= 333 && seen < 340;
+    // the ticks at 100 to 900 and the nmi
+    tmp = tmp && ref_mach.read_memory(0x10) == 9 &&
+          ref_mach.read_memory(0x11) == 1;
+    for (auto core : {core_switch, core_threaded, core_cached, core_jit}) {
+        setup_events(mach, core, seen);
+        mach.run_until(1000);
+        tmp = tmp && seen >= 333 && seen < 340 && same_state(mach, ref_mach);
+    }
+    mach.init();
+    mach.set_core(core_switch);
+    vfy(tmp);
+}
+
+// a device counting reads of its second byte and keeping what is written
+struct t_test_io : t_io {
+    char last = 0;
+    int reads = 0;
+    char read(t_addr addr) override {
+        if (addr == 0xd001) {
+            return ++reads >= 10;
+        }
+        return last + 1;
+    }
+    void write(t_addr, char val) override {
+        last = val;
+    }
+};
+
+static void
+test_bus()
+{
+    std::vector<char> prog = {
+        0xa9, 0x41, 0x8d, 0x00, 0xd0, // lda #$41, sta $d000
+        0xad, 0x00, 0xd0, 0x85, 0x00, // lda $d000, sta $00
+        0x8d, 0x10, 0x08, 0xad, 0x10, 0x09, // sta $0810, lda $0910
+        0x85, 0x01, 0x8d, 0x00, 0x30, // sta $01, sta $3000
+        0xad, 0x01, 0xd0, 0xf0, 0xfb // lda $d001, beq $0215
+    };
+    std::cout << "test : bus\n";
+    auto tmp = true;
+    for (auto core : {core_switch, core_threaded, core_cached, core_jit}) {
+        t_test_io io;
+        std::vector<char> mirror(0x100);
+        mach.init();
+        mach.set_core(core);
+        mach.load_program(prog, 0x200);
+        mach.map_io(0xd0, &io);
+        mach.map_page(0x08, mirror.data(), false);
+        mach.map_page(0x09, mirror.data(), false);
+        mach.map_page(0x30, nullptr, true);
+        // polling a device is not an idle loop
+        mach.set_idle_mode(idle_trap);
+        auto s = mach.run_to_stop(~0ul);
+        tmp = tmp && s.reason == stop_illegal && s.addr == 0x21a;
+        tmp = tmp && mem(0) == 0x42 && mem(1) == 0x42 && mem(0x3000) == 0xff;
+        tmp = tmp && mirror[0x10] == 0x42 && io.reads == 10;
+        // mapped pages are saved as the program reads them and restored
+        // through the mapping
+        auto snap = mach.snapshot();
+        mirror[0x10] = 0x00;
+        mach.restore(snap);
+        tmp = tmp && mirror[0x10] == 0x42 && mem(0x0910) == 0x42;
+    }
+    vfy(tmp);
+}
+
+// a device returning noise, raising an irq from every seventh read
+struct t_noise_io : t_io {
+    t_machine* m;
+    unsigned state = 1;
+    char read(t_addr) override {
+        state = state * 1103515245 + 12345;
+        if (state % 7 == 0) {
+            m->raise_irq();
+        }
+        return state >> 16;
+    }
+    void write(t_addr, char) override {
+    }
+};
+
+// registers, counters and ram but the device page
+static std::string digest(t_machine& m) {
+    auto r = m.get_registers();
+    std::ostringstream s;
+    s << r.pc << ' ' << int(r.sp) << ' ' << int(r.ra) << ' ' << int(r.rx)
+      << ' ' << int(r.ry) << ' ' << int(r.rp) << ' ' << m.get_step_counter()
+      << ' ' << m.get_cycle_counter() << ' ';
+    for (t_addr addr = 0; addr < 0x10000; addr++) {
+        if (addr >> 8 != 0xd0) {
+            s << m.read_memory(addr);
+        }
+    }
+    return s.str();
+}
+
+static void
+test_replay()
+{
+    std::vector<char> prog = {
+        0x58, 0xad, 0x00, 0xd0, // cli, lda $d000
+        0x18, 0x65, 0x10, 0x85, 0x10, // clc, adc $10, sta $10
+        0xe8, 0x4c, 0x01, 0x02 // inx, jmp $0201
+    };
+    std::vector<char> handler = {
+        0x48, 0xad, 0x01, 0xd0, // pha, lda $d001
+        0x45, 0x11, 0x85, 0x11, // eor $11, sta $11
+        0xe6, 0x12, 0x68, 0x40 // inc $12, pla, rti
+    };
+    std::cout << "test : replay\n";
+    t_noise_io noise;
+    noise.m = &ref_mach;
+    ref_mach.init();
+    ref_mach.set_core(core_threaded);
+    ref_mach.map_io(0xd0, &noise);
+    ref_mach.load_program(handler, 0x300);
+    ref_mach.load_program({0x00, 0x03}, 0xfffe);
+    ref_mach.load_program(prog, 0x200);
+    ref_mach.schedule(100, t_timer{100});
+    t_recording rec;
+    ref_mach.record(&rec, 1000);
+    std::vector<std::string> states;
+    for (t_cycles at : {3000, 12000, 20000}) {
+        ref_mach.run_until(at);
+        states.push_back(digest(ref_mach));
+    }
+    ref_mach.record(nullptr, 0);
+    auto tmp = rec.checkpoints.size() >= 19 && !rec.reads.empty() &&
+               rec.inputs.size() > 150 && ref_mach.read_memory(0x12) != 0;
+    // devices answer nothing while replaying; seek back and forth
+    t_test_io silent;
+    mach.init();
+    mach.map_io(0xd0, &silent);
+    tmp = tmp && mach.seek(rec, 12000) && digest(mach) == states[1];
+    tmp = tmp && mach.seek(rec, 3000) && digest(mach) == states[0];
+    tmp = tmp && mach.seek(rec, 20000) && digest(mach) == states[2];
+    tmp = tmp && mach.seek(rec, 0) && silent.reads == 0;
+    ref_mach.init();
+    ref_mach.set_core(core_switch);
+    mach.init();
+    vfy(tmp);
+}
+
+static void
+test_recompiled()
+{
+    std::cout << "test : recompiled\n";
+    ref_mach.init();
+    ref_mach.load_program_from_file("test.bin", 0x4000);
+    ref_mach.set_breakpoint(0x45c0, true);
+    ref_mach.run_to_stop(~0ul);
+    auto steps = ref_mach.get_step_counter();
+    mach.set_recompiled(&full_test_rc);
+    mach.init();
+    mach.set_core(core_recompiled);
+    mach.load_program_from_file("test.bin", 0x4000);
+    mach.exec(steps);
+    auto tmp = same_state(mach, ref_mach) && mem(0x210) == 0xff;
+    // a block no longer holding its bytes is left to the switch core
+    for (auto m : {&ref_mach, &mach}) {
+        m->init();
+        m->load_program_from_file("test.bin", 0x4000);
+        m->load_program({0x56}, 0x4006);
+        m->set_program_counter(0x4000);
+        m->exec(steps);
+    }
+    tmp = tmp && same_state(mach, ref_mach);
+    mach.set_recompiled(nullptr);
+    mach.init();
+    mach.set_core(core_switch);
+    ref_mach.init();
+    vfy(tmp);
+}
+
+static void
+test_fusion()
+{
+    std::vector<char> prog = {
+        0xa9, 0x08, 0x85, 0x10, // lda #$08, sta $10
+        0xa2, 0x10, 0x8a, // ldx #$10, txa
+        0xc5, 0x10, 0xd0, 0x02, // cmp $10, bne $020d
+        0xe6, 0x11, 0x08, // inc $11, php
+        0x68, 0x29, 0xc3, // pla, and #$c3
+        0xca, 0xd0, 0xf2, // dex, bne $0206
+        0x4c, 0x14, 0x02 // jmp $0214
+    };
+    std::cout << "test : fusion\n";
+    auto tmp = true;
+    // slices of 1 and 3 steps end runs between the two of a pair
+    for (unsigned long slice : {1, 2, 3, 1000}) {
+        for (auto m : {&ref_mach, &mach}) {
+            m->init();
+            m->load_program(prog, 0x200);
+        }
+        mach.set_core(core_cached);
+        for (unsigned long steps = 0; steps < 300; steps += slice) {
+            ref_mach.exec(slice);
+            mach.exec(slice);
+        }
+        // the bne falls through once, at x = 8, taking $11 from $ff to 0
+        tmp = tmp && same_state(mach, ref_mach) && mem(0x11) == 0 &&
+              mach.get_registers().rx == 0 &&
+              (mach.get_fused_count() == 0) == (slice == 1);
+    }
+    mach.set_fusion(false);
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.exec(300);
+    tmp = tmp && mach.get_fused_count() == 0;
+    mach.set_fusion(true);
+    mach.set_core(core_switch);
+    ref_mach.init();
+    vfy(tmp);
+}
+
+static void
+test_bulk()
+{
+    typedef std::vector<std::pair<t_addr, std::vector<char>>> t_layout;
+    t_layout prog = {{0x200, {
+        0xa0, 0x00, // ldy #$00
+        0xb1, 0x20, 0x91, 0x22, 0xc8, 0xd0, 0xf9, // copy ($20) to ($22)
+        0xa2, 0x00, 0xa9, 0x5a, // ldx #$00, lda #$5a
+        0x9d, 0x00, 0x06, 0xca, 0xd0, 0xfa, // fill $0600-$06ff
+        0xa0, 0x80, // ldy #$80
+        0x91, 0x24, 0xc8, 0xd0, 0xfb, // fill ($24)+$80 up
+        0xe6, 0x23, 0xe6, 0x25, // inc $23, inc $25
+        0x4c, 0x00, 0x02 // jmp $0200
+    }}};
+    // the same loops, each ending on the last byte of a page, so that the
+    // branch back crosses a page
+    t_layout at_end = {
+        {0x2000, {0xa0, 0x00, 0x4c, 0xf9, 0x20}}, // ldy #$00, jmp $20f9
+        {0x20f9, {0xb1, 0x20, 0x91, 0x22, 0xc8, 0xd0, 0xf9}},
+        {0x2100, {0xa2, 0x00, 0xa9, 0x5a, 0x4c, 0xfa, 0x21}},
+        {0x21fa, {0x9d, 0x00, 0x06, 0xca, 0xd0, 0xfa}},
+        {0x2200, {0xa0, 0x80, 0x4c, 0xfb, 0x22}}, // ldy #$80, jmp $22fb
+        {0x22fb, {0x91, 0x24, 0xc8, 0xd0, 0xfb}},
+        {0x2300, {0xe6, 0x23, 0xe6, 0x25, 0x4c, 0x00, 0x20}}
+    };
+    std::vector<char> data(0x500);
+    for (unsigned i = 0; i < data.size(); i++) {
+        data[i] = i * 7;
+    }
+    // apart, overlapping ahead of the source, and on the zero page, the
+    // stack and then the code
+    const std::vector<std::vector<char>> pointers = {
+        {char(0x80), 0x03, 0x00, 0x07, 0x00, 0x0a},
+        {char(0x80), 0x07, char(0x90), 0x07, 0x40, 0x10},
+        {char(0x80), 0x03, char(0xf0), 0x00, char(0xc0), 0x00}
+    };
+    std::cout << "test : bulk\n";
+    auto tmp = true;
+    for (auto layout : {&prog, &at_end}) {
+        for (auto& zero_page : pointers) {
+            // slices ending inside the loops
+            for (unsigned long slice : {1, 7, 1000, 20000}) {
+                for (auto m : {&ref_mach, &mach}) {
+                    m->init();
+                    for (auto& code : *layout) {
+                        m->load_program(code.second, code.first);
+                    }
+                    m->load_program(data, 0x380);
+                    m->load_program(zero_page, 0x20);
+                    m->set_program_counter(layout->front().first);
+                }
+                mach.set_core(core_cached);
+                for (unsigned long steps = 0; steps < 20000;
+                     steps += slice) {
+                    ref_mach.exec(slice);
+                    mach.exec(slice);
+                }
+                tmp = tmp && same_state(mach, ref_mach);
+            }
+        }
+    }
+    mach.set_core(core_switch);
+    ref_mach.init();
+    vfy(tmp);
+}
+
+static void
+test_undo()
+{
+    std::vector<char> prog = {
+        0x58, 0xa2, 0x00, // cli, ldx #$00
+        0x20, 0x00, 0x04, 0xe8, // jsr $0400, inx
+        0x4c, 0x03, 0x02 // jmp $0203
+    };
+    std::vector<char> routine = {
+        0x48, 0x8a, 0x9d, 0x00, 0x05, // pha, txa, sta $0500,x
+        0xfe, 0x00, 0x06, 0x68, // inc $0600,x, pla
+        0x69, 0x03, 0x60 // adc #$03, rts
+    };
+    std::vector<char> handler = {0xe6, 0x12, 0x40}; // inc $12, rti
+    std::cout << "test : undo\n";
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.load_program(routine, 0x400);
+    mach.load_program(handler, 0x300);
+    mach.load_program({0x00, 0x03}, 0xfffe);
+    mach.set_program_counter(0x200);
+    // writes copy shared pages back first
+    mach.restore(mach.snapshot());
+    mach.schedule_irq(150);
+    mach.schedule_irq(700);
+    mach.set_undo(0x1000);
+    std::vector<std::string> states = {digest(mach)};
+    for (int i = 0; i < 100; i++) {
+        mach.step();
+        states.push_back(digest(mach));
+    }
+    mach.exec(150);
+    auto r = mach.run_back_until(0x203);
+    auto tmp = r.ret == 0 && r.steps > 0 && mach.get_program_counter() == 0x203;
+    while (mach.get_step_counter() > 100) {
+        mach.step_back();
+    }
+    tmp = tmp && mach.read_memory(0x12) == 0;
+    for (int i = 100; i >= 0; i--) {
+        tmp = tmp && digest(mach) == states[i];
+        tmp = tmp && mach.step_back() == (i > 0);
+    }
+    // the same steps again, without the interrupts
+    mach.exec(100);
+    tmp = tmp && mach.read_memory(0x12) == 0xff;
+    // a short log keeps the last steps
+    mach.set_undo(0x100);
+    mach.exec(1000);
+    r = mach.run_back_until(0); // nothing runs there
+    tmp = tmp && r.ret == 1 && r.steps > 50 && r.steps < 1000;
+    mach.exec(10);
+    mach.restore(mach.snapshot());
+    tmp = tmp && !mach.step_back();
+    mach.init();
+    vfy(tmp);
+}
+
+// Lanes take data-dependent branches, indexed and indirect addresses and
+// jumps to their own targets; each must end as a machine of its own does.
+static std::vector<char> lockstep_image(int lane) {
+    std::vector<char> image(0x0900, 0xff);
+    auto put = [&](t_addr addr, const std::vector<char>& v) {
+        std::copy(v.begin(), v.end(), image.begin() + addr);
+    };
+    put(0x0010, {
+        char(lane * 0x29 + 0x0d), char(lane * 7), // inputs
+        0x80, 0x07, 0xc0, 0x08 // pointers
+    });
+    put(0x001e, {0x00, 0x07});
+    put(0x0200, {
+        0xa5, 0x10, 0xa6, 0x11, // lda $10, ldx $11
+        0x20, 0x00, 0x04, 0x85, 0x20, // jsr $0400, sta $20
+        0xbd, 0xf0, 0x07, 0x95, 0x40, // lda $07f0,x, sta $40,x
+        0xa4, 0x10, 0xb1, 0x12, 0x91, 0x14, // ldy $10, lda ($12),y, sta ($14),y
+        0xa5, 0x10, 0x29, 0x03, 0x0a, 0xaa, // lda $10, and #$03, asl a, tax
+        0xbd, 0x00, 0x07, 0x85, 0x16, // lda $0700,x, sta $16
+        0xbd, 0x01, 0x07, 0x85, 0x17, // lda $0701,x, sta $17
+        0x6c, 0x16, 0x00 // jmp ($0016)
+    });
+    // multiply by shifts and adds
+    put(0x0400, {
+        0x85, 0x50, 0x86, 0x51, // sta $50, stx $51
+        0xa9, 0x00, 0xa0, 0x08, // lda #$00, ldy #$08
+        0x46, 0x51, 0x90, 0x03, // lsr $51, bcc $040f
+        0x18, 0x65, 0x50, // clc, adc $50
+        0x06, 0x50, 0x88, 0xd0, 0xf4, // asl $50, dey, bne $0408
+        0x60 // rts
+    });
+    put(0x0500, {
+        0x38, 0xa5, 0x10, 0xe9, 0x40, // sec, lda $10, sbc #$40
+        0x08, 0x68, 0x85, 0x30, // php, pla, sta $30
+        0x4c, 0x00, 0x06 // jmp $0600
+    });
+    put(0x0510, {
+        0x18, 0xa5, 0x10, 0x69, 0x90, // clc, lda $10, adc #$90
+        0x24, 0x10, 0x08, 0x68, 0x85, 0x30, // bit $10, php, pla, sta $30
+        0x4c, 0x00, 0x06 // jmp $0600
+    });
+    put(0x0520, {
+        0xa5, 0x10, 0x4a, 0x66, 0x31, // lda $10, lsr a, ror $31
+        0x2a, 0x49, 0x5a, 0x85, 0x30, // rol a, eor #$5a, sta $30
+        0x4c, 0x00, 0x06 // jmp $0600
+    });
+    put(0x0530, {
+        0xa5, 0x10, 0xc9, 0xe0, // lda $10, cmp #$e0
+        0x90, 0x01, 0x02, // bcc $0537, illegal
+        0xa1, 0x18, 0x85, 0x30, // lda ($18,x), sta $30
+        0x4c, 0x00, 0x06 // jmp $0600
+    });
+    put(0x0600, {
+        0xa5, 0x10, 0x29, 0x0f, 0xa8, // lda $10, and #$0f, tay
+        0xe6, 0x32, 0x88, 0x10, 0xfb, // inc $32, dey, bpl $0605
+        0xba, 0x86, 0x33, // tsx, stx $33
+        0xa9, 0x02, 0x48, 0xa9, 0xf0, 0x48, // push $02f0
+        0xa5, 0x10, 0x48, 0x40 // lda $10, pha, rti
+    });
+    put(0x0700, {0x00, 0x05, 0x10, 0x05, 0x20, 0x05, 0x30, 0x05});
+    return image;
+}
+
+static bool same_lane(t_machine_vector& v, int l, t_machine& m, t_stop stop) {
+    auto r = v.get_registers(l);
+    auto s = m.get_registers();
+    auto t = v.get_stop(l);
+    if (r.pc != s.pc || r.sp != s.sp || r.ra != s.ra || r.rx != s.rx ||
+        r.ry != s.ry || r.rp != s.rp || t.reason != stop.reason ||
+        t.addr != stop.addr) {
+        return false;
+    }
+    if (v.get_step_counter(l) != m.get_step_counter() ||
+        v.get_cycle_counter(l) != m.get_cycle_counter()) {
+        return false;
+    }
+    for (t_addr addr = 0; addr < 0x10000; addr++) {
+        if (v.read_memory(l, addr) != m.read_memory(addr)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+test_lockstep()
+{
+    std::cout << "test : lockstep\n";
+    std::unique_ptr<t_machine_vector> v(new t_machine_vector);
+    std::unique_ptr<t_machine_vector> w(new t_machine_vector);
+    std::unique_ptr<t_machine_vector> u(new t_machine_vector);
+    v->load_program(lockstep_image(0), 0);
+    w->load_program(lockstep_image(0), 0);
+    u->load_program(lockstep_image(0), 0);
+    for (int l = 0; l < t_machine_vector::lanes; l++) {
+        auto image = lockstep_image(l);
+        for (t_addr addr = 0x10; addr < 0x12; addr++) {
+            v->write_memory(l, addr, image[addr]);
+            w->write_memory(l, addr, image[addr]);
+            u->write_memory(l, addr, image[addr]);
+        }
+    }
+    for (auto m : {v.get(), w.get(), u.get()}) {
+        m->set_program_counter(0x200);
+        m->set_stop_pc(0x2f0);
+    }
+    // all at once, a few steps at a time, and lane by lane
+    v->run(1000);
+    for (int i = 0; i < 100; i++) {
+        w->run(7);
+    }
+    u->set_max_groups(1);
+    u->run(1000);
+    auto tmp = v->get_fallbacks() == 0 && u->get_fallbacks() > 0;
+    for (int l = 0; l < t_machine_vector::lanes; l++) {
+        mach.init();
+        mach.load_program(lockstep_image(l), 0);
+        mach.set_program_counter(0x200);
+        mach.set_breakpoint(0x2f0, true);
+        auto stop = mach.run_to_stop(1000);
+        tmp = tmp && same_lane(*v, l, mach, stop);
+        tmp = tmp && same_lane(*w, l, mach, stop);
+        tmp = tmp && same_lane(*u, l, mach, stop);
+    }
+    vfy(tmp && v->get_stop(18).reason == stop_illegal &&
+        v->get_stop(0).reason == stop_break);
+}
+
 void begin_testing() {
     pass_count = 0;
     total_count = 0;
@@ -200,14 +1162,31 @@ void modular_test() {
     test_jump();
     test_branch();
     test_mode();
+    test_breakpoint();
+    test_watch_stack();
+    test_idle();
+    test_bus();
+    test_fork();
+    test_baseline();
+    test_trace();
+    test_compare();
+    test_profile();
+    test_call_graph();
+    test_heat();
+    test_events();
+    test_replay();
+    test_undo();
+    test_recompiled();
+    test_fusion();
+    test_bulk();
+    test_lockstep();
 }
 
 void full_test() {
     mach.init();
     mach.load_program_from_file("test.bin", 0x4000);
-    while (mach.get_program_counter() != 0x45c0u) {
-        mach.step();
-    }
+    mach.set_breakpoint(0x45c0, true);
+    mach.run_to_stop(~0ul);
     auto answer = mach.read_memory(0x0210);
     std::cout << "answer : "; print_hex(answer); std::cout << "\n";
     if (answer == 0xff) {
@@ -225,20 +1204,491 @@ void func_test() {
         return;
     }
     mach.set_program_counter(0x0400);
+    mach.set_breakpoint(0x3469, true);
     while (true) {
-        auto pc = mach.get_program_counter();
-        auto sc = mach.get_step_counter();
-        if (pc == 0x3469ul) {
+        mach.print_info();
+        mach.set_step_limit(mach.get_step_counter() + 0x1000);
+        auto stop = mach.run_to_stop(~0ul);
+        if (mach.get_program_counter() == 0x3469ul) {
             std::cout << "success\n";
             break;
         }
-        if (sc % 0x1000u == 0) {
-            mach.print_info();
-        }
-        auto ret = mach.step();
-        if (ret < 0) {
+        if (stop.reason == stop_illegal) {
             std::cout << "bad instruction\n";
             break;
         }
     }
 }
+
+// the steps the functional test takes to reach its success address
+static const unsigned long func_test_steps = 26986179;
+static const t_addr func_test_success = 0x3469;
+
+static int load_func_test(t_machine& m, t_core core) {
+    m.init();
+    m.set_core(core);
+    auto ret = m.load_program_from_file("func_test_no_dec.bin", 0x0000);
+    m.set_program_counter(0x0400);
+    return ret;
+}
+
+static bool same_state(t_machine& m, t_machine& n) {
+    auto r = m.get_registers();
+    auto s = n.get_registers();
+    if (r.pc != s.pc || r.sp != s.sp || r.ra != s.ra || r.rx != s.rx ||
+        r.ry != s.ry || r.rp != s.rp) {
+        return false;
+    }
+    if (m.get_step_counter() != n.get_step_counter() ||
+        m.get_cycle_counter() != n.get_cycle_counter()) {
+        return false;
+    }
+    for (t_addr addr = 0; addr < 0x10000; addr++) {
+        if (m.read_memory(addr) != n.read_memory(addr)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void core_test(t_core core, const std::string& name) {
+    // run as many steps as the switch core needed to reach the end
+    if (load_func_test(mach, core) < 0 ||
+        mach.exec(ref_mach.get_step_counter()) < 0) {
+        std::cout << "core test fail : " << name << "\n";
+        return;
+    }
+    mach.print_info();
+    if (!same_state(ref_mach, mach)) {
+        std::cout << "core test fail : " << name << "\n";
+        return;
+    }
+    // again in time slices up to the cycle count of the switch core
+    load_func_test(mach, core);
+    auto end = ref_mach.get_cycle_counter();
+    t_cycles cycles = 0;
+    unsigned long steps = 0;
+    while (mach.get_cycle_counter() < end) {
+        auto r = mach.run_until(std::min(mach.get_cycle_counter() + 9973, end));
+        cycles += r.cycles;
+        steps += r.steps;
+    }
+    if (same_state(ref_mach, mach) && cycles == end &&
+        steps == mach.get_step_counter()) {
+        std::cout << "core test pass : " << name << "\n";
+    } else {
+        std::cout << "core test fail : " << name << "\n";
+    }
+}
+
+void core_test() {
+    if (load_func_test(ref_mach, core_switch) < 0) {
+        std::cout << "load program fail\n";
+        return;
+    }
+    while (ref_mach.get_program_counter() != 0x3469ul) {
+        if (ref_mach.step() < 0) {
+            std::cout << "bad instruction\n";
+            return;
+        }
+    }
+    ref_mach.print_info();
+    core_test(core_switch, "switch");
+    core_test(core_threaded, "threaded");
+    core_test(core_cached, "cached");
+    mach.set_fusion(false);
+    core_test(core_cached, "cached unfused");
+    mach.set_fusion(true);
+    core_test(core_jit, "jit");
+    mach.set_recompiled(&func_test_rc);
+    core_test(core_recompiled, "recompiled");
+    mach.set_recompiled(nullptr);
+}
+
+void memory_bench() {
+    // eight data accesses per nine instructions: loads, stores and a
+    // read-modify-write through the indexed, zero page and indirect modes
+    std::vector<char> prog = {
+        0xbd, 0x00, 0x10, // lda $1000,x
+        0x9d, 0x00, 0x20, // sta $2000,x
+        0xa4, 0x10,       // ldy $10
+        0x84, 0x11,       // sty $11
+        0xb1, 0x20,       // lda ($20),y
+        0x95, 0x30,       // sta $30,x
+        0x06, 0x50,       // asl $50
+        0xe8,             // inx
+        0x4c, 0x00, 0x02  // jmp $0200
+    };
+    const unsigned long iterations = 10000000;
+    mach.init();
+    mach.set_core(core_switch);
+    mach.load_program(prog, 0x200);
+    auto start = std::chrono::steady_clock::now();
+    mach.exec(iterations * 9);
+    auto stop = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(stop - start).count();
+    std::cout << "loads/stores per second : " << iterations * 8 / sec << "\n";
+}
+
+void batch_bench() {
+    std::ifstream input("func_test_no_dec.bin", std::ios::binary);
+    if (!input.good()) {
+        std::cout << "load program fail\n";
+        return;
+    }
+    std::vector<char> image{std::istreambuf_iterator<char>(input),
+                            std::istreambuf_iterator<char>()};
+    auto hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<t_job> jobs(8 * hw);
+    for (auto& job : jobs) {
+        job = {image, 0x0000, 0x0400, 0x3469, false, 200000000,
+               core_threaded, 0, 0};
+    }
+    double base = 0;
+    for (unsigned threads = 1; threads <= hw; threads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        auto results = run_batch(jobs, threads);
+        auto stop = std::chrono::steady_clock::now();
+        double sec = std::chrono::duration<double>(stop - start).count();
+        for (auto& r : results) {
+            if (r.stop.reason != stop_break || r.stop.addr != 0x3469) {
+                std::cout << "batch fail\n";
+                return;
+            }
+        }
+        auto rate = jobs.size() / sec;
+        if (threads == 1) {
+            base = rate;
+        }
+        std::cout << "threads : " << threads << " | jobs/s : " << rate;
+        std::cout << " | speedup : " << rate / base << "\n";
+    }
+}
+
+void lockstep_bench() {
+    // each lane multiplies its own numbers; the shifts and adds branch on
+    // the data
+    std::vector<char> prog = {
+        0xa5, 0x10, 0xa6, 0x11, // lda $10, ldx $11
+        0x20, 0x00, 0x04, 0x85, 0x10, // jsr $0400, sta $10
+        0xe6, 0x11, 0x4c, 0x00, 0x02 // inc $11, jmp $0200
+    };
+    auto image = lockstep_image(0);
+    std::copy(prog.begin(), prog.end(), image.begin() + 0x200);
+    const unsigned long steps = 10000000;
+    const int lanes = t_machine_vector::lanes;
+    std::unique_ptr<t_machine_vector> v(new t_machine_vector);
+    v->load_program(image, 0);
+    for (int l = 0; l < lanes; l++) {
+        v->write_memory(l, 0x10, l * 0x29 + 0x0d);
+        v->write_memory(l, 0x11, l * 7);
+    }
+    v->set_program_counter(0x200);
+    auto start = std::chrono::steady_clock::now();
+    v->run(steps);
+    auto stop = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(stop - start).count();
+    auto rate = steps * lanes / sec;
+    std::cout << "lockstep : " << rate / 1e6 << " mips\n";
+    for (auto core : {core_switch, core_threaded}) {
+        start = std::chrono::steady_clock::now();
+        for (int l = 0; l < lanes; l++) {
+            image[0x10] = l * 0x29 + 0x0d;
+            image[0x11] = l * 7;
+            mach.init();
+            mach.set_core(core);
+            mach.load_program(image, 0);
+            mach.set_program_counter(0x200);
+            mach.exec(steps);
+            if (mach.read_memory(0x10) != v->read_memory(l, 0x10)) {
+                std::cout << "lockstep fail\n";
+                return;
+            }
+        }
+        stop = std::chrono::steady_clock::now();
+        sec = std::chrono::duration<double>(stop - start).count();
+        std::cout << (core == core_switch ? "switch" : "threaded");
+        std::cout << " : " << steps * lanes / sec / 1e6 << " mips";
+        std::cout << " | lockstep speedup : " << rate * sec / (steps * lanes);
+        std::cout << "\n";
+    }
+}
+
+void reset_bench() {
+    // a test sized program, as tst() runs them
+    std::vector<char> prog = {0xa9, 0x25, 0x29, 0x36, 0x85, 0x99};
+    const unsigned long resets = 1000000;
+    mach.init();
+    mach.set_core(core_switch);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < resets; i++) {
+        mach.init();
+        mach.load_program(prog, 0x200);
+        mach.exec(3);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(stop - start).count();
+    auto rate = resets / sec;
+    std::cout << "init resets per second : " << rate << "\n";
+    mach.init();
+    mach.load_program(prog, 0x200);
+    mach.set_baseline();
+    start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < resets; i++) {
+        mach.reset_to_baseline();
+        mach.exec(3);
+    }
+    stop = std::chrono::steady_clock::now();
+    sec = std::chrono::duration<double>(stop - start).count();
+    std::cout << "baseline resets per second : " << resets / sec;
+    std::cout << " | speedup : " << resets / sec / rate << "\n";
+}
+
+// cpu time of the calling thread, which leaves out a trace's drain thread
+static double thread_seconds() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void trace_bench() {
+    // the plain core, the checked core, a trace alone and a trace with a
+    // breakpoint armed
+    enum { run_core, run_checked, run_traced, run_both, runs };
+    const int repeats = 5;
+    t_trace trace;
+    double sec[runs] = {1e9, 1e9, 1e9, 1e9};
+    double wall = 1e9;
+    double bytes = 0;
+    // a run of each first to warm up, then the best of the repeats
+    for (int i = -1; i < repeats; i++) {
+        for (int run = 0; run < runs; run++) {
+            if (load_func_test(mach, core_threaded) < 0) {
+                std::cout << "load program fail\n";
+                return;
+            }
+            if (run == run_checked || run == run_both) {
+                // only arms the checked core, the run ends first
+                mach.set_breakpoint(func_test_success, true);
+            }
+            if (run == run_traced || run == run_both) {
+                trace.open("func_test.trc", 1 << 20);
+                mach.set_trace(&trace);
+            }
+            auto start = std::chrono::steady_clock::now();
+            auto cpu = thread_seconds();
+            mach.exec(func_test_steps);
+            cpu = thread_seconds() - cpu;
+            trace.close();
+            auto stop = std::chrono::steady_clock::now();
+            mach.set_trace(nullptr);
+            if (mach.get_program_counter() != func_test_success) {
+                std::cout << "trace fail\n";
+                return;
+            }
+            if (i < 0) {
+                continue;
+            }
+            sec[run] = std::min(sec[run], cpu);
+            if (run == run_traced) {
+                wall = std::min(
+                    wall, std::chrono::duration<double>(stop - start).count());
+                std::ifstream file("func_test.trc",
+                                   std::ios::binary | std::ios::ate);
+                bytes = double(file.tellg());
+            }
+        }
+    }
+    std::remove("func_test.trc");
+    auto steps = mach.get_step_counter();
+    std::cout << "core : " << steps / sec[run_core] / 1e6 << " mips";
+    std::cout << " | checked : " << steps / sec[run_checked] / 1e6 << " mips";
+    std::cout << " | traced : " << steps / sec[run_traced] / 1e6 << " mips";
+    std::cout << " | over core : " << sec[run_traced] / sec[run_core];
+    std::cout << " | checked and traced : " << sec[run_both] / sec[run_checked];
+    std::cout << " | with drain : " << wall << " s";
+    std::cout << " | bytes per step : " << bytes / steps;
+    std::cout << "\n";
+}
+
+void compare_bench() {
+    // a reference of the functional test from a trace of this emulator
+    const unsigned long steps = 2000000;
+    t_trace trace;
+    if (load_func_test(mach, core_switch) < 0 ||
+        !trace.open("func_test.trc", 1 << 20)) {
+        std::cout << "load program fail\n";
+        return;
+    }
+    mach.set_trace(&trace);
+    mach.exec(steps);
+    trace.close();
+    {
+        std::ofstream log("func_test.log");
+        decode_trace("func_test.trc", log);
+    }
+    std::remove("func_test.trc");
+    load_func_test(mach, core_switch);
+    auto start = std::chrono::steady_clock::now();
+    auto d = compare_trace(mach, "func_test.log", ~0ul);
+    auto stop = std::chrono::steady_clock::now();
+    std::remove("func_test.log");
+    double sec = std::chrono::duration<double>(stop - start).count();
+    if (d.result != compare_match || d.line != steps) {
+        std::cout << "compare fail : line " << d.line << "\n";
+        return;
+    }
+    std::cout << "lines compared per second : " << d.line / sec << "\n";
+}
+
+void profile_report() {
+    t_profile prof;
+    if (load_func_test(mach, core_switch) < 0) {
+        std::cout << "load program fail\n";
+        return;
+    }
+    if (!mach.set_profile(&prof)) {
+        std::cout << "profiling compiled out, build with make PROFILE=1\n";
+        return;
+    }
+    mach.set_breakpoint(0x3469, true);
+    mach.run_to_stop(~0ul);
+    print_profile(prof, std::cout, 10);
+    std::cout << "\nhot routines\n";
+    print_calls(prof, t_symbols(), std::cout, 10);
+    std::cout << "\nhot memory\n";
+    print_heat(prof, std::cout, 10);
+}
+
+void record_bench() {
+    const int repeats = 5;
+    t_recording rec;
+    double sec[2] = {1e9, 1e9};
+    // a run of each first to warm up, then the best of the repeats
+    for (int i = -1; i < repeats; i++) {
+        for (int recorded = 0; recorded < 2; recorded++) {
+            if (load_func_test(mach, core_threaded) < 0) {
+                std::cout << "load program fail\n";
+                return;
+            }
+            if (recorded) {
+                rec = t_recording();
+                mach.record(&rec, 1 << 20);
+            }
+            auto start = std::chrono::steady_clock::now();
+            mach.exec(func_test_steps);
+            auto stop = std::chrono::steady_clock::now();
+            if (mach.get_program_counter() != func_test_success) {
+                std::cout << "record fail\n";
+                return;
+            }
+            if (i >= 0) {
+                sec[recorded] = std::min(
+                    sec[recorded],
+                    std::chrono::duration<double>(stop - start).count());
+            }
+        }
+    }
+    auto end = mach.get_cycle_counter();
+    auto start = std::chrono::steady_clock::now();
+    mach.init();
+    auto ok = mach.seek(rec, end / 3) && mach.seek(rec, end / 2);
+    auto stop = std::chrono::steady_clock::now();
+    double seek = std::chrono::duration<double>(stop - start).count();
+    std::cout << "unrecorded : " << sec[0] << " s";
+    std::cout << " | recorded : " << sec[1] << " s";
+    std::cout << " | slowdown : " << sec[1] / sec[0];
+    std::cout << " | checkpoints : " << rec.checkpoints.size();
+    std::cout << " | two seeks : " << seek << " s" << (ok ? "" : " fail");
+    std::cout << "\n";
+}
+
+void undo_bench() {
+    const unsigned long steps = 4000000;
+    double sec[2];
+    for (int logged = 0; logged < 2; logged++) {
+        if (load_func_test(mach, core_switch) < 0) {
+            std::cout << "load program fail\n";
+            return;
+        }
+        if (logged) {
+            mach.set_undo(1 << 24);
+        }
+        auto start = std::chrono::steady_clock::now();
+        mach.exec(steps);
+        auto stop = std::chrono::steady_clock::now();
+        sec[logged] = std::chrono::duration<double>(stop - start).count();
+    }
+    auto start = std::chrono::steady_clock::now();
+    unsigned long back = 0;
+    while (back < steps && mach.step_back()) {
+        back++;
+    }
+    auto stop = std::chrono::steady_clock::now();
+    double sec_back = std::chrono::duration<double>(stop - start).count();
+    std::cout << "unlogged : " << sec[0] << " s";
+    std::cout << " | logged : " << sec[1] << " s";
+    std::cout << " | back : " << sec_back << " s";
+    std::cout << " | steps back : " << back << "\n";
+}
+
+void fusion_bench() {
+    // the two back to back, so that a slower spell of the host hits both;
+    // the median of their ratios
+    const int repeats = 21;
+    std::vector<double> ratio;
+    for (int i = 0; i < repeats; i++) {
+        double sec[2];
+        for (int fused = 0; fused < 2; fused++) {
+            mach.set_fusion(fused);
+            if (load_func_test(mach, core_cached) < 0) {
+                std::cout << "load program fail\n";
+                return;
+            }
+            auto cpu = thread_seconds();
+            mach.exec(func_test_steps);
+            sec[fused] = thread_seconds() - cpu;
+            if (mach.get_program_counter() != func_test_success) {
+                std::cout << "fusion fail\n";
+                mach.set_fusion(true);
+                return;
+            }
+        }
+        ratio.push_back(sec[1] / sec[0]);
+    }
+    std::sort(ratio.begin(), ratio.end());
+    auto saved = mach.get_fused_count();
+    auto steps = mach.get_step_counter();
+    std::cout << "fused / unfused : " << ratio[repeats / 2];
+    std::cout << " | dispatches removed : " << saved << " of " << steps;
+    std::cout << " (" << 100.0 * saved / steps << " %)\n";
+}
+
+void fork_bench() {
+    // branches of a few steps from a state well into the functional test
+    const unsigned long branches = 20000;
+    const unsigned long steps = 100;
+    if (load_func_test(mach, core_threaded) < 0) {
+        std::cout << "load program fail\n";
+        return;
+    }
+    mach.exec(1000000);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < branches; i++) {
+        auto child = mach.fork();
+        child->exec(steps);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    double fork = std::chrono::duration<double>(stop - start).count();
+    auto snap = mach.snapshot();
+    start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < branches; i++) {
+        mach.restore(snap);
+        mach.exec(steps);
+    }
+    stop = std::chrono::steady_clock::now();
+    double restore = std::chrono::duration<double>(stop - start).count();
+    std::cout << "fork : " << fork / branches * 1e6 << " us";
+    std::cout << " | restore : " << restore / branches * 1e6 << " us";
+    std::cout << " | machine : " << sizeof(t_machine) / 1024 << " KB\n";
+}
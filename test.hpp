@@ -5,3 +5,15 @@ void begin_testing();
 void end_testing();
 void full_test();
 void func_test();
+void core_test();
+void memory_bench();
+void batch_bench();
+void lockstep_bench();
+void reset_bench();
+void trace_bench();
+void compare_bench();
+void profile_report();
+void record_bench();
+void undo_bench();
+void fusion_bench();
+void fork_bench();
@@ -0,0 +1,822 @@
+#include <algorithm>
+#include <cstring>
+
+#include "machine.hpp"
+#include "opcodes.hpp"
+#include "trace.hpp"
+
+// Threaded-code cores. Every handler fuses the addressing mode with the
+// operation, keeps the registers in locals and jumps straight to the next
+// handler. Cycle counts and flags follow the m_*() / i_*() pairs used by
+// step() exactly.
+//
+// run_threaded<false> dispatches on the opcode byte through a 256-entry
+// table. run_threaded<true> runs from the predecoded cache instead: the
+// entry for an address holds the handler, the operand (or branch target),
+// the length and the base cycles. Entries are filled on first execution
+// and are stale once the generation of their page moves on, which
+// invalidate_code() does whenever a page holding decoded code is written.
+//
+// With fusion on, see t_machine::set_fusion(), decoding an instruction that
+// starts one of the pairs in pairs[] with the instruction after it on the
+// same page decodes that one too and gives the first entry a handler
+// running both with one dispatch. The bne after a cmp tests the result
+// the cmp left rather than the flags.
+//
+// Fusion also takes in the copy and fill loops in loops[], found whole on
+// one page and ending before its last byte, so that the branch back stays
+// on the page and takes 3 cycles. It runs as many of their iterations as
+// the count allows with one memmove() or memset(), leaving registers,
+// flags and cycles as the loop would. Every page is ram while the cached
+// instance runs, so there is no device to miss an access. A loop storing
+// to the zero page, where its pointers are, or to a page holding decoded
+// code runs as it is.
+//
+// The checked instance, used while breakpoints are armed, tests the pc
+// against break_map before each instruction and stops there. It likewise
+// tests read_map and write_map before the operand access, the pointer
+// fetch of (zp,x) and (zp),y, the pointer of jmp (abs), the stack bytes an
+// instruction or interrupt pushes or pulls and the vector it reads, all of
+// them before any is made. Nothing is tested for the instruction a run
+// resumes from after such a stop.
+//
+// With idle detection on, the checked instance also notes the state at the
+// target of every backward jump or branch. Reaching the same target again
+// with the same registers and no store or device access in between means
+// the code loops until an interrupt: it stops with stop_trap, or skips as
+// many whole iterations as the count allows.
+//
+// With a trace attached, the checked instance also records each instruction
+// before it runs, see t_trace. A trace with nothing else to check runs in
+// the traced instance, which records as the checked one does and tests
+// nothing. Neither runs from the cache, whose fused entries would leave
+// the second of a pair unrecorded.
+//
+// The bus instance, a checked one, reads and writes through the page table;
+// it runs whenever a page is mapped to a device or away from the machine's
+// ram.
+
+#define SET_NZ(v) p = (p & 0x7d) | ((v) & 0x80) | ((v) ? 0 : 0x02)
+#define SET_C(b) p = (p & 0xfe) | ((b) ? 0x01 : 0)
+#define SET_V(b) p = (p & 0xbf) | ((b) ? 0x40 : 0)
+
+#define RD(addr) (bus ? read_bus(addr) : mem[(addr) & 0xffff])
+#define RD2(addr) (RD(addr) | t_addr(RD((addr) + 1)) << 8)
+
+// stores keep the predecoded cache and the jit coherent
+#define WR(addr, val) \
+    if (checked) { \
+        writes++; \
+    } \
+    if (bus) { \
+        write_bus(addr, val); \
+    } else { \
+        mem[addr] = (val); \
+        dirty[(addr) >> 8] = 1; \
+        if ((cached || checked) && code_page[(addr) >> 8]) { \
+            invalidate_code(addr); \
+        } \
+    }
+
+#define TEST_BIT(map, addr) ((map)[(addr) >> 6] >> ((addr) & 63) & 1)
+
+#define WATCH_AT(map, addr, reason) \
+    if (checked && !first && TEST_BIT(map, addr)) { \
+        stop = {reason, t_addr(addr)}; \
+        goto stopped; \
+    }
+#define WATCH(map, reason) WATCH_AT(map, ea, reason)
+
+// the n bytes the pushes or pulls to come write or read
+#define WATCH_PUSH(n) \
+    for (unsigned i = 0; checked && i < (n); i++) { \
+        WATCH_AT(write_map, 0x100u + char(s - i), stop_write); \
+    }
+#define WATCH_PULL(n) \
+    for (unsigned i = 0; checked && i < (n); i++) { \
+        WATCH_AT(read_map, 0x100u + char(s + 1 + i), stop_read); \
+    }
+#define WATCH_PTR(addr, next) \
+    WATCH_AT(read_map, addr, stop_read); \
+    WATCH_AT(read_map, next, stop_read)
+
+#define PUSH(v) WR(0x100u + s, v); s--
+#define PULL(v) s++; v = RD(0x100u + s)
+
+// operand bytes of the current instruction
+#define OP8 (cached ? t_addr(d->operand) : t_addr(RD(pc + 1)))
+#define OP16 (cached ? t_addr(d->operand) : RD2(pc + 1))
+
+// addressing modes: leave the effective address in ea and step over the
+// operand; the indexed modes also note a page crossing in cross
+
+#define M_ZPG ea = OP8; pc += 2
+#define M_ZPX ea = char(OP8 + x); pc += 2
+#define M_ZPY ea = char(OP8 + y); pc += 2
+#define M_ABS ea = OP16; pc += 3
+#define M_ABX \
+    ea = OP16; cross = ((ea & 0xff) + x) >> 8; \
+    ea = (ea + x) & 0xffff; pc += 3
+#define M_ABY \
+    ea = OP16; cross = ((ea & 0xff) + y) >> 8; \
+    ea = (ea + y) & 0xffff; pc += 3
+#define M_INX \
+    ea = char(OP8 + x); WATCH_PTR(ea, ea + 1); \
+    ea = RD(ea) | t_addr(RD(ea + 1)) << 8; pc += 2
+#define M_INY \
+    ea = OP8; WATCH_PTR(ea, char(ea + 1)); \
+    ea = RD(ea) | t_addr(RD(char(ea + 1))) << 8; \
+    cross = ((ea & 0xff) + y) >> 8; ea = (ea + y) & 0xffff; pc += 2
+
+// read operands: leave the value in v
+#define R_IMM v = OP8; pc += 2
+#define R(mode) M_##mode; WATCH(read_map, stop_read); v = RD(ea)
+#define ST(r) WATCH(write_map, stop_write); WR(ea, r)
+
+// operations
+
+#define DO_LD(r) r = v; SET_NZ(r)
+#define DO_AND a &= v; SET_NZ(a)
+#define DO_EOR a ^= v; SET_NZ(a)
+#define DO_ORA a |= v; SET_NZ(a)
+#define DO_BIT p = (p & 0x3d) | (v & 0xc0) | ((a & v) ? 0 : 0x02)
+#define DO_CMP(r) SET_C(r >= v); v = r - v; SET_NZ(v)
+#define DO_ADC \
+    res = a + v + (p & 0x01); \
+    SET_V(~(a ^ v) & (a ^ res) & 0x80); SET_C(res > 0xff); \
+    a = res; SET_NZ(a)
+#define DO_SBC \
+    res = a - v - !(p & 0x01); \
+    SET_V((a ^ v) & (a ^ res) & 0x80); SET_C(res < 0x100); \
+    a = res; SET_NZ(a)
+#define DO_ASL(r) SET_C(r & 0x80); r <<= 1; SET_NZ(r)
+#define DO_LSR(r) SET_C(r & 0x01); r >>= 1; SET_NZ(r)
+#define DO_ROL(r) \
+    t = p & 0x01; SET_C(r & 0x80); r = (r << 1) | t; SET_NZ(r)
+#define DO_ROR(r) \
+    t = (p & 0x01) << 7; SET_C(r & 0x01); r = (r >> 1) | t; SET_NZ(r)
+#define DO_MODIFY \
+    WATCH(read_map, stop_read); WATCH(write_map, stop_write); v = RD(ea)
+#define DO_RMW(op) DO_MODIFY; op(v); WR(ea, v)
+#define DO_INC DO_MODIFY; v++; WR(ea, v); SET_NZ(v)
+#define DO_DEC DO_MODIFY; v--; WR(ea, v); SET_NZ(v)
+#define DO_BRANCH(cond) \
+    pc = (pc + 2) & 0xffff; c = 2; \
+    if (cond) { \
+        if (cached) { \
+            pc = d->operand; \
+            c = d->cycles; \
+        } else { \
+            ea = (pc + (signed char)(RD(pc - 1))) & 0xffff; \
+            c += 1 + ((ea >> 8) != (pc >> 8)); \
+            pc = ea; \
+        } \
+        IDLE_CHECK; \
+    }
+
+#define IDLE_CHECK \
+    if (checked && idle_mode && pc <= ipc) { \
+        if (pc == loop.pc && writes + io_count == loop.writes && \
+            a == loop.a && x == loop.x && y == loop.y && s == loop.s && \
+            p == loop.p) { \
+            if (idle_mode == idle_trap) { \
+                goto trapped; \
+            } \
+            ea = loop.count - count; \
+            k = (count - 1) / ea; \
+            count -= k * ea; \
+            cycles += k * (cycles - loop.cycles); \
+        } \
+        loop = {pc, count, cycles, writes + io_count, a, x, y, s, p}; \
+    }
+
+// code bytes for the trace; a device is never read more than the
+// instruction itself reads it
+#define PEEK(addr) \
+    (bus && !page_read[((addr) >> 8) & 0xff] ? char(0) : RD(addr))
+
+#define DISPATCH \
+    do { \
+        pc &= 0xffff; \
+        if (checked) { \
+            ipc = pc; \
+            if (!first && TEST_BIT(break_map, pc)) { \
+                stop = {stop_break, pc}; \
+                goto stopped; \
+            } \
+        } \
+        if (traced && trace) { \
+            trace->record(pc, PEEK(pc), PEEK(pc + 1), PEEK(pc + 2), a, x, \
+                          y, s, p, cycles); \
+        } \
+        if (!cached) { \
+            goto *table[RD(pc)]; \
+        } \
+        d = &decoded[pc]; \
+        if (d->gen != page_gen[pc >> 8]) { \
+            goto decode; \
+        } \
+        goto *d->handler; \
+    } while (0)
+
+// the first instruction of a fused pair, run alone as the last step of a
+// run
+#define FUSE(op) \
+    if (count < 2) { \
+        goto op_##op; \
+    }
+
+// ends the first instruction of a fused pair and goes on to the second,
+// decoded with it
+#define HALF \
+    cycles += c; \
+    count--; \
+    fused_count++; \
+    d = &decoded[pc]
+
+// ends k iterations of a loop len bytes long and n instructions to an
+// iteration, res cycles if every branch was taken; its counter is 0 when
+// the last one falls through
+#define LOOPED(len, n) \
+    c = 3; \
+    if (p & 0x02) { \
+        res--; \
+        c = 2; \
+        pc += len; \
+    } \
+    cycles += res - c; \
+    count -= (n) * k - 1; \
+    NEXT
+
+#define NEXT \
+    do { \
+        cycles += c; \
+        first = false; \
+        if (--count == 0) { \
+            goto leave; \
+        } \
+        DISPATCH; \
+    } while (0)
+
+// an instruction that may clear the interrupt disable flag hands a pending
+// interrupt back to the top of run_threaded()
+#define NEXT_IRQ \
+    do { \
+        if ((reset_flag || irq_flag) && !(p & 0x04)) { \
+            cycles += c; \
+            count--; \
+            goto leave; \
+        } \
+        NEXT; \
+    } while (0)
+
+int t_machine::exec_threaded(unsigned long count) {
+    return run_threaded<false, false, false, false>(count);
+}
+
+int t_machine::exec_cached(unsigned long count) {
+    return run_threaded<true, false, false, false>(count);
+}
+
+// a trace with no breakpoint, idle detection or mapped page, see
+// exec_checked()
+int t_machine::exec_traced(unsigned long count) {
+    return run_threaded<false, false, false, true>(count);
+}
+
+// returns 1 when stopped by a breakpoint, see exec_checked()
+int t_machine::exec_watched(unsigned long count) {
+    // only a device could map a page during the run, and there is none
+    // unless something is mapped already
+    if (bus_pages) {
+        return run_threaded<false, true, true, true>(count);
+    }
+    return run_threaded<false, true, false, true>(count);
+}
+
+// fills the cache entry for the instruction at pc, as the cached instance,
+// which never runs on the bus, reads it
+static void fill(t_decoded& d, const char* mem, t_addr pc,
+                 const void* handler, std::uint32_t gen) {
+    unsigned char op = mem[pc];
+    d.handler = handler;
+    d.gen = gen;
+    d.len = op_length[op];
+    d.cycles = op_cycles[op];
+    d.operand = mem[(pc + 1) & 0xffff];
+    if (d.len > 2) {
+        d.operand |= mem[(pc + 2) & 0xffff] << 8;
+    }
+    if ((op & 0x1f) == 0x10) {
+        // branches keep their target and the cycles when taken
+        auto next = (pc + 2) & 0xffff;
+        d.operand = (next + (signed char)(d.operand)) & 0xffff;
+        d.cycles = 3 + ((d.operand >> 8) != (next >> 8));
+    }
+}
+
+// the bytes of a loop in loops[]; 0 stands for an operand byte
+static bool matches(const char* mem, const unsigned char* code,
+                    unsigned len) {
+    for (unsigned i = 0; i < len; i++) {
+        if (code[i] && (unsigned char)(mem[i]) != code[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// whether a loop may store n bytes from addr at once
+static bool bulk_stores(const char* code_page, t_addr addr,
+                        unsigned long n) {
+    if (addr < 0x100 || addr + n > 0x10000) {
+        return false;
+    }
+    for (auto page = addr >> 8; page <= (addr + n - 1) >> 8; page++) {
+        if (code_page[page]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void mark_dirty(char* dirty, t_addr addr, unsigned long n) {
+    for (auto page = addr >> 8; page <= (addr + n - 1) >> 8; page++) {
+        dirty[page] = 1;
+    }
+}
+
+// copies as a loop of loads and stores going up does, so an overlap ahead
+// of the source repeats its first bytes
+static void bulk_copy(char* mem, t_addr from, t_addr to, unsigned long n) {
+    if (to <= from || to >= from + n) {
+        std::memmove(mem + to, mem + from, n);
+        return;
+    }
+    for (unsigned long i = 0; i < n; i++) {
+        mem[to + i] = mem[from + i];
+    }
+}
+
+template <bool cached, bool checked, bool bus, bool traced>
+int t_machine::run_threaded(unsigned long count) {
+    static const void* const table[0x100] = {
+        &&op_00, &&op_01, &&op_ill, &&op_ill, &&op_ill, &&op_05, &&op_06, &&op_ill,
+        &&op_08, &&op_09, &&op_0a, &&op_ill, &&op_ill, &&op_0d, &&op_0e, &&op_ill,
+        &&op_10, &&op_11, &&op_ill, &&op_ill, &&op_ill, &&op_15, &&op_16, &&op_ill,
+        &&op_18, &&op_19, &&op_ill, &&op_ill, &&op_ill, &&op_1d, &&op_1e, &&op_ill,
+        &&op_20, &&op_21, &&op_ill, &&op_ill, &&op_24, &&op_25, &&op_26, &&op_ill,
+        &&op_28, &&op_29, &&op_2a, &&op_ill, &&op_2c, &&op_2d, &&op_2e, &&op_ill,
+        &&op_30, &&op_31, &&op_ill, &&op_ill, &&op_ill, &&op_35, &&op_36, &&op_ill,
+        &&op_38, &&op_39, &&op_ill, &&op_ill, &&op_ill, &&op_3d, &&op_3e, &&op_ill,
+        &&op_40, &&op_41, &&op_ill, &&op_ill, &&op_ill, &&op_45, &&op_46, &&op_ill,
+        &&op_48, &&op_49, &&op_4a, &&op_ill, &&op_4c, &&op_4d, &&op_4e, &&op_ill,
+        &&op_50, &&op_51, &&op_ill, &&op_ill, &&op_ill, &&op_55, &&op_56, &&op_ill,
+        &&op_58, &&op_59, &&op_ill, &&op_ill, &&op_ill, &&op_5d, &&op_5e, &&op_ill,
+        &&op_60, &&op_61, &&op_ill, &&op_ill, &&op_ill, &&op_65, &&op_66, &&op_ill,
+        &&op_68, &&op_69, &&op_6a, &&op_ill, &&op_6c, &&op_6d, &&op_6e, &&op_ill,
+        &&op_70, &&op_71, &&op_ill, &&op_ill, &&op_ill, &&op_75, &&op_76, &&op_ill,
+        &&op_78, &&op_79, &&op_ill, &&op_ill, &&op_ill, &&op_7d, &&op_7e, &&op_ill,
+        &&op_ill, &&op_81, &&op_ill, &&op_ill, &&op_84, &&op_85, &&op_86, &&op_ill,
+        &&op_88, &&op_ill, &&op_8a, &&op_ill, &&op_8c, &&op_8d, &&op_8e, &&op_ill,
+        &&op_90, &&op_91, &&op_ill, &&op_ill, &&op_94, &&op_95, &&op_96, &&op_ill,
+        &&op_98, &&op_99, &&op_9a, &&op_ill, &&op_ill, &&op_9d, &&op_ill, &&op_ill,
+        &&op_a0, &&op_a1, &&op_a2, &&op_ill, &&op_a4, &&op_a5, &&op_a6, &&op_ill,
+        &&op_a8, &&op_a9, &&op_aa, &&op_ill, &&op_ac, &&op_ad, &&op_ae, &&op_ill,
+        &&op_b0, &&op_b1, &&op_ill, &&op_ill, &&op_b4, &&op_b5, &&op_b6, &&op_ill,
+        &&op_b8, &&op_b9, &&op_ba, &&op_ill, &&op_bc, &&op_bd, &&op_be, &&op_ill,
+        &&op_c0, &&op_c1, &&op_ill, &&op_ill, &&op_c4, &&op_c5, &&op_c6, &&op_ill,
+        &&op_c8, &&op_c9, &&op_ca, &&op_ill, &&op_cc, &&op_cd, &&op_ce, &&op_ill,
+        &&op_d0, &&op_d1, &&op_ill, &&op_ill, &&op_ill, &&op_d5, &&op_d6, &&op_ill,
+        &&op_d8, &&op_d9, &&op_ill, &&op_ill, &&op_ill, &&op_dd, &&op_de, &&op_ill,
+        &&op_e0, &&op_e1, &&op_ill, &&op_ill, &&op_e4, &&op_e5, &&op_e6, &&op_ill,
+        &&op_e8, &&op_e9, &&op_ea, &&op_ill, &&op_ec, &&op_ed, &&op_ee, &&op_ill,
+        &&op_f0, &&op_f1, &&op_ill, &&op_ill, &&op_ill, &&op_f5, &&op_f6, &&op_ill,
+        &&op_f8, &&op_f9, &&op_ill, &&op_ill, &&op_ill, &&op_fd, &&op_fe, &&op_ill,
+    };
+    // the two pairs that fire often enough in the functional test to pay
+    // for the lookup, see fusion_bench()
+    static const struct {
+        unsigned char first;
+        unsigned char second;
+        const void* handler;
+    } pairs[] = {
+        {0xc5, 0xd0, &&fu_c5_d0}, {0x68, 0x29, &&fu_68_29},
+    };
+    static const struct {
+        unsigned char len;
+        unsigned char code[7];
+        const void* handler;
+    } loops[] = {
+        // lda (src),y; sta (dst),y; iny; bne
+        {7, {0xb1, 0, 0x91, 0, 0xc8, 0xd0, 0xf9}, &&lp_copy},
+        // sta abs,x; dex; bne
+        {6, {0x9d, 0, 0, 0xca, 0xd0, 0xfa}, &&lp_fill_x},
+        // sta (dst),y; iny; bne
+        {5, {0x91, 0, 0xc8, 0xd0, 0xfb}, &&lp_fill_y},
+    };
+
+    auto mem = memory.data();
+    auto dirty = page_dirty.data();
+    t_decoded* d = nullptr;
+    t_addr pc;
+    t_addr ea;
+    t_addr to;
+    unsigned cross;
+    unsigned res;
+    unsigned c;
+    unsigned long start;
+    t_cycles cycles;
+    t_addr ipc = 0;
+    bool first = checked && this->pc == resume_pc;
+    unsigned long writes = 0;
+    struct {
+        t_addr pc;
+        unsigned long count;
+        t_cycles cycles;
+        unsigned long writes;
+        char a, x, y, s, p;
+    } loop{};
+    unsigned long k;
+    char a, x, y, s, p, v, t;
+
+    resume_pc = 0x10000;
+
+next_run:
+    loop.pc = 0x10000;
+    if (count == 0) {
+        return 0;
+    }
+    if (interrupt_pending()) {
+        if (checked && !first && watch_interrupt()) {
+            resume_pc = this->pc;
+            return 1;
+        }
+        process_interrupt();
+        step_count++;
+        count--;
+        first = false;
+        goto next_run;
+    }
+
+    pc = this->pc & 0xffff;
+    a = ra;
+    x = rx;
+    y = ry;
+    s = sp;
+    p = get_status();
+    c = cyc;
+    cycles = total_cycles;
+    start = count;
+    DISPATCH;
+
+decode:
+    // fill the cache entry for pc and run it
+    v = RD(pc);
+    fill(*d, mem, pc, table[v], page_gen[pc >> 8]);
+    code_page[pc >> 8] = 1;
+    code_page[((pc + d->len - 1) & 0xffff) >> 8] = 1;
+    if (fusion) {
+        for (auto& l : loops) {
+            if ((pc & 0xff) + l.len < 0x100 &&
+                matches(mem + pc, l.code, l.len)) {
+                d->handler = l.handler;
+                goto *d->handler;
+            }
+        }
+    }
+    // the second instruction of a pair, on the same page, goes stale with
+    // the first
+    ea = (pc + d->len) & 0xffff;
+    if (fusion && ea >> 8 == pc >> 8) {
+        t = RD(ea);
+        for (auto& f : pairs) {
+            if (f.first != v || f.second != t) {
+                continue;
+            }
+            auto e = &decoded[ea];
+            if (e->gen != d->gen) {
+                fill(*e, mem, ea, table[t], d->gen);
+            }
+            code_page[((ea + e->len - 1) & 0xffff) >> 8] = 1;
+            d->handler = f.handler;
+            break;
+        }
+    }
+    goto *d->handler;
+
+op_29: R_IMM; DO_AND; c = 2; NEXT;
+op_25: R(ZPG); DO_AND; c = 3; NEXT;
+op_35: R(ZPX); DO_AND; c = 4; NEXT;
+op_2d: R(ABS); DO_AND; c = 4; NEXT;
+op_3d: R(ABX); DO_AND; c = 4 + cross; NEXT;
+op_39: R(ABY); DO_AND; c = 4 + cross; NEXT;
+op_21: R(INX); DO_AND; c = 6; NEXT;
+op_31: R(INY); DO_AND; c = 5 + cross; NEXT;
+
+op_49: R_IMM; DO_EOR; c = 2; NEXT;
+op_45: R(ZPG); DO_EOR; c = 3; NEXT;
+op_55: R(ZPX); DO_EOR; c = 4; NEXT;
+op_4d: R(ABS); DO_EOR; c = 4; NEXT;
+op_5d: R(ABX); DO_EOR; c = 4 + cross; NEXT;
+op_59: R(ABY); DO_EOR; c = 4 + cross; NEXT;
+op_41: R(INX); DO_EOR; c = 6; NEXT;
+op_51: R(INY); DO_EOR; c = 5 + cross; NEXT;
+
+op_09: R_IMM; DO_ORA; c = 2; NEXT;
+op_05: R(ZPG); DO_ORA; c = 3; NEXT;
+op_15: R(ZPX); DO_ORA; c = 4; NEXT;
+op_0d: R(ABS); DO_ORA; c = 4; NEXT;
+op_1d: R(ABX); DO_ORA; c = 4 + cross; NEXT;
+op_19: R(ABY); DO_ORA; c = 4 + cross; NEXT;
+op_01: R(INX); DO_ORA; c = 6; NEXT;
+op_11: R(INY); DO_ORA; c = 5 + cross; NEXT;
+
+op_24: R(ZPG); DO_BIT; c = 3; NEXT;
+op_2c: R(ABS); DO_BIT; c = 4; NEXT;
+
+op_a9: R_IMM; DO_LD(a); c = 2; NEXT;
+op_a5: R(ZPG); DO_LD(a); c = 3; NEXT;
+op_b5: R(ZPX); DO_LD(a); c = 4; NEXT;
+op_ad: R(ABS); DO_LD(a); c = 4; NEXT;
+op_bd: R(ABX); DO_LD(a); c = 4 + cross; NEXT;
+op_b9: R(ABY); DO_LD(a); c = 4 + cross; NEXT;
+op_a1: R(INX); DO_LD(a); c = 6; NEXT;
+op_b1: R(INY); DO_LD(a); c = 5 + cross; NEXT;
+
+op_a2: R_IMM; DO_LD(x); c = 2; NEXT;
+op_a6: R(ZPG); DO_LD(x); c = 3; NEXT;
+op_b6: R(ZPY); DO_LD(x); c = 4; NEXT;
+op_ae: R(ABS); DO_LD(x); c = 4; NEXT;
+op_be: R(ABY); DO_LD(x); c = 4 + cross; NEXT;
+
+op_a0: R_IMM; DO_LD(y); c = 2; NEXT;
+op_a4: R(ZPG); DO_LD(y); c = 3; NEXT;
+op_b4: R(ZPX); DO_LD(y); c = 4; NEXT;
+op_ac: R(ABS); DO_LD(y); c = 4; NEXT;
+op_bc: R(ABX); DO_LD(y); c = 4 + cross; NEXT;
+
+op_85: M_ZPG; ST(a); c = 3; NEXT;
+op_95: M_ZPX; ST(a); c = 4; NEXT;
+op_8d: M_ABS; ST(a); c = 4; NEXT;
+op_9d: M_ABX; ST(a); c = 5; NEXT;
+op_99: M_ABY; ST(a); c = 5; NEXT;
+op_81: M_INX; ST(a); c = 6; NEXT;
+op_91: M_INY; ST(a); c = 6; NEXT;
+
+op_86: M_ZPG; ST(x); c = 3; NEXT;
+op_96: M_ZPY; ST(x); c = 4; NEXT;
+op_8e: M_ABS; ST(x); c = 4; NEXT;
+
+op_84: M_ZPG; ST(y); c = 3; NEXT;
+op_94: M_ZPX; ST(y); c = 4; NEXT;
+op_8c: M_ABS; ST(y); c = 4; NEXT;
+
+op_aa: pc++; x = a; SET_NZ(x); c = 2; NEXT;
+op_a8: pc++; y = a; SET_NZ(y); c = 2; NEXT;
+op_8a: pc++; a = x; SET_NZ(a); c = 2; NEXT;
+op_98: pc++; a = y; SET_NZ(a); c = 2; NEXT;
+
+op_e6: M_ZPG; DO_INC; c = 5; NEXT;
+op_f6: M_ZPX; DO_INC; c = 6; NEXT;
+op_ee: M_ABS; DO_INC; c = 6; NEXT;
+op_fe: M_ABX; DO_INC; c = 7; NEXT;
+op_e8: pc++; x++; SET_NZ(x); c = 2; NEXT;
+op_c8: pc++; y++; SET_NZ(y); c = 2; NEXT;
+
+op_c6: M_ZPG; DO_DEC; c = 5; NEXT;
+op_d6: M_ZPX; DO_DEC; c = 6; NEXT;
+op_ce: M_ABS; DO_DEC; c = 6; NEXT;
+op_de: M_ABX; DO_DEC; c = 7; NEXT;
+op_ca: pc++; x--; SET_NZ(x); c = 2; NEXT;
+op_88: pc++; y--; SET_NZ(y); c = 2; NEXT;
+
+op_0a: pc++; DO_ASL(a); c = 2; NEXT;
+op_06: M_ZPG; DO_RMW(DO_ASL); c = 5; NEXT;
+op_16: M_ZPX; DO_RMW(DO_ASL); c = 6; NEXT;
+op_0e: M_ABS; DO_RMW(DO_ASL); c = 6; NEXT;
+op_1e: M_ABX; DO_RMW(DO_ASL); c = 7; NEXT;
+
+op_4a: pc++; DO_LSR(a); c = 2; NEXT;
+op_46: M_ZPG; DO_RMW(DO_LSR); c = 5; NEXT;
+op_56: M_ZPX; DO_RMW(DO_LSR); c = 6; NEXT;
+op_4e: M_ABS; DO_RMW(DO_LSR); c = 6; NEXT;
+op_5e: M_ABX; DO_RMW(DO_LSR); c = 7; NEXT;
+
+op_2a: pc++; DO_ROL(a); c = 2; NEXT;
+op_26: M_ZPG; DO_RMW(DO_ROL); c = 5; NEXT;
+op_36: M_ZPX; DO_RMW(DO_ROL); c = 6; NEXT;
+op_2e: M_ABS; DO_RMW(DO_ROL); c = 6; NEXT;
+op_3e: M_ABX; DO_RMW(DO_ROL); c = 7; NEXT;
+
+op_6a: pc++; DO_ROR(a); c = 2; NEXT;
+op_66: M_ZPG; DO_RMW(DO_ROR); c = 5; NEXT;
+op_76: M_ZPX; DO_RMW(DO_ROR); c = 6; NEXT;
+op_6e: M_ABS; DO_RMW(DO_ROR); c = 6; NEXT;
+op_7e: M_ABX; DO_RMW(DO_ROR); c = 7; NEXT;
+
+op_ba: pc++; x = s; SET_NZ(x); c = 2; NEXT;
+op_9a: pc++; s = x; c = 2; NEXT;
+op_48: WATCH_PUSH(1); pc++; PUSH(a); c = 3; NEXT;
+op_08: WATCH_PUSH(1); pc++; PUSH(p | 0x30); c = 3; NEXT;
+op_68: WATCH_PULL(1); pc++; PULL(a); SET_NZ(a); c = 4; NEXT;
+op_28: WATCH_PULL(1); pc++; PULL(p); c = 4; NEXT_IRQ;
+
+op_4c: pc = OP16; c = 3; IDLE_CHECK; NEXT;
+op_6c: M_ABS; WATCH_PTR(ea, (ea + 1) & 0xffff); pc = RD2(ea); c = 5; NEXT;
+op_20:
+    WATCH_PUSH(2);
+    M_ABS;
+    pc--;
+    PUSH(char(pc >> 8));
+    PUSH(char(pc));
+    pc = ea;
+    c = 6;
+    NEXT;
+op_60:
+    WATCH_PULL(2);
+    PULL(v);
+    PULL(t);
+    pc = (t_addr(t) << 8 | v) + 1;
+    c = 6;
+    NEXT;
+
+op_90: DO_BRANCH(!(p & 0x01)); NEXT;
+op_b0: DO_BRANCH(p & 0x01); NEXT;
+op_f0: DO_BRANCH(p & 0x02); NEXT;
+op_30: DO_BRANCH(p & 0x80); NEXT;
+op_d0: DO_BRANCH(!(p & 0x02)); NEXT;
+op_10: DO_BRANCH(!(p & 0x80)); NEXT;
+op_50: DO_BRANCH(!(p & 0x40)); NEXT;
+op_70: DO_BRANCH(p & 0x40); NEXT;
+
+op_18: pc++; p &= 0xfe; c = 2; NEXT;
+op_d8: pc++; p &= 0xf7; c = 2; NEXT;
+op_58: pc++; p &= 0xfb; c = 2; NEXT_IRQ;
+op_b8: pc++; p &= 0xbf; c = 2; NEXT;
+op_38: pc++; p |= 0x01; c = 2; NEXT;
+op_f8: pc++; p |= 0x08; c = 2; NEXT;
+op_78: pc++; p |= 0x04; c = 2; NEXT;
+
+op_69: R_IMM; DO_ADC; c = 2; NEXT;
+op_65: R(ZPG); DO_ADC; c = 3; NEXT;
+op_75: R(ZPX); DO_ADC; c = 4; NEXT;
+op_6d: R(ABS); DO_ADC; c = 4; NEXT;
+op_7d: R(ABX); DO_ADC; c = 4 + cross; NEXT;
+op_79: R(ABY); DO_ADC; c = 4 + cross; NEXT;
+op_61: R(INX); DO_ADC; c = 6; NEXT;
+op_71: R(INY); DO_ADC; c = 5 + cross; NEXT;
+
+op_e9: R_IMM; DO_SBC; c = 2; NEXT;
+op_e5: R(ZPG); DO_SBC; c = 3; NEXT;
+op_f5: R(ZPX); DO_SBC; c = 4; NEXT;
+op_ed: R(ABS); DO_SBC; c = 4; NEXT;
+op_fd: R(ABX); DO_SBC; c = 4 + cross; NEXT;
+op_f9: R(ABY); DO_SBC; c = 4 + cross; NEXT;
+op_e1: R(INX); DO_SBC; c = 6; NEXT;
+op_f1: R(INY); DO_SBC; c = 5 + cross; NEXT;
+
+op_c9: R_IMM; DO_CMP(a); c = 2; NEXT;
+op_c5: R(ZPG); DO_CMP(a); c = 3; NEXT;
+op_d5: R(ZPX); DO_CMP(a); c = 4; NEXT;
+op_cd: R(ABS); DO_CMP(a); c = 4; NEXT;
+op_dd: R(ABX); DO_CMP(a); c = 4 + cross; NEXT;
+op_d9: R(ABY); DO_CMP(a); c = 4 + cross; NEXT;
+op_c1: R(INX); DO_CMP(a); c = 6; NEXT;
+op_d1: R(INY); DO_CMP(a); c = 5 + cross; NEXT;
+
+op_e0: R_IMM; DO_CMP(x); c = 2; NEXT;
+op_e4: R(ZPG); DO_CMP(x); c = 3; NEXT;
+op_ec: R(ABS); DO_CMP(x); c = 4; NEXT;
+
+op_c0: R_IMM; DO_CMP(y); c = 2; NEXT;
+op_c4: R(ZPG); DO_CMP(y); c = 3; NEXT;
+op_cc: R(ABS); DO_CMP(y); c = 4; NEXT;
+
+op_ea: pc++; c = 2; NEXT;
+op_00:
+    WATCH_PUSH(3);
+    WATCH_PTR(0xfffe, 0xffff);
+    pc += 2;
+    PUSH(char(pc >> 8));
+    PUSH(char(pc));
+    PUSH(p | 0x30);
+    pc = RD2(0xfffe);
+    p |= 0x14;
+    c = 7;
+    NEXT;
+op_40:
+    WATCH_PULL(3);
+    pc++;
+    PULL(p);
+    PULL(v);
+    PULL(t);
+    pc = t_addr(t) << 8 | v;
+    c = 6;
+    NEXT_IRQ;
+
+fu_c5_d0: FUSE(c5); R(ZPG); DO_CMP(a); c = 3; HALF; DO_BRANCH(v); NEXT;
+// the and sets n and z over those of the pla
+fu_68_29: FUSE(68); pc++; PULL(a); c = 4; HALF; R_IMM; DO_AND; c = 2; NEXT;
+
+// copy and fill loops, k iterations at once
+lp_copy:
+    ea = RD(d->operand) | t_addr(RD(char(d->operand + 1))) << 8;
+    cross = (ea & 0xff) + y;
+    ea += y;
+    v = RD(pc + 3);
+    to = (RD(v) | t_addr(RD(char(v + 1))) << 8) + y;
+    k = std::min<unsigned long>(0x100 - y, count / 4);
+    if (!k || ea + k > 0x10000 || !bulk_stores(code_page.data(), to, k)) {
+        goto op_b1;
+    }
+    bulk_copy(mem, ea, to, k);
+    mark_dirty(dirty, to, k);
+    a = mem[ea + k - 1];
+    // the loads cross a page from iteration cross on
+    cross = cross < 0x100 ? 0x100 - cross : 0;
+    res = 16 * k + (k > cross ? k - cross : 0);
+    y += k;
+    SET_NZ(y);
+    LOOPED(7, 4);
+lp_fill_x:
+    // from x = 0 the first store goes to the top of the range
+    k = std::min<unsigned long>(x, count / 3);
+    to = d->operand + x + 1 - k;
+    if (!k || !bulk_stores(code_page.data(), to, k)) {
+        goto op_9d;
+    }
+    std::memset(mem + to, a, k);
+    mark_dirty(dirty, to, k);
+    res = 10 * k;
+    x -= k;
+    SET_NZ(x);
+    LOOPED(6, 3);
+lp_fill_y:
+    to = (RD(d->operand) | t_addr(RD(char(d->operand + 1))) << 8) + y;
+    k = std::min<unsigned long>(0x100 - y, count / 3);
+    if (!k || !bulk_stores(code_page.data(), to, k)) {
+        goto op_91;
+    }
+    std::memset(mem + to, a, k);
+    mark_dirty(dirty, to, k);
+    res = 11 * k;
+    y += k;
+    SET_NZ(y);
+    LOOPED(5, 3);
+
+op_ill:
+    pc++;
+    this->pc = pc;
+    ra = a;
+    rx = x;
+    ry = y;
+    sp = s;
+    set_status(p);
+    cyc = c;
+    total_cycles = cycles;
+    step_count += start - count;
+    return -1;
+
+stopped:
+    // before the instruction at ipc
+    this->pc = ipc;
+    resume_pc = ipc;
+    ra = a;
+    rx = x;
+    ry = y;
+    sp = s;
+    set_status(p);
+    cyc = c;
+    total_cycles = cycles;
+    step_count += start - count;
+    return 1;
+
+trapped:
+    // after the jump back to the loop
+    cycles += c;
+    count--;
+    this->pc = pc;
+    ra = a;
+    rx = x;
+    ry = y;
+    sp = s;
+    set_status(p);
+    cyc = c;
+    total_cycles = cycles;
+    step_count += start - count;
+    stop = {stop_trap, pc};
+    return 1;
+
+leave:
+    this->pc = pc;
+    ra = a;
+    rx = x;
+    ry = y;
+    sp = s;
+    set_status(p);
+    cyc = c;
+    total_cycles = cycles;
+    step_count += start - count;
+    goto next_run;
+}
@@ -0,0 +1,291 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "machine.hpp"
+#include "recomp.hpp"
+
+// the functional test translated by the makefile, see tools/recompile.cpp
+extern const t_recompiled func_test_rc;
+
+// a timed run of a workload
+struct t_sample {
+    unsigned long steps;
+    t_cycles cycles;
+    double sec;
+};
+
+// Sets the machine up, then times the run; false if it did not end as it
+// should.
+typedef bool (*t_workload)(t_machine&, t_sample&);
+
+static double now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// loads prog at 0x200 and the zero page bytes at 0
+static void load(t_machine& m, const std::vector<char>& prog,
+                 const std::vector<char>& zero_page) {
+    m.init();
+    m.load_program(zero_page, 0);
+    m.load_program(prog, 0x200);
+    m.set_program_counter(0x200);
+}
+
+// times exec(steps) from where the machine stands
+static bool time_exec(t_machine& m, unsigned long steps, t_sample& s) {
+    auto steps0 = m.get_step_counter();
+    auto cycles0 = m.get_cycle_counter();
+    auto start = now();
+    auto ret = m.exec(steps);
+    s.sec = now() - start;
+    s.steps = m.get_step_counter() - steps0;
+    s.cycles = m.get_cycle_counter() - cycles0;
+    return ret == 0;
+}
+
+// The functional test, a little past the 26986179 steps to its success
+// address, where it loops. A breakpoint there would take every core to the
+// checked threaded one.
+static bool func_test(t_machine& m, t_sample& s) {
+    m.init();
+    if (m.load_program_from_file("func_test_no_dec.bin", 0x0000) < 0) {
+        return false;
+    }
+    m.set_program_counter(0x0400);
+    return time_exec(m, 27000000, s) && m.get_program_counter() == 0x3469;
+}
+
+// arithmetic and logic on the registers and the zero page
+static bool alu(t_machine& m, t_sample& s) {
+    std::vector<char> prog = {
+        0x18, 0x69, 0x07, // clc, adc #$07
+        0x45, 0x10, 0x0a, // eor $10, asl a
+        0x29, 0x7e, 0x09, 0x21, // and #$7e, ora #$21
+        0x66, 0x10, 0x38, 0xe5, 0x11, // ror $10, sec, sbc $11
+        0xaa, 0xc8, 0xd0, 0xed, // tax, iny, bne $0200
+        0xe6, 0x11, 0x4c, 0x00, 0x02 // inc $11, jmp $0200
+    };
+    load(m, prog, std::vector<char>(0x20, 0x35));
+    return time_exec(m, 20000000, s);
+}
+
+// copies 12K a page at a time through indirect pointers, over and over
+static bool copy(t_machine& m, t_sample& s) {
+    std::vector<char> prog = {
+        0xa9, 0x10, 0x85, 0x21, // lda #$10, sta $21
+        0xa9, 0x40, 0x85, 0x23, // lda #$40, sta $23
+        0xb1, 0x20, 0x91, 0x22, // lda ($20),y, sta ($22),y
+        0xc8, 0xd0, 0xf9, // iny, bne $0208
+        0xe6, 0x21, 0xe6, 0x23, // inc $21, inc $23
+        0xa5, 0x23, 0xc9, 0x70, // lda $23, cmp #$70
+        0xd0, 0xef, 0x4c, 0x00, 0x02 // bne $0208, jmp $0200
+    };
+    std::vector<char> zero_page(0x24, 0);
+    zero_page[0x21] = 0x10;
+    zero_page[0x23] = 0x40;
+    load(m, prog, zero_page);
+    return time_exec(m, 20000000, s);
+}
+
+// branches on the bits of a linear feedback shift register
+static bool branches(t_machine& m, t_sample& s) {
+    std::vector<char> prog = {
+        0xa5, 0x10, 0x0a, // lda $10, asl a
+        0x90, 0x02, 0x49, 0x1d, // bcc $0207, eor #$1d
+        0x85, 0x10, 0x30, 0x03, // sta $10, bmi $020e
+        0xe8, 0x10, 0x01, // inx, bpl $020f
+        0xc8, 0x4a, 0xb0, 0x02, // iny, lsr a, bcs $0214
+        0xe6, 0x11, 0x4c, 0x00, 0x02 // inc $11, jmp $0200
+    };
+    load(m, prog, std::vector<char>(0x20, 0x01));
+    return time_exec(m, 20000000, s);
+}
+
+// a brk every third instruction, its handler counting it and returning
+static bool interrupts(t_machine& m, t_sample& s) {
+    std::vector<char> prog = {
+        0x00, 0xea, 0xe8, 0x4c, 0x00, 0x02 // brk, inx, jmp $0200
+    };
+    std::vector<char> handler = {0xe6, 0x10, 0x40}; // inc $10, rti
+    load(m, prog, std::vector<char>(0x20, 0));
+    m.load_program(handler, 0x300);
+    m.load_program({0x00, 0x03}, 0xfffe);
+    m.set_program_counter(0x200);
+    return time_exec(m, 20000000, s);
+}
+
+// raises an irq every 20000 cycles, a frame at 1 MHz
+struct t_timer {
+    t_cycles at;
+
+    void operator()(t_machine& m) const {
+        m.raise_irq();
+        m.schedule(at + 20000, t_timer{at + 20000});
+    }
+};
+
+// the alu loop under a timer interrupt, its handler counting the ticks
+static bool timer(t_machine& m, t_sample& s) {
+    std::vector<char> prog = {
+        0x58, 0x18, 0x69, 0x07, // cli, clc, adc #$07
+        0x45, 0x10, 0x0a, // eor $10, asl a
+        0x29, 0x7e, 0x09, 0x21, // and #$7e, ora #$21
+        0x66, 0x10, 0x38, 0xe5, 0x11, // ror $10, sec, sbc $11
+        0xaa, 0xc8, 0xd0, 0xed, // tax, iny, bne $0201
+        0xe6, 0x11, 0x4c, 0x01, 0x02 // inc $11, jmp $0201
+    };
+    std::vector<char> handler = {0xe6, 0x12, 0x40}; // inc $12, rti
+    load(m, prog, std::vector<char>(0x20, 0x35));
+    m.load_program(handler, 0x300);
+    m.load_program({0x00, 0x03}, 0xfffe);
+    m.set_program_counter(0x200);
+    m.schedule(20000, t_timer{20000});
+    return time_exec(m, 20000000, s);
+}
+
+// a test sized program run from a reset each time, as tst() runs them
+static bool resets(t_machine& m, t_sample& s) {
+    std::vector<char> prog = {0xa9, 0x25, 0x29, 0x36, 0x85, 0x99};
+    const unsigned long count = 1000000;
+    load(m, prog, {});
+    m.set_baseline();
+    s.steps = 0;
+    s.cycles = 0;
+    auto start = now();
+    // the counters go back to 0 with each reset
+    for (unsigned long i = 0; i < count; i++) {
+        m.reset_to_baseline();
+        m.exec(3);
+        s.steps += m.get_step_counter();
+        s.cycles += m.get_cycle_counter();
+    }
+    s.sec = now() - start;
+    return m.read_memory(0x99) == 0x24;
+}
+
+struct t_stats {
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+static t_stats stats(const std::vector<double>& v) {
+    t_stats t = {0, 0, v[0], v[0]};
+    for (auto x : v) {
+        t.mean += x;
+        t.min = std::min(t.min, x);
+        t.max = std::max(t.max, x);
+    }
+    t.mean /= v.size();
+    for (auto x : v) {
+        t.stddev += (x - t.mean) * (x - t.mean);
+    }
+    if (v.size() > 1) {
+        t.stddev = std::sqrt(t.stddev / (v.size() - 1));
+    }
+    return t;
+}
+
+static std::string json(const t_stats& t) {
+    char text[128];
+    std::snprintf(text, sizeof(text),
+                  "{\"mean\": %.6g, \"stddev\": %.6g, \"min\": %.6g, "
+                  "\"max\": %.6g}",
+                  t.mean, t.stddev, t.min, t.max);
+    return text;
+}
+
+// Runs every workload on every core, warmup times and then repeats times
+// more, and prints instructions and cycles per second and nanoseconds per
+// instruction with their spread. The results go to the json file too.
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 4) {
+        std::cerr << "usage : benchsuite <json file> [repeats] [warmup]\n";
+        return 2;
+    }
+    int repeats = argc > 2 ? std::atoi(argv[2]) : 5;
+    int warmup = argc > 3 ? std::atoi(argv[3]) : 1;
+    if (repeats < 1 || warmup < 0) {
+        std::cerr << "bad repeats or warmup\n";
+        return 2;
+    }
+    const struct {
+        const char* name;
+        t_workload run;
+    } workloads[] = {
+        {"func_test", func_test}, {"alu", alu}, {"copy", copy},
+        {"branches", branches}, {"interrupts", interrupts},
+        {"timer", timer}, {"resets", resets}
+    };
+    const struct {
+        const char* name;
+        t_core core;
+    } cores[] = {
+        {"switch", core_switch}, {"threaded", core_threaded},
+        {"cached", core_cached}, {"jit", core_jit},
+        {"recompiled", core_recompiled}
+    };
+    // only the functional test was translated; the other workloads run
+    // the switch core under core_recompiled
+    std::unique_ptr<t_machine> m(new t_machine);
+    m->set_recompiled(&func_test_rc);
+    std::string results;
+    char line[128];
+    std::printf("%-10s  %-10s  %9s  %8s  %9s  %9s  %6s\n", "workload", "core",
+                "mips", "+-", "mcps", "ns/step", "+-");
+    for (auto& w : workloads) {
+        for (auto& c : cores) {
+            m->set_core(c.core);
+            std::vector<double> ips, cps, ns;
+            t_sample s = {};
+            for (int i = -warmup; i < repeats; i++) {
+                if (!w.run(*m, s)) {
+                    std::cerr << "workload fail : " << w.name << " on "
+                              << c.name << "\n";
+                    return 1;
+                }
+                if (i >= 0) {
+                    ips.push_back(s.steps / s.sec);
+                    cps.push_back(s.cycles / s.sec);
+                    ns.push_back(s.sec * 1e9 / s.steps);
+                }
+            }
+            auto i = stats(ips);
+            auto n = stats(ns);
+            auto cy = stats(cps);
+            std::printf("%-10s  %-10s  %9.2f  %7.2f%%  %9.2f  %9.3f  %5.2f%%\n",
+                        w.name, c.name, i.mean / 1e6,
+                        100 * i.stddev / i.mean, cy.mean / 1e6, n.mean,
+                        100 * n.stddev / n.mean);
+            std::fflush(stdout);
+            std::snprintf(line, sizeof(line),
+                          "    {\"workload\": \"%s\", \"core\": \"%s\", "
+                          "\"steps\": %lu, \"cycles\": %llu,\n",
+                          w.name, c.name, s.steps,
+                          (unsigned long long)(s.cycles));
+            results += results.empty() ? "" : ",\n";
+            results += line;
+            results += "     \"ips\": " + json(i) + ",\n";
+            results += "     \"cps\": " + json(cy) + ",\n";
+            results += "     \"ns_per_step\": " + json(n) + "}";
+        }
+    }
+    std::ofstream out(argv[1]);
+    out << "{\n  \"repeats\": " << repeats << ", \"warmup\": " << warmup
+        << ",\n  \"results\": [\n" << results << "\n  ]\n}\n";
+    if (!out.good()) {
+        std::cerr << "cannot write : " << argv[1] << "\n";
+        return 1;
+    }
+    return 0;
+}
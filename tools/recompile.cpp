@@ -0,0 +1,646 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "opcodes.hpp"
+#include "recomp.hpp"
+
+// the binary image and where it is loaded
+struct t_image {
+    std::vector<char> bytes;
+    std::uint32_t load;
+
+    bool has(std::uint32_t addr, unsigned n) const {
+        return addr >= load && addr + n <= load + bytes.size() &&
+               addr + n <= 0x10000;
+    }
+
+    unsigned char at(std::uint32_t addr) const {
+        return bytes[addr - load];
+    }
+
+    unsigned word(std::uint32_t addr) const {
+        return at(addr) | at(addr + 1) << 8;
+    }
+};
+
+static bool is_branch(t_op op) {
+    return op >= op_bcc && op <= op_bvs;
+}
+
+// Instructions after which control goes elsewhere, or may have to: cli,
+// plp and rti can let a waiting interrupt in.
+static bool ends_block(t_op op) {
+    return is_branch(op) || op == op_jmp || op == op_jsr || op == op_rts ||
+           op == op_rti || op == op_brk || op == op_cli || op == op_plp;
+}
+
+// reads that take a cycle more when indexing crosses a page
+static bool read_penalty(t_op op) {
+    switch (op) {
+    case op_lda: case op_ldx: case op_ldy: case op_and: case op_eor:
+    case op_ora: case op_adc: case op_sbc: case op_cmp:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static std::string hex(unsigned v, int digits) {
+    char text[16];
+    std::snprintf(text, sizeof(text), "0x%0*x", digits, v);
+    return text;
+}
+
+// Recursive descent from the entry points: every address control can
+// reach through branches, jumps, calls and the returns after them, brk and
+// the interrupt vectors, and the targets jmp ($xxxx) pointers hold in the
+// image. Code reached only through a pointer changed at run time, an rts
+// to a pushed address or a store is left to the interpreter.
+class t_disassembly {
+    const t_image& image;
+    std::vector<std::uint32_t> work;
+
+    void add(std::uint32_t addr) {
+        addr &= 0xffff;
+        if (image.has(addr, 1) && leaders.insert(addr).second) {
+            work.push_back(addr);
+        }
+    }
+
+    void walk(std::uint32_t addr) {
+        while (image.has(addr, 1) && !decoded[addr]) {
+            auto opcode = image.at(addr);
+            auto in = decode(opcode);
+            auto len = op_length[opcode];
+            if (in.op == op_none || !image.has(addr, len)) {
+                return;
+            }
+            decoded[addr] = 1;
+            auto next = addr + len;
+            if (is_branch(in.op)) {
+                add(next + (signed char)(image.at(addr + 1)));
+                add(next);
+                return;
+            }
+            switch (in.op) {
+            case op_jmp:
+                if (in.mode == mode_abs) {
+                    add(image.word(addr + 1));
+                } else if (image.has(image.word(addr + 1), 2)) {
+                    // where the pointer goes in the image, likely still
+                    // when the jump runs; dispatch checks at run time
+                    add(image.word(image.word(addr + 1)));
+                }
+                return;
+            case op_jsr:
+                add(image.word(addr + 1));
+                add(next);
+                return;
+            case op_brk:
+                // rti returns past its padding byte
+                if (image.has(0xfffe, 2)) {
+                    add(image.word(0xfffe));
+                }
+                add(addr + 2);
+                return;
+            case op_rts:
+            case op_rti:
+                return;
+            case op_cli:
+            case op_plp:
+                add(next);
+                return;
+            default:
+                addr = next;
+            }
+        }
+    }
+
+public:
+    std::set<std::uint32_t> leaders;
+    std::vector<char> decoded; // instruction starts
+
+    t_disassembly(const t_image& i, const std::vector<std::uint32_t>& entries)
+        : image(i), decoded(0x10000) {
+        for (auto e : entries) {
+            add(e);
+        }
+        for (std::uint32_t vector = 0xfffa; vector < 0x10000; vector += 2) {
+            if (image.has(vector, 2)) {
+                add(image.word(vector));
+            }
+        }
+        while (!work.empty()) {
+            auto addr = work.back();
+            work.pop_back();
+            walk(addr);
+        }
+    }
+};
+
+// a basic block: its instructions from start, and where it ends
+struct t_block {
+    std::uint32_t start;
+    std::uint32_t end;
+    std::vector<std::uint32_t> code;
+};
+
+static std::vector<t_block> find_blocks(const t_image& image,
+                                        const t_disassembly& d) {
+    std::vector<t_block> blocks;
+    for (auto start : d.leaders) {
+        if (!d.decoded[start]) {
+            continue;
+        }
+        t_block b{start, start, {}};
+        auto addr = start;
+        while (true) {
+            auto opcode = image.at(addr);
+            b.code.push_back(addr);
+            addr += op_length[opcode];
+            if (ends_block(decode(opcode).op) || addr >= 0x10000 ||
+                d.leaders.count(addr) || !d.decoded[addr]) {
+                break;
+            }
+        }
+        b.end = addr;
+        blocks.push_back(b);
+    }
+    return blocks;
+}
+
+// Writes C++ for the blocks: one function, a label a block, running on the
+// registers in locals. A block starts by taking its instructions from the
+// budget and its base cycles; control between blocks known here is a goto,
+// anywhere else goes through the switch at dispatch.
+class t_emitter {
+    const t_image& image;
+    const std::vector<t_block>& blocks;
+    std::map<std::uint32_t, std::size_t> index;
+    std::ostream& os;
+
+    // the instructions after the current one, and their base cycles
+    unsigned left;
+    unsigned cycles_left;
+    std::uint32_t next;
+
+    std::string go(std::uint32_t target) {
+        target &= 0xffff;
+        auto it = index.find(target);
+        if (it != index.end()) {
+            return "goto b" + std::to_string(it->second) + ";";
+        }
+        return "pc = " + hex(target, 4) + "; goto out;";
+    }
+
+    void line(const std::string& text) {
+        os << "    " << text << "\n";
+    }
+
+    // Stores value at addr; an instruction storing to live code ends the
+    // run once it is done.
+    void store(const std::string& addr, const std::string& value) {
+        line("m[" + addr + "] = " + value + ";");
+        line("dirty[(" + addr + ") >> 8] = 1;");
+        line("if (code_map[" + addr + "]) written[writes++] = " + addr +
+             ";");
+    }
+
+    void push(const std::string& value) {
+        line("t = 0x100 + sp--;");
+        store("t", value);
+    }
+
+    void pull(const std::string& into) {
+        line("sp++;");
+        line(into + " = m[0x100 + sp];");
+    }
+
+    void end_after_store() {
+        line("if (writes) {");
+        line("    pc = " + hex(next, 4) + ";");
+        if (left) {
+            line("    budget += " + std::to_string(left) + ";");
+            line("    cycles -= " + std::to_string(cycles_left) + ";");
+        }
+        line("    goto out;");
+        line("}");
+    }
+
+    void set_status(const std::string& value) {
+        line("rp = " + value + ";");
+        line("carry = rp & 1;");
+        line("zres = ~rp & 2;");
+        line("overflow = rp & 0x40;");
+        line("nres = rp;");
+    }
+
+    void flags(const std::string& reg) {
+        line("zres = nres = " + reg + ";");
+    }
+
+    std::string status() {
+        return "recomp_status(rp, carry, zres, overflow, nres)";
+    }
+
+    // the effective address into t, unless a constant, which it returns
+    std::string address(t_op op, t_mode mode, std::uint32_t at) {
+        unsigned zp = image.at(at + 1);
+        unsigned abs = image.has(at + 1, 2) ? image.word(at + 1) : 0;
+        auto penalty = read_penalty(op);
+        switch (mode) {
+        case mode_zpg:
+            return hex(zp, 2);
+        case mode_zpx:
+        case mode_zpy:
+            line("t = (" + hex(zp, 2) + " + " +
+                 (mode == mode_zpx ? "rx" : "ry") + ") & 0xff;");
+            return "t";
+        case mode_abs:
+            return hex(abs, 4);
+        case mode_abx:
+        case mode_aby: {
+            std::string reg = mode == mode_abx ? "rx" : "ry";
+            if (penalty) {
+                line("cycles += (" + hex(abs & 0xff, 2) + " + " + reg +
+                     ") >> 8;");
+            }
+            line("t = (" + hex(abs, 4) + " + " + reg + ") & 0xffff;");
+            return "t";
+        }
+        case mode_inx:
+            // the pointer may run past the zero page, as read_mem_2() reads
+            line("v = " + hex(zp, 2) + " + rx;");
+            line("t = m[v] | m[v + 1] << 8;");
+            return "t";
+        case mode_iny:
+            line("t = m[" + hex(zp, 2) + "] + ry;");
+            if (penalty) {
+                line("cycles += t >> 8;");
+            }
+            line("t = (t + (m[" + hex((zp + 1) & 0xff, 2) +
+                 "] << 8)) & 0xffff;");
+            return "t";
+        default:
+            return "";
+        }
+    }
+
+    // the operand of a read: immediate, or memory at the address
+    std::string operand(t_op op, t_mode mode, std::uint32_t at) {
+        if (mode == mode_imm) {
+            return hex(image.at(at + 1), 2);
+        }
+        return "m[" + address(op, mode, at) + "]";
+    }
+
+    // a shift or rotate of v, a or memory
+    void shift(t_op op, t_mode mode, std::uint32_t at) {
+        std::string addr;
+        if (mode == mode_acc) {
+            line("v = ra;");
+        } else {
+            addr = address(op, mode, at);
+            line("v = m[" + addr + "];");
+        }
+        switch (op) {
+        case op_asl:
+            line("carry = v & 0x80;");
+            line("v <<= 1;");
+            break;
+        case op_lsr:
+            line("carry = v & 1;");
+            line("v >>= 1;");
+            break;
+        case op_rol:
+            line("{");
+            line("    bool ca = carry;");
+            line("    carry = v & 0x80;");
+            line("    v = v << 1 | ca;");
+            line("}");
+            break;
+        default:
+            line("{");
+            line("    bool ca = carry;");
+            line("    carry = v & 1;");
+            line("    v = v >> 1 | ca << 7;");
+            line("}");
+        }
+        if (mode == mode_acc) {
+            line("ra = v;");
+        } else {
+            store(addr, "v");
+        }
+        flags("v");
+    }
+
+    void branch(t_op op, std::uint32_t at) {
+        static const char* const conditions[] = {
+            "!carry", "carry", "!(nres & 0x80)", "nres & 0x80",
+            "zres", "!zres", "!overflow", "overflow"
+        };
+        auto target = (next + (signed char)(image.at(at + 1))) & 0xffff;
+        unsigned extra = 1 + ((target >> 8) != (next >> 8));
+        line(std::string("if (") + conditions[op - op_bcc] + ") {");
+        line("    cycles += " + std::to_string(extra) + ";");
+        line("    " + go(target));
+        line("}");
+        line(go(next));
+    }
+
+    // Writes the instruction at; false if it wrote the end of the block.
+    bool instruction(std::uint32_t at) {
+        auto opcode = image.at(at);
+        auto in = decode(opcode);
+        auto op = in.op;
+        auto mode = in.mode;
+        line("// " + hex(at, 4) + " " + op_names[op]);
+        switch (op) {
+        case op_lda:
+        case op_ldx:
+        case op_ldy: {
+            auto reg = op == op_lda ? "ra" : op == op_ldx ? "rx" : "ry";
+            line(std::string(reg) + " = " + operand(op, mode, at) + ";");
+            flags(reg);
+            break;
+        }
+        case op_sta:
+        case op_stx:
+        case op_sty:
+            store(address(op, mode, at),
+                  op == op_sta ? "ra" : op == op_stx ? "rx" : "ry");
+            break;
+        case op_tax: line("rx = ra;"); flags("rx"); break;
+        case op_tay: line("ry = ra;"); flags("ry"); break;
+        case op_txa: line("ra = rx;"); flags("ra"); break;
+        case op_tya: line("ra = ry;"); flags("ra"); break;
+        case op_tsx: line("rx = sp;"); flags("rx"); break;
+        case op_txs: line("sp = rx;"); break;
+        case op_pha: push("ra"); break;
+        case op_pla: pull("ra"); flags("ra"); break;
+        case op_php: push("(" + status() + " | 0x30)"); break;
+        case op_plp:
+            pull("v");
+            set_status("v");
+            line("pc = " + hex(next, 4) + ";");
+            line("if (c.irq && !(rp & 4)) goto out;");
+            line(go(next));
+            return false;
+        case op_and:
+        case op_eor:
+        case op_ora: {
+            auto sign = op == op_and ? " &= " : op == op_eor ? " ^= " : " |= ";
+            line("ra" + std::string(sign) + operand(op, mode, at) + ";");
+            flags("ra");
+            break;
+        }
+        case op_bit:
+            line("v = " + operand(op, mode, at) + ";");
+            line("zres = ra & v;");
+            line("nres = v;");
+            line("overflow = v & 0x40;");
+            break;
+        case op_inc:
+        case op_dec: {
+            auto addr = address(op, mode, at);
+            line("v = m[" + addr + "]" + (op == op_inc ? " + 1;" : " - 1;"));
+            store(addr, "v");
+            flags("v");
+            break;
+        }
+        case op_inx: line("rx++;"); flags("rx"); break;
+        case op_dex: line("rx--;"); flags("rx"); break;
+        case op_iny: line("ry++;"); flags("ry"); break;
+        case op_dey: line("ry--;"); flags("ry"); break;
+        case op_jmp:
+            if (mode == mode_abs) {
+                line(go(image.word(at + 1)));
+                return false;
+            }
+            line("t = " + hex(image.word(at + 1), 4) + ";");
+            line("pc = m[t] | m[(t + 1) & 0xffff] << 8;");
+            line("goto dispatch;");
+            return false;
+        case op_jsr: {
+            auto ret = at + 2;
+            auto target = image.word(at + 1);
+            push(hex(ret >> 8 & 0xff, 2));
+            push(hex(ret & 0xff, 2));
+            line("pc = " + hex(target, 4) + ";");
+            line("if (writes) goto out;");
+            line(go(target));
+            return false;
+        }
+        case op_rts:
+            pull("t");
+            pull("v");
+            line("pc = (t | v << 8) + 1;");
+            line("goto dispatch;");
+            return false;
+        case op_clc: line("carry = false;"); break;
+        case op_sec: line("carry = true;"); break;
+        case op_clv: line("overflow = false;"); break;
+        case op_cld: line("rp &= ~8;"); break;
+        case op_sed: line("rp |= 8;"); break;
+        case op_sei: line("rp |= 4;"); break;
+        case op_cli:
+            line("rp &= ~4;");
+            line("pc = " + hex(next, 4) + ";");
+            line("if (c.irq) goto out;");
+            line(go(next));
+            return false;
+        case op_brk: {
+            auto ret = at + 2;
+            push(hex(ret >> 8 & 0xff, 2));
+            push(hex(ret & 0xff, 2));
+            push("(" + status() + " | 0x30)");
+            line("pc = m[0xfffe] | m[0xffff] << 8;");
+            line("rp |= 0x14;");
+            line("if (writes) goto out;");
+            line("goto dispatch;");
+            return false;
+        }
+        case op_rti:
+            pull("v");
+            set_status("v");
+            pull("t");
+            pull("v");
+            line("pc = t | v << 8;");
+            line("if (c.irq && !(rp & 4)) goto out;");
+            line("goto dispatch;");
+            return false;
+        case op_nop:
+            break;
+        case op_asl:
+        case op_lsr:
+        case op_rol:
+        case op_ror:
+            shift(op, mode, at);
+            break;
+        case op_adc:
+        case op_sbc:
+            line(std::string(op == op_adc ? "recomp_adc" : "recomp_sbc") +
+                 "(ra, " + operand(op, mode, at) + ", carry, overflow);");
+            flags("ra");
+            break;
+        case op_cmp:
+        case op_cpx:
+        case op_cpy: {
+            auto reg = op == op_cmp ? "ra" : op == op_cpx ? "rx" : "ry";
+            line("v = " + operand(op, mode, at) + ";");
+            line(std::string("carry = ") + reg + " >= v;");
+            line(std::string("zres = nres = ") + reg + " - v;");
+            break;
+        }
+        default:
+            if (is_branch(op)) {
+                branch(op, at);
+                return false;
+            }
+        }
+        if (op == op_sta || op == op_stx || op == op_sty || op == op_pha ||
+            op == op_php || ((op == op_inc || op == op_dec ||
+                              op == op_asl || op == op_lsr ||
+                              op == op_rol || op == op_ror) &&
+                             mode != mode_acc)) {
+            end_after_store();
+        }
+        return true;
+    }
+
+    void block(std::size_t b) {
+        auto& block = blocks[b];
+        cycles_left = 0;
+        for (auto at : block.code) {
+            cycles_left += op_cycles[image.at(at)];
+        }
+        auto n = std::to_string(block.code.size());
+        os << "b" << b << ":\n";
+        line("if (budget < " + n + " || !live[" + std::to_string(b) + "]) {");
+        line("    pc = " + hex(block.start, 4) + ";");
+        line("    goto out;");
+        line("}");
+        line("budget -= " + n + ";");
+        line("cycles += " + std::to_string(cycles_left) + ";");
+        left = block.code.size();
+        for (auto at : block.code) {
+            left--;
+            cycles_left -= op_cycles[image.at(at)];
+            next = at + op_length[image.at(at)];
+            if (!instruction(at)) {
+                return;
+            }
+        }
+        // falls into the next block, or runs into code left out
+        line(go(next));
+    }
+
+public:
+    t_emitter(const t_image& i, const std::vector<t_block>& b,
+              std::ostream& o)
+        : image(i), blocks(b), os(o) {
+        for (std::size_t k = 0; k < blocks.size(); k++) {
+            index[blocks[k].start] = k;
+        }
+    }
+
+    void emit(const std::string& name) {
+        os << "// " << name << ", written by tools/recompile.cpp\n\n";
+        os << "#include \"recomp.hpp\"\n\nnamespace {\n\n";
+        os << "const t_recomp_block blocks[] = {\n";
+        for (auto& b : blocks) {
+            auto hash = recomp_hash(&image.bytes[b.start - image.load],
+                                    b.end - b.start);
+            os << "    {" << hex(b.start, 4) << ", " << hex(b.end, 4) << ", "
+               << hex(hash, 8) << "},\n";
+        }
+        os << "};\n\n";
+        os << "void run(t_recomp_ctx& c) {\n";
+        line("auto m = reinterpret_cast<unsigned char*>(c.mem);");
+        line("auto dirty = c.page_dirty;");
+        line("auto code_map = c.code_map;");
+        line("auto live = c.live;");
+        line("std::uint32_t pc = c.pc;");
+        line("unsigned char ra = c.ra;");
+        line("unsigned char rx = c.rx;");
+        line("unsigned char ry = c.ry;");
+        line("unsigned char sp = c.sp;");
+        line("unsigned char rp;");
+        line("bool carry;");
+        line("unsigned char zres;");
+        line("bool overflow;");
+        line("unsigned char nres;");
+        set_status("c.rp");
+        line("long budget = c.budget;");
+        line("std::uint64_t cycles = c.cycles;");
+        line("std::uint32_t written[3];");
+        line("unsigned writes = 0;");
+        line("unsigned t;");
+        line("unsigned char v;");
+        os << "dispatch:\n";
+        line("switch (pc) {");
+        for (std::size_t b = 0; b < blocks.size(); b++) {
+            line("case " + hex(blocks[b].start, 4) + ": goto b" +
+                 std::to_string(b) + ";");
+        }
+        line("}");
+        line("goto out;");
+        for (std::size_t b = 0; b < blocks.size(); b++) {
+            block(b);
+        }
+        os << "out:\n";
+        line("c.pc = pc;");
+        line("c.ra = ra;");
+        line("c.rx = rx;");
+        line("c.ry = ry;");
+        line("c.sp = sp;");
+        line("c.rp = " + status() + ";");
+        line("c.budget = budget;");
+        line("c.cycles = cycles;");
+        line("c.writes = writes;");
+        line("for (unsigned i = 0; i < writes; i++) {");
+        line("    c.written[i] = written[i];");
+        line("}");
+        os << "}\n\n}\n\n";
+        os << "extern const t_recompiled " << name << " = {\n";
+        line("blocks, sizeof(blocks) / sizeof(blocks[0]), run");
+        os << "};\n";
+    }
+};
+
+// Translates a binary image ahead of time into C++ for t_recompiled, see
+// t_machine::set_recompiled(), from the given entry points and the
+// interrupt vectors the image holds.
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        std::cerr << "usage : recompile <image> <load address> <name> "
+                     "<entry>...\n";
+        return 2;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in.good()) {
+        std::cerr << "cannot read : " << argv[1] << "\n";
+        return 1;
+    }
+    t_image image{{std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>()},
+                  std::uint32_t(std::strtoul(argv[2], nullptr, 0))};
+    if (image.load + image.bytes.size() > 0x10000) {
+        std::cerr << "image past $ffff : " << argv[1] << "\n";
+        return 1;
+    }
+    std::vector<std::uint32_t> entries;
+    for (int i = 4; i < argc; i++) {
+        entries.push_back(std::strtoul(argv[i], nullptr, 0) & 0xffff);
+    }
+    t_disassembly d(image, entries);
+    auto blocks = find_blocks(image, d);
+    t_emitter(image, blocks, std::cout).emit(argv[3]);
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include <iostream>
+
+#include "trace.hpp"
+
+// prints a trace file written by t_trace as text
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "usage : tracedump <trace file>\n";
+        return 2;
+    }
+    std::ios::sync_with_stdio(false);
+    if (!decode_trace(argv[1], std::cout)) {
+        std::cerr << "bad trace : " << argv[1] << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "opcodes.hpp"
+#include "trace.hpp"
+
+// A trace file starts with trace_magic. Each record is a byte of flags
+// followed by the fields they name, in this order:
+//   0x01  pc, low byte first, unless it follows the previous instruction
+//   0x02  a, when changed; likewise 0x04 x, 0x08 y, 0x10 s and 0x20 p
+//   0x40  cycles since the previous record, as a base 128 varint, unless
+//         they are the base cycles of the previous opcode; cycle counts
+//         are kept modulo 2^48 in the ring
+//   0x80  the instruction bytes, unless they are the same as the last ones
+//         recorded at that pc
+// A typical record takes two or three bytes.
+
+static const char trace_magic[8] = {'6', '5', '0', '2', 't', 'r', 'c', 1};
+
+static const std::uint64_t cycle_mask = 0xffffffffffffull;
+
+// what both ends expect of the next record
+struct t_codec {
+    std::uint32_t pc = 0x10000;
+    std::uint64_t cycles = 0;
+    unsigned delta = 0;
+    char regs[5] = {};
+    // instruction bytes last seen at each address, ~0u if none
+    std::vector<std::uint32_t> code =
+        std::vector<std::uint32_t>(0x10000, ~0u);
+
+    void next(std::uint32_t at, unsigned char op, std::uint64_t now,
+              const char* r) {
+        pc = (at + op_length[op]) & 0xffff;
+        cycles = now;
+        delta = op_cycles[op];
+        std::copy(r, r + 5, regs);
+    }
+};
+
+static const std::uint32_t length_mask[4] = {0, 0xff, 0xffff, 0xffffff};
+
+static std::uint32_t pack_code(const t_trace_record& r) {
+    auto op = (unsigned char)(r.op[0]);
+    std::uint32_t v = op | (unsigned char)(r.op[1]) << 8 |
+                      (unsigned char)(r.op[2]) << 16;
+    return v & length_mask[op_length[op]];
+}
+
+// Writes the record at o, at most 19 bytes, and returns the end. The
+// registers change at random, so they are stored whether or not they
+// changed and o only moves past the ones that did.
+static char* encode(t_codec& c, const t_trace_record& r, char* o) {
+    auto flags = o++;
+    std::uint32_t pc = r.pc_cycles >> 48;
+    unsigned jump = pc != c.pc;
+    o[0] = pc;
+    o[1] = pc >> 8;
+    o += 2 * jump;
+    unsigned f = jump;
+    for (int i = 0; i < 5; i++) {
+        unsigned changed = r.regs[i] != c.regs[i];
+        *o = r.regs[i];
+        o += changed;
+        f |= changed << (i + 1);
+    }
+    auto cycles = r.pc_cycles & cycle_mask;
+    auto delta = (cycles - c.cycles) & cycle_mask;
+    if (delta != c.delta) {
+        f |= 0x40;
+        for (; delta >= 0x80; delta >>= 7) {
+            *o++ = 0x80 | (delta & 0x7f);
+        }
+        *o++ = delta;
+    }
+    auto code = pack_code(r);
+    if (c.code[pc] != code) {
+        f |= 0x80;
+        c.code[pc] = code;
+        auto len = op_length[(unsigned char)(r.op[0])];
+        o = std::copy(r.op, r.op + len, o);
+    }
+    *flags = f;
+    c.next(pc, r.op[0], cycles, r.regs);
+    return o;
+}
+
+t_trace::t_trace() : mask(0), next(0), free_end(0), head(0), tail(0),
+                     done(false) {
+}
+
+t_trace::~t_trace() {
+    close();
+}
+
+// Starts a trace into the file, ending any trace already open, with a ring
+// of at least capacity records.
+bool t_trace::open(const std::string& file, std::size_t capacity) {
+    close();
+    out.open(file, std::ios::binary | std::ios::trunc);
+    if (!out.good()) {
+        return false;
+    }
+    out.write(trace_magic, sizeof(trace_magic));
+    std::size_t size = 0x100;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring.assign(size, t_trace_record());
+    mask = size - 1;
+    next = 0;
+    free_end = 0;
+    head = 0;
+    tail = 0;
+    done = false;
+    drain_thread = std::thread(&t_trace::drain, this);
+    return true;
+}
+
+void t_trace::close() {
+    if (!drain_thread.joinable()) {
+        return;
+    }
+    flush();
+    done.store(true, std::memory_order_release);
+    drain_thread.join();
+    out.close();
+}
+
+void t_trace::flush() {
+    head.store(next, std::memory_order_release);
+}
+
+std::uint64_t t_trace::get_count() {
+    return next;
+}
+
+// the ring is full: publish it all and wait for the drain to make room
+void t_trace::wait() {
+    flush();
+    while ((free_end = tail.load(std::memory_order_acquire) + ring.size()) ==
+           next) {
+        std::this_thread::yield();
+    }
+}
+
+void t_trace::drain() {
+    t_codec c;
+    std::vector<char> buf(0x20000);
+    auto o = buf.data();
+    auto t = tail.load(std::memory_order_relaxed);
+    while (true) {
+        // everything is published once done is seen
+        auto end = done.load(std::memory_order_acquire);
+        auto h = head.load(std::memory_order_acquire);
+        if (t == h) {
+            if (end) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        // give room back to record() often enough that it rarely waits
+        h = std::min(h, t + 0x1000);
+        for (; t != h; t++) {
+            o = encode(c, ring[t & mask], o);
+            // a record encodes to 18 bytes at most, so buf never overruns
+            if (o - buf.data() >= 0x10000) {
+                out.write(buf.data(), o - buf.data());
+                o = buf.data();
+            }
+        }
+        tail.store(t, std::memory_order_release);
+    }
+    out.write(buf.data(), o - buf.data());
+}
+
+// the instruction as an assembler would take it
+static std::string disassemble(std::uint32_t pc, const unsigned char* op) {
+    auto in = decode(op[0]);
+    unsigned abs = op[1] | op[2] << 8;
+    auto format = "%s";
+    unsigned arg = op[1];
+    switch (in.mode) {
+    case mode_imp: break;
+    case mode_acc: format = "%s a"; break;
+    case mode_imm: format = "%s #$%02x"; break;
+    case mode_rel:
+        format = "%s $%04x";
+        arg = (pc + 2 + (signed char)(op[1])) & 0xffff;
+        break;
+    case mode_zpg: format = "%s $%02x"; break;
+    case mode_zpx: format = "%s $%02x,x"; break;
+    case mode_zpy: format = "%s $%02x,y"; break;
+    case mode_abs: format = "%s $%04x"; arg = abs; break;
+    case mode_abx: format = "%s $%04x,x"; arg = abs; break;
+    case mode_aby: format = "%s $%04x,y"; arg = abs; break;
+    case mode_ind: format = "%s ($%04x)"; arg = abs; break;
+    case mode_inx: format = "%s ($%02x,x)"; break;
+    case mode_iny: format = "%s ($%02x),y"; break;
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), format, op_names[in.op], arg);
+    return text;
+}
+
+// Lines look like
+//   0400  d8        cld           a:00 x:00 y:00 p:24 sp:ff cyc:0
+bool decode_trace(const std::string& file, std::ostream& os) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[sizeof(trace_magic)];
+    if (!in.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), trace_magic)) {
+        return false;
+    }
+    auto src = in.rdbuf();
+    bool bad = false;
+    auto get = [&]() -> unsigned {
+        auto v = src->sbumpc();
+        bad = bad || v == std::char_traits<char>::eof();
+        return v & 0xff;
+    };
+    t_codec c;
+    char line[96];
+    while (src->sgetc() != std::char_traits<char>::eof()) {
+        auto flags = get();
+        auto pc = c.pc;
+        if (flags & 0x01) {
+            pc = get();
+            pc |= get() << 8;
+        }
+        char regs[5];
+        for (int i = 0; i < 5; i++) {
+            regs[i] = (flags & (0x02 << i)) ? get() : c.regs[i];
+        }
+        std::uint64_t delta = c.delta;
+        if (flags & 0x40) {
+            delta = 0;
+            for (int shift = 0; !bad; shift += 7) {
+                auto b = get();
+                delta |= std::uint64_t(b & 0x7f) << shift;
+                if (!(b & 0x80)) {
+                    break;
+                }
+            }
+        }
+        auto cycles = c.cycles + delta;
+        auto code = c.code[pc];
+        if (flags & 0x80) {
+            code = get();
+            auto len = op_length[code];
+            for (int i = 1; i < len; i++) {
+                code |= get() << (8 * i);
+            }
+            c.code[pc] = code;
+        }
+        if (bad || code == ~0u) {
+            return false;
+        }
+        unsigned char op[3] = {
+            (unsigned char)(code), (unsigned char)(code >> 8),
+            (unsigned char)(code >> 16)
+        };
+        char bytes[12];
+        switch (op_length[op[0]]) {
+        case 1: std::snprintf(bytes, sizeof(bytes), "%02x", op[0]); break;
+        case 2:
+            std::snprintf(bytes, sizeof(bytes), "%02x %02x", op[0], op[1]);
+            break;
+        default:
+            std::snprintf(bytes, sizeof(bytes), "%02x %02x %02x", op[0], op[1],
+                          op[2]);
+        }
+        std::snprintf(line, sizeof(line),
+                      "%04x  %-8s  %-13s a:%02x x:%02x y:%02x p:%02x sp:%02x "
+                      "cyc:%llu\n",
+                      unsigned(pc), bytes, disassemble(pc, op).c_str(),
+                      (unsigned char)(regs[0]), (unsigned char)(regs[1]),
+                      (unsigned char)(regs[2]), (unsigned char)(regs[4]),
+                      (unsigned char)(regs[3]), (unsigned long long)(cycles));
+        os << line;
+        c.next(pc, op[0], cycles, regs);
+    }
+    return true;
+}
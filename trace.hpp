@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// an instruction about to run: its address and bytes, the registers and the
+// cycle count before it, in 16 bytes
+struct t_trace_record {
+    std::uint64_t pc_cycles; // pc in the top 16 bits, cycles modulo 2^48
+    char op[3]; // opcode and operand bytes, as many as the opcode has
+    char regs[5]; // a, x, y, s and p
+};
+
+// Records instructions into a ring of fixed size, which a thread of its own
+// drains to a file, each record delta encoded against the one before; see
+// decode_trace(). There is a single producer, and record() only waits while
+// the ring is full. Records are published to the drain in batches, all of
+// them by flush() and close().
+class t_trace {
+    std::vector<t_trace_record> ring;
+    std::uint64_t mask;
+    std::uint64_t next; // records made
+    std::uint64_t free_end; // next may reach this without looking at tail
+    std::atomic<std::uint64_t> head; // records published
+    std::atomic<std::uint64_t> tail; // records written out
+    std::atomic<bool> done;
+    std::ofstream out;
+    std::thread drain_thread;
+
+    void wait();
+    void drain();
+
+public:
+    t_trace();
+    ~t_trace();
+    bool open(const std::string&, std::size_t);
+    void close();
+    void flush();
+    std::uint64_t get_count();
+    void record(std::uint32_t, char, char, char, char, char, char, char,
+                char, std::uint64_t);
+};
+
+// Writes a trace file as text, one instruction per line, and returns false
+// if the file cannot be read or is not a trace.
+bool decode_trace(const std::string&, std::ostream&);
+
+inline void t_trace::record(std::uint32_t pc, char op, char lo, char hi,
+                            char a, char x, char y, char s, char p,
+                            std::uint64_t cycles) {
+    if (next == free_end) {
+        wait();
+    }
+    // filled here and stored whole: a store of a char into the ring may
+    // alias anything, and would have ring and next read again after it
+    t_trace_record r;
+    r.pc_cycles = std::uint64_t(pc) << 48 | (cycles & 0xffffffffffffull);
+    r.op[0] = op;
+    r.op[1] = lo;
+    r.op[2] = hi;
+    r.regs[0] = a;
+    r.regs[1] = x;
+    r.regs[2] = y;
+    r.regs[3] = s;
+    r.regs[4] = p;
+    ring[next & mask] = r;
+    if ((++next & 0xff) == 0) {
+        head.store(next, std::memory_order_release);
+    }
+}